@@ -9,18 +9,20 @@ void sr_recv_arp_req(
   struct sr_instance* sr,
   sr_ethernet_hdr_t* e_hdr,
   sr_arp_hdr_t *arp_hdr,
-  char* iface
+  struct sr_if* iface
 );
 
 void sr_recv_arp_reply(
   struct sr_instance* sr,
   sr_ethernet_hdr_t* e_hdr,
   sr_arp_hdr_t *arp_hdr,
-  char* iface
+  struct sr_if* iface
 );
 
 void sr_handle_host_unreachable(struct sr_instance *sr, struct sr_arpreq *req);
 
+/* Fills in an ARP header in network byte order. sip and tip are expected in
+   network byte order, arp_op in host byte order. */
 void sr_init_arp_hdr(
   sr_arp_hdr_t *hdr,
   unsigned char *sha,
@@ -32,7 +34,4 @@ void sr_init_arp_hdr(
 
 sr_arp_hdr_t *sr_extract_arp_hdr(sr_ethernet_hdr_t *e_hdr);
 
-void sr_arp_hdr_ntoh(sr_arp_hdr_t *hdr);
-void sr_arp_hdr_hton(sr_arp_hdr_t *hdr);
-
 #endif
@@ -80,7 +80,12 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     
     /* If the IP wasn't found, add it */
     if (!req) {
-        req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
+        req = (struct sr_arpreq *) sr_slab_alloc(&(cache->req_slab));
+        if (!req) {
+            fprintf(stderr, "ARP request pool exhausted, dropping packet\n");
+            pthread_mutex_unlock(&(cache->lock));
+            return NULL;
+        }
         req->ip = ip;
         req->next = cache->requests;
         cache->requests = req;
@@ -88,15 +93,18 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     
     /* Add the packet to the list of packets for this request */
     if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
+        struct sr_packet *new_pkt = (struct sr_packet *)sr_slab_alloc(&(cache->pkt_slab));
         
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+        if (new_pkt) {
+            new_pkt->buf = (uint8_t *)malloc(packet_len);
+            memcpy(new_pkt->buf, packet, packet_len);
+            new_pkt->len = packet_len;
+            strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
+            new_pkt->next = req->packets;
+            req->packets = new_pkt;
+        } else {
+            fprintf(stderr, "ARP packet queue pool exhausted, dropping packet\n");
+        }
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -142,6 +150,7 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         cache->entries[i].ip = ip;
         cache->entries[i].added = time(NULL);
         cache->entries[i].valid = 1;
+        cache->generation++;
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -178,12 +187,10 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
             nxt = pkt->next;
             if (pkt->buf)
                 free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+            sr_slab_free(&(cache->pkt_slab), pkt);
         }
         
-        free(entry);
+        sr_slab_free(&(cache->req_slab), entry);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -205,13 +212,19 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
 }
 
 /* Initialize table + table lock. Returns 0 on success. */
-int sr_arpcache_init(struct sr_arpcache *cache) {  
+int sr_arpcache_init(struct sr_arpcache *cache, unsigned int max_reqs) {  
     /* Seed RNG to kick out a random entry if all entries full. */
     srand(time(NULL));
     
     /* Invalidate all entries */
     memset(cache->entries, 0, sizeof(cache->entries));
     cache->requests = NULL;
+    cache->generation = 0;
+
+    if (sr_slab_init(&(cache->req_slab), sizeof(struct sr_arpreq), max_reqs) != 0 ||
+        sr_slab_init(&(cache->pkt_slab), sizeof(struct sr_packet), max_reqs * SR_ARPCACHE_PKTS_PER_REQ) != 0) {
+        return -1;
+    }
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -223,6 +236,8 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    sr_slab_destroy(&(cache->req_slab));
+    sr_slab_destroy(&(cache->pkt_slab));
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
@@ -243,6 +258,7 @@ void *sr_arpcache_timeout(void *sr_ptr) {
         for (i = 0; i < SR_ARPCACHE_SZ; i++) {
             if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
                 cache->entries[i].valid = 0;
+                cache->generation++;
             }
         }
         
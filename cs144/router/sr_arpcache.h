@@ -70,14 +70,17 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_slab.h"
 
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPCACHE_DEFAULT_MAX_REQS 256
+#define SR_ARPCACHE_PKTS_PER_REQ 8 /* sizes the queued packet pool, not a per request limit */
 
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    char iface[sr_IFACE_NAMELEN]; /* The outgoing interface */
     struct sr_packet *next;
 };
 
@@ -102,6 +105,9 @@ struct sr_arpreq {
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
+    unsigned int generation;    /* Bumped whenever an entry is added or invalidated */
+    struct sr_slab req_slab;    /* Pending requests and their queued packets come */
+    struct sr_slab pkt_slab;    /* from fixed pools so ARP misses never malloc them */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -116,7 +122,9 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
    freed by the caller.
 
    A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   can remove the ARP request from the queue by calling sr_arpreq_destroy.
+   Returns NULL if the request pool is exhausted, in which case the packet is
+   dropped. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
@@ -143,7 +151,7 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
    a destructor, and a cleanup thread times out cache entries every 15
    seconds. */
 
-int   sr_arpcache_init(struct sr_arpcache *cache);
+int   sr_arpcache_init(struct sr_arpcache *cache, unsigned int max_reqs);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_egress.h"
+
+void *egress_transmit(void *egress_ptr);
+struct sr_egress_queue *egress_pick(struct sr_egress *egress, uint64_t now);
+struct sr_egress_slot *egress_head(struct sr_egress_queue *queue, uint64_t now);
+bool egress_codel_ok_to_drop(struct sr_egress_queue *queue, uint64_t now);
+void egress_pop(struct sr_egress_queue *queue);
+void egress_pace(struct sr_egress *egress, unsigned int len);
+uint64_t egress_now(void);
+
+void sr_egress_init(struct sr_instance *sr, unsigned int rate) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+  /* This runs from sr_connect_to_server, before sr_init sets up sr->attr */
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
+  pthread_attr_setscope(&thread_attr, PTHREAD_SCOPE_SYSTEM);
+
+  unsigned int i;
+  for (i = 0; i < sr->if_table.num_ifaces; i++) {
+    struct sr_if *iface = &(sr->if_table.ifaces[i]);
+    if (iface->egress != NULL) {
+      continue;
+    }
+
+    struct sr_egress *egress = calloc(1, sizeof(struct sr_egress));
+    if (egress == NULL) {
+      fprintf(stderr, "Unable to allocate egress queues for %s, sending unqueued\n", iface->name);
+      continue;
+    }
+
+    egress->sr = sr;
+    egress->iface = iface;
+    egress->rate = rate;
+    egress->queues[SR_EGRESS_NORMAL].quantum = 3 * SR_EGRESS_FRAME_MAX;
+    egress->queues[SR_EGRESS_BULK].quantum = SR_EGRESS_FRAME_MAX;
+    egress->drr_cur = SR_EGRESS_NORMAL;
+
+    pthread_mutex_init(&(egress->lock), &attr);
+    pthread_cond_init(&(egress->ready), NULL);
+    pthread_create(&(egress->thread), &thread_attr, egress_transmit, egress);
+
+    iface->egress = egress;
+  }
+
+  pthread_attr_destroy(&thread_attr);
+}
+
+int sr_egress_enqueue(struct sr_egress *egress, uint8_t *buf, unsigned int len) {
+  unsigned int cls = sr_egress_classify(buf, len);
+  struct sr_egress_queue *queue = &(egress->queues[cls]);
+
+  pthread_mutex_lock(&(egress->lock));
+
+  if (queue->count == SR_EGRESS_QUEUE_LEN) {
+    queue->tail_drops++;
+    pthread_mutex_unlock(&(egress->lock));
+    return -1;
+  }
+
+  struct sr_egress_slot *slot = &(queue->slots[(queue->head + queue->count) & (SR_EGRESS_QUEUE_LEN - 1)]);
+  memcpy(slot->frame, buf, len);
+  slot->len = len;
+  slot->enqueued = egress_now();
+  queue->count++;
+  queue->bytes += len;
+
+  pthread_cond_signal(&(egress->ready));
+  pthread_mutex_unlock(&(egress->lock));
+
+  return 0;
+}
+
+/* Anything that keeps a connection moving or reports on the network is small
+   and latency sensitive, so it jumps ahead of data */
+unsigned int sr_egress_classify(uint8_t *buf, unsigned int len) {
+  sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)buf;
+  if (ntohs(e_hdr->ether_type) != ethertype_ip || len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+    return SR_EGRESS_PRIO;
+  }
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+  unsigned int dscp = ip_hdr->ip_tos >> 2;
+  if (dscp == SR_EGRESS_DSCP_EF || dscp == SR_EGRESS_DSCP_CS6 || dscp == SR_EGRESS_DSCP_CS7) {
+    return SR_EGRESS_PRIO;
+  } else if (dscp == SR_EGRESS_DSCP_CS1) {
+    return SR_EGRESS_BULK;
+  }
+
+  if (ip_hdr->ip_p == ip_protocol_icmp) {
+    return SR_EGRESS_PRIO;
+  }
+
+  unsigned int ip_hl = ip_hdr->ip_hl * 4;
+  unsigned int ip_len = ntohs(ip_hdr->ip_len);
+  bool first_frag = (ntohs(ip_hdr->ip_off) & IP_OFFMASK) == 0;
+  if (ip_hdr->ip_p == ip_protocol_tcp && first_frag && ip_len >= ip_hl + sizeof(struct tcphdr) &&
+      len >= sizeof(sr_ethernet_hdr_t) + ip_hl + sizeof(struct tcphdr)) {
+    struct tcphdr *tcp_hdr = (struct tcphdr *)(((uint8_t *)ip_hdr) + ip_hl);
+    if (ip_len == ip_hl + tcp_hdr->doff * 4) {
+      return SR_EGRESS_PRIO;
+    }
+  }
+
+  return SR_EGRESS_NORMAL;
+}
+
+void sr_egress_print_stats(struct sr_instance *sr) {
+  const char *names[SR_EGRESS_CLASSES] = { "prio", "normal", "bulk" };
+
+  unsigned int i;
+  for (i = 0; i < sr->if_table.num_ifaces; i++) {
+    struct sr_egress *egress = sr->if_table.ifaces[i].egress;
+    if (egress == NULL) {
+      continue;
+    }
+
+    pthread_mutex_lock(&(egress->lock));
+
+    unsigned int cls;
+    for (cls = 0; cls < SR_EGRESS_CLASSES; cls++) {
+      struct sr_egress_queue *queue = &(egress->queues[cls]);
+      fprintf(stderr, "%s %s: %u queued, %lu sent, %lu tail drops, %lu codel drops\n",
+        egress->iface->name, names[cls], queue->count, queue->sent, queue->tail_drops, queue->codel_drops);
+
+      fprintf(stderr, "  sojourn us:");
+      unsigned int b;
+      for (b = 0; b < SR_EGRESS_HIST_BUCKETS; b++) {
+        if (queue->hist[b] == 0) {
+          continue;
+        }
+        if (b == SR_EGRESS_HIST_BUCKETS - 1) {
+          fprintf(stderr, " >=%u:%lu", 1u << (b - 1), queue->hist[b]);
+        } else {
+          fprintf(stderr, " <%u:%lu", 1u << b, queue->hist[b]);
+        }
+      }
+      fprintf(stderr, "\n");
+    }
+
+    pthread_mutex_unlock(&(egress->lock));
+  }
+}
+
+void *egress_transmit(void *egress_ptr) {
+  struct sr_egress *egress = (struct sr_egress *)egress_ptr;
+  uint8_t frame[SR_EGRESS_FRAME_MAX];
+
+  while (1) {
+    pthread_mutex_lock(&(egress->lock));
+
+    struct sr_egress_queue *queue;
+    while ((queue = egress_pick(egress, egress_now())) == NULL) {
+      pthread_cond_wait(&(egress->ready), &(egress->lock));
+    }
+
+    /* Frames are copied out so the socket write happens without the lock */
+    struct sr_egress_slot *slot = &(queue->slots[queue->head]);
+    unsigned int len = slot->len;
+    memcpy(frame, slot->frame, len);
+
+    uint64_t sojourn = (egress_now() - slot->enqueued) / 1000;
+    unsigned int bucket = 0;
+    while (bucket < SR_EGRESS_HIST_BUCKETS - 1 && sojourn >= (1ull << bucket)) {
+      bucket++;
+    }
+    queue->hist[bucket]++;
+    queue->sent++;
+    if (queue != &(egress->queues[SR_EGRESS_PRIO])) {
+      queue->deficit -= len;
+    }
+    egress_pop(queue);
+
+    pthread_mutex_unlock(&(egress->lock));
+
+    sr_write_packet_iface(egress->sr, frame, len, egress->iface);
+    egress_pace(egress, len);
+  }
+
+  return NULL;
+}
+
+/* Returns the queue whose head frame goes out next, or NULL if all are empty.
+   Must be called with the egress lock held. */
+struct sr_egress_queue *egress_pick(struct sr_egress *egress, uint64_t now) {
+  struct sr_egress_queue *prio = &(egress->queues[SR_EGRESS_PRIO]);
+  if (egress_head(prio, now) != NULL) {
+    return prio;
+  }
+
+  /* Every class gets its quantum at the start of its turn and keeps sending
+     until the head frame is bigger than its credit. Quanta are at least a
+     frame, so this settles within a round. */
+  unsigned int visits;
+  for (visits = 0; visits < 2 * SR_EGRESS_CLASSES; visits++) {
+    struct sr_egress_queue *queue = &(egress->queues[egress->drr_cur]);
+    struct sr_egress_slot *slot = egress_head(queue, now);
+
+    if (slot != NULL && !egress->drr_turn_started) {
+      queue->deficit += queue->quantum;
+      egress->drr_turn_started = true;
+    }
+
+    if (slot != NULL && (int)slot->len <= queue->deficit) {
+      return queue;
+    }
+
+    if (slot == NULL) {
+      queue->deficit = 0;
+    }
+
+    egress->drr_turn_started = false;
+    egress->drr_cur++;
+    if (egress->drr_cur == SR_EGRESS_CLASSES) {
+      egress->drr_cur = SR_EGRESS_NORMAL;
+    }
+  }
+
+  return NULL;
+}
+
+/* Returns the frame at the head of the queue after CoDel has dropped whatever
+   it wants to, or NULL if that leaves the queue empty (RFC 8289, 5.5) */
+struct sr_egress_slot *egress_head(struct sr_egress_queue *queue, uint64_t now) {
+  if (queue->count == 0) {
+    queue->dropping = false;
+    return NULL;
+  }
+
+  bool ok_to_drop = egress_codel_ok_to_drop(queue, now);
+
+  if (queue->dropping) {
+    if (!ok_to_drop) {
+      queue->dropping = false;
+    }
+    while (queue->dropping && now >= queue->drop_next) {
+      egress_pop(queue);
+      queue->codel_drops++;
+      queue->drop_count++;
+      if (queue->count == 0 || !egress_codel_ok_to_drop(queue, now)) {
+        queue->dropping = false;
+      } else {
+        queue->drop_next += SR_EGRESS_CODEL_INTERVAL / sqrt(queue->drop_count);
+      }
+    }
+  } else if (ok_to_drop) {
+    egress_pop(queue);
+    queue->codel_drops++;
+    queue->dropping = true;
+
+    /* Pick up near the old drop rate if we were dropping recently */
+    bool recent = queue->drop_count > 2 && now - queue->drop_next < 16 * SR_EGRESS_CODEL_INTERVAL;
+    queue->drop_count = recent ? queue->drop_count - 2 : 1;
+    queue->drop_next = now + SR_EGRESS_CODEL_INTERVAL / sqrt(queue->drop_count);
+  }
+
+  return queue->count > 0 ? &(queue->slots[queue->head]) : NULL;
+}
+
+bool egress_codel_ok_to_drop(struct sr_egress_queue *queue, uint64_t now) {
+  uint64_t sojourn = now - queue->slots[queue->head].enqueued;
+
+  /* A queue holding less than a frame can't be a standing queue */
+  if (sojourn < SR_EGRESS_CODEL_TARGET || queue->bytes <= SR_EGRESS_FRAME_MAX) {
+    queue->first_above = 0;
+    return false;
+  }
+
+  if (queue->first_above == 0) {
+    queue->first_above = now + SR_EGRESS_CODEL_INTERVAL;
+    return false;
+  }
+
+  return now >= queue->first_above;
+}
+
+void egress_pop(struct sr_egress_queue *queue) {
+  queue->bytes -= queue->slots[queue->head].len;
+  queue->head = (queue->head + 1) & (SR_EGRESS_QUEUE_LEN - 1);
+  queue->count--;
+}
+
+/* Sleeps for as long as the frame would take on a link of the configured rate */
+void egress_pace(struct sr_egress *egress, unsigned int len) {
+  if (egress->rate == 0) {
+    return;
+  }
+
+  uint64_t ns = (uint64_t)len * 8 * 1000000 / egress->rate;
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  nanosleep(&ts, NULL);
+}
+
+uint64_t egress_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,88 @@
+#ifndef SR_EGRESS_H
+#define SR_EGRESS_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "sr_protocol.h"
+#include "sr_if.h"
+
+struct sr_instance;
+
+/* Traffic classes, in the order the scheduler considers them */
+#define SR_EGRESS_PRIO 0 /* ARP, ICMP, bare TCP control segments, DSCP EF/CS6/CS7 */
+#define SR_EGRESS_NORMAL 1
+#define SR_EGRESS_BULK 2 /* DSCP CS1 (lower effort) */
+#define SR_EGRESS_CLASSES 3
+
+#define SR_EGRESS_QUEUE_LEN 128 /* frames per class, must be a power of 2 */
+#define SR_EGRESS_FRAME_MAX (sizeof(sr_ethernet_hdr_t) + SR_IFACE_MTU)
+#define SR_EGRESS_HIST_BUCKETS 16 /* bucket i counts sojourn times < 2^i us, the last everything else */
+
+/* CoDel parameters (RFC 8289) */
+#define SR_EGRESS_CODEL_TARGET 5000000ull /* ns of standing queue delay tolerated */
+#define SR_EGRESS_CODEL_INTERVAL 100000000ull /* ns the delay must persist before dropping */
+
+#define SR_EGRESS_DSCP_CS1 8
+#define SR_EGRESS_DSCP_EF 46
+#define SR_EGRESS_DSCP_CS6 48
+#define SR_EGRESS_DSCP_CS7 56
+
+struct sr_egress_slot {
+  uint64_t enqueued; /* CLOCK_MONOTONIC ns */
+  unsigned int len;
+  uint8_t frame[SR_EGRESS_FRAME_MAX];
+};
+
+/* A bounded FIFO for one class. New frames are tail dropped once it is full,
+   and CoDel drops from the head while the queue stays above its target delay. */
+struct sr_egress_queue {
+  struct sr_egress_slot slots[SR_EGRESS_QUEUE_LEN];
+  unsigned int head;
+  unsigned int count;
+  unsigned int bytes;
+
+  int deficit; /* DRR credit in bytes */
+  unsigned int quantum;
+
+  /* CoDel state */
+  bool dropping;
+  unsigned int drop_count;
+  uint64_t first_above; /* when the delay may first be acted on, 0 if below target */
+  uint64_t drop_next;
+
+  unsigned long sent;
+  unsigned long tail_drops;
+  unsigned long codel_drops;
+  unsigned long hist[SR_EGRESS_HIST_BUCKETS]; /* sojourn times of sent frames */
+};
+
+/* The priority class is always served first. The other classes share what is
+   left by deficit round robin, NORMAL getting three times the quantum of BULK.
+   A thread per interface drains the queues, optionally paced to a fixed rate. */
+struct sr_egress {
+  struct sr_instance *sr;
+  struct sr_if *iface;
+  struct sr_egress_queue queues[SR_EGRESS_CLASSES];
+  unsigned int drr_cur; /* DRR class whose turn it is */
+  bool drr_turn_started;
+  unsigned int rate; /* kbit/s, 0 to send as fast as the socket takes frames */
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_t thread;
+};
+
+/* Creates an egress queue and transmit thread for every interface that
+   doesn't have one yet. Called once VNS has told us about the interfaces. */
+void sr_egress_init(struct sr_instance *sr, unsigned int rate);
+
+/* Queues a copy of the frame. Returns 0 if it was queued, -1 if it was dropped. */
+int sr_egress_enqueue(struct sr_egress *egress, uint8_t *buf, unsigned int len);
+
+unsigned int sr_egress_classify(uint8_t *buf, unsigned int len);
+
+void sr_egress_print_stats(struct sr_instance *sr);
+
+#endif /* -- SR_EGRESS_H -- */
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_icmp.h"
+#include "sr_flow.h"
+#include "sr_utils.h"
+
+struct sr_flow_cache *flow_cache_get(void);
+void flow_cache_create_key(void);
+unsigned int flow_hash(struct sr_flow_key *key);
+bool flow_entry_current(struct sr_instance *sr, struct sr_flow_entry *entry, time_t now);
+unsigned int flow_nat_generation(struct sr_instance *sr);
+
+pthread_once_t flow_cache_once = PTHREAD_ONCE_INIT;
+pthread_key_t flow_cache_key;
+
+bool sr_flow_key_init(struct sr_flow_key *key, struct sr_pkt_desc *desc) {
+  if (desc->l4_hdr == NULL || (desc->ip_off & IP_MF)) {
+    return false;
+  }
+
+  if (desc->ip_p == ip_protocol_tcp && (desc->tcp_flags & (TH_SYN | TH_FIN | TH_RST))) {
+    return false;
+  }
+
+  if (desc->ip_p == ip_protocol_icmp && desc->icmp_type != ECHO_REQUEST && desc->icmp_type != ECHO_REPLY) {
+    return false;
+  }
+
+  /* Zeroed so that keys can be compared with memcmp */
+  memset(key, 0, sizeof(struct sr_flow_key));
+  key->ip_src = desc->ip_src;
+  key->ip_dst = desc->ip_dst;
+  key->aux_src = desc->aux_src;
+  key->aux_dst = desc->aux_dst;
+  key->ip_p = desc->ip_p;
+  key->iface = desc->iface;
+
+  return true;
+}
+
+bool sr_flow_cache_forward(struct sr_instance *sr, struct sr_flow_key *key, struct sr_pkt_desc *desc) {
+  if (desc->ip_ttl <= 1) {
+    return false;
+  }
+
+  struct sr_flow_entry *entry = &(flow_cache_get()->entries[flow_hash(key)]);
+  if (!entry->valid || memcmp(&(entry->key), key, sizeof(struct sr_flow_key)) != 0 ||
+      desc->ip_len > entry->mtu || !flow_entry_current(sr, entry, time(NULL))) {
+    return false;
+  }
+
+  sr_ip_hdr_t *ip_hdr = desc->ip_hdr;
+  ip_hdr->ip_ttl--;
+  ip_hdr->ip_src = entry->ip_src;
+  ip_hdr->ip_dst = entry->ip_dst;
+  ip_hdr->ip_sum = cksum_apply_delta(ip_hdr->ip_sum, entry->ip_sum_delta);
+
+  if (entry->rewrite_l4 && desc->ip_p == ip_protocol_tcp) {
+    struct tcphdr *tcp_hdr = (struct tcphdr *)desc->l4_hdr;
+    tcp_hdr->source = entry->aux_src;
+    tcp_hdr->dest = entry->aux_dst;
+    tcp_hdr->check = cksum_apply_delta(tcp_hdr->check, entry->l4_sum_delta);
+  } else if (entry->rewrite_l4 && desc->ip_p == ip_protocol_icmp) {
+    sr_icmp_t3_hdr_t *icmp_hdr = (sr_icmp_t3_hdr_t *)desc->l4_hdr;
+    icmp_hdr->iden = entry->aux_src;
+    icmp_hdr->icmp_sum = cksum_apply_delta(icmp_hdr->icmp_sum, entry->l4_sum_delta);
+  }
+
+  sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)desc->buf;
+  memcpy(e_hdr->ether_shost, entry->ether_shost, ETHER_ADDR_LEN);
+  memcpy(e_hdr->ether_dhost, entry->ether_dhost, ETHER_ADDR_LEN);
+
+  sr_send_packet_iface(sr, desc->buf, sizeof(sr_ethernet_hdr_t) + desc->ip_len,
+    sr_get_interface_by_idx(sr, entry->egress));
+
+  return true;
+}
+
+void sr_flow_cache_learn(struct sr_instance *sr, struct sr_flow_key *key, struct sr_pkt_desc *desc, unsigned int egress) {
+  struct sr_flow_entry *entry = &(flow_cache_get()->entries[flow_hash(key)]);
+  sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)desc->buf;
+
+  memcpy(&(entry->key), key, sizeof(struct sr_flow_key));
+
+  uint32_t ip_src_delta = cksum_delta32(htonl(key->ip_src), htonl(desc->ip_src));
+  uint32_t ip_dst_delta = cksum_delta32(htonl(key->ip_dst), htonl(desc->ip_dst));
+
+  entry->ip_src = htonl(desc->ip_src);
+  entry->ip_dst = htonl(desc->ip_dst);
+  entry->aux_src = htons(desc->aux_src);
+  entry->aux_dst = htons(desc->aux_dst);
+
+  /* Decrementing the TTL subtracts 0x0100 from its 16 bit word whatever the
+     TTL is, so its share of the delta is the same for every packet */
+  entry->ip_sum_delta = ip_src_delta + ip_dst_delta + cksum_delta16(htons(1 << 8), 0);
+
+  /* Only the NAT rewrites transport hdrs, and it only handles TCP and ICMP */
+  entry->rewrite_l4 = false;
+  entry->l4_sum_delta = 0;
+  if (desc->ip_p == ip_protocol_tcp) {
+    entry->rewrite_l4 = true;
+    entry->l4_sum_delta = ip_src_delta + ip_dst_delta +
+      cksum_delta16(htons(key->aux_src), htons(desc->aux_src)) +
+      cksum_delta16(htons(key->aux_dst), htons(desc->aux_dst));
+  } else if (desc->ip_p == ip_protocol_icmp) {
+    entry->rewrite_l4 = true;
+    entry->l4_sum_delta = cksum_delta16(htons(key->aux_src), htons(desc->aux_src));
+  }
+
+  memcpy(entry->ether_shost, e_hdr->ether_shost, ETHER_ADDR_LEN);
+  memcpy(entry->ether_dhost, e_hdr->ether_dhost, ETHER_ADDR_LEN);
+  entry->egress = egress;
+  entry->mtu = sr_get_interface_by_idx(sr, egress)->mtu;
+
+  entry->nat_generation = flow_nat_generation(sr);
+  entry->arp_generation = sr->cache.generation;
+  entry->rt_generation = sr->rt_generation;
+  entry->learned = time(NULL);
+  entry->valid = true;
+}
+
+bool flow_entry_current(struct sr_instance *sr, struct sr_flow_entry *entry, time_t now) {
+  return entry->nat_generation == flow_nat_generation(sr) &&
+    entry->arp_generation == sr->cache.generation &&
+    entry->rt_generation == sr->rt_generation &&
+    difftime(now, entry->learned) < SR_FLOW_REFRESH;
+}
+
+unsigned int flow_nat_generation(struct sr_instance *sr) {
+  return sr->nat != NULL ? sr_nat_generation(sr->nat) : 0;
+}
+
+unsigned int flow_hash(struct sr_flow_key *key) {
+  uint32_t h = key->ip_src * 2654435761u;
+  h ^= key->ip_dst * 2246822519u;
+  h ^= ((uint32_t)key->aux_src << 16 | key->aux_dst) * 3266489917u;
+  h ^= key->ip_p | key->iface << 8;
+
+  h ^= h >> 15;
+  return h & (SR_FLOW_CACHE_SZ - 1);
+}
+
+void flow_cache_create_key(void) {
+  pthread_key_create(&flow_cache_key, free);
+}
+
+/* Each thread's cache is allocated the first time that thread forwards a packet */
+struct sr_flow_cache *flow_cache_get(void) {
+  pthread_once(&flow_cache_once, flow_cache_create_key);
+
+  struct sr_flow_cache *cache = pthread_getspecific(flow_cache_key);
+  if (cache == NULL) {
+    cache = calloc(1, sizeof(struct sr_flow_cache));
+    pthread_setspecific(flow_cache_key, cache);
+  }
+
+  return cache;
+}
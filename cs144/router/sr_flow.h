@@ -0,0 +1,69 @@
+#ifndef SR_FLOW_H
+#define SR_FLOW_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_pkt.h"
+
+#define SR_FLOW_CACHE_SZ 1024 /* # of entries per thread, must be a power of 2 */
+#define SR_FLOW_REFRESH 1 /* seconds before a cached flow is sent through the slow path again */
+
+/* Identifies a flow as it arrives, before any NAT translation */
+struct sr_flow_key {
+  uint32_t ip_src;
+  uint32_t ip_dst;
+  uint16_t aux_src;
+  uint16_t aux_dst;
+  uint8_t ip_p;
+  unsigned int iface; /* ingress interface index */
+};
+
+/* Everything the slow path decided for a flow, replayed on a cache hit.
+   Addresses, ports and checksum deltas are in network byte order. */
+struct sr_flow_entry {
+  bool valid;
+  struct sr_flow_key key;
+
+  uint32_t ip_src;
+  uint32_t ip_dst;
+  uint16_t aux_src;
+  uint16_t aux_dst;
+  bool rewrite_l4; /* whether the transport hdr needs rewriting */
+  uint32_t ip_sum_delta; /* covers the TTL decrement and any address rewrite */
+  uint32_t l4_sum_delta;
+  uint8_t ether_shost[ETHER_ADDR_LEN];
+  uint8_t ether_dhost[ETHER_ADDR_LEN];
+  unsigned int egress; /* egress interface index */
+  uint32_t mtu; /* bigger packets take the slow path to be fragmented */
+
+  /* The entry is only used while none of the tables it was built from have
+     changed, and for at most SR_FLOW_REFRESH seconds so the NAT keeps seeing
+     the flow and its timers keep getting refreshed. */
+  unsigned int nat_generation;
+  unsigned int arp_generation;
+  unsigned int rt_generation;
+  time_t learned;
+};
+
+/* Direct-mapped, so a lookup is a single probe. Each thread that forwards
+   packets gets its own cache, so no locking is needed. */
+struct sr_flow_cache {
+  struct sr_flow_entry entries[SR_FLOW_CACHE_SZ];
+};
+
+/* Fills in key for the packet. Returns false if the packet must always take
+   the slow path (fragments, TCP SYN/FIN/RST, non-echo ICMP, ...). */
+bool sr_flow_key_init(struct sr_flow_key *key, struct sr_pkt_desc *desc);
+
+/* Forwards the packet using a cached action. Returns false on a miss, in
+   which case the packet is untouched. */
+bool sr_flow_cache_forward(struct sr_instance *sr, struct sr_flow_key *key, struct sr_pkt_desc *desc);
+
+/* Records the action the slow path just took for a forwarded packet. desc and
+   the frame must reflect the packet as it was sent out of egress. */
+void sr_flow_cache_learn(struct sr_instance *sr, struct sr_flow_key *key, struct sr_pkt_desc *desc, unsigned int egress);
+
+#endif /* -- SR_FLOW_H -- */
@@ -25,6 +25,9 @@
 #include "sr_if.h"
 #include "sr_router.h"
 
+unsigned int if_name_hash(const char* name);
+void if_table_index_ips(struct sr_if_table* table);
+
 /*--------------------------------------------------------------------- 
  * Method: sr_get_interface
  * Scope: Global
@@ -36,24 +39,71 @@
 
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 {
-    struct sr_if* if_walker = 0;
+    struct sr_if_table* table = 0;
+    unsigned int slot;
+    unsigned int i;
 
     /* -- REQUIRES -- */
     assert(name);
     assert(sr);
 
-    if_walker = sr->if_list;
+    table = &(sr->if_table);
+    slot = if_name_hash(name);
 
-    while(if_walker)
+    for(i = 0; i < SR_IF_NAME_SLOTS; i++)
     {
-       if(!strncmp(if_walker->name,name,sr_IFACE_NAMELEN))
-        { return if_walker; }
-        if_walker = if_walker->next;
+        int idx = table->name_slots[slot] - 1;
+        if(idx < 0)
+        { return 0; }
+        if(!strncmp(table->ifaces[idx].name,name,sr_IFACE_NAMELEN))
+        { return &(table->ifaces[idx]); }
+        slot = (slot + 1) & (SR_IF_NAME_SLOTS - 1);
     }
 
     return 0;
 } /* -- sr_get_interface -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_interface_by_idx
+ * Scope: Global
+ *
+ * Return the interface record at idx in the interface table
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface_by_idx(struct sr_instance* sr, unsigned int idx)
+{
+    assert(idx < sr->if_table.num_ifaces);
+    return &(sr->if_table.ifaces[idx]);
+} /* -- sr_get_interface_by_idx -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_is_local_ip
+ * Scope: Global
+ *
+ * Return true if ip_nbo is the address of one of the router's interfaces
+ *
+ *---------------------------------------------------------------------*/
+
+bool sr_is_local_ip(struct sr_instance* sr, uint32_t ip_nbo)
+{
+    uint32_t* local_ips = sr->if_table.local_ips;
+    unsigned int slot = (ip_nbo * 2654435761u) & (SR_LOCAL_IP_SLOTS - 1);
+    unsigned int i;
+
+    if(ip_nbo == 0)
+    { return false; }
+
+    for(i = 0; i < SR_LOCAL_IP_SLOTS && local_ips[slot] != 0; i++)
+    {
+        if(local_ips[slot] == ip_nbo)
+        { return true; }
+        slot = (slot + 1) & (SR_LOCAL_IP_SLOTS - 1);
+    }
+
+    return false;
+} /* -- sr_is_local_ip -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_add_interface(..)
  * Scope: Global
@@ -64,32 +114,36 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 
 void sr_add_interface(struct sr_instance* sr, const char* name)
 {
-    struct sr_if* if_walker = 0;
+    struct sr_if_table* table = 0;
+    struct sr_if* iface = 0;
+    unsigned int slot;
 
     /* -- REQUIRES -- */
     assert(name);
     assert(sr);
 
-    /* -- empty list special case -- */
-    if(sr->if_list == 0)
-    {
-        sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
-        assert(sr->if_list);
-        sr->if_list->next = 0;
-        strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
-        return;
-    }
+    table = &(sr->if_table);
+    assert(table->num_ifaces < SR_MAX_IFACES);
 
-    /* -- find the end of the list -- */
-    if_walker = sr->if_list;
-    while(if_walker->next)
-    {if_walker = if_walker->next; }
+    iface = &(table->ifaces[table->num_ifaces]);
+    memset(iface, 0, sizeof(struct sr_if));
+    strncpy(iface->name,name,sr_IFACE_NAMELEN);
+    iface->mtu = SR_IFACE_MTU;
+    iface->idx = table->num_ifaces;
+    iface->internal = strncmp(name,INTERNAL_IFACE,sr_IFACE_NAMELEN) == 0;
 
-    if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
-    assert(if_walker->next);
-    if_walker = if_walker->next;
-    strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
-    if_walker->next = 0;
+    slot = if_name_hash(name);
+    while(table->name_slots[slot] != 0)
+    { slot = (slot + 1) & (SR_IF_NAME_SLOTS - 1); }
+    table->name_slots[slot] = iface->idx + 1;
+
+    /* -- keep the list links for code that walks if_list -- */
+    if(table->num_ifaces == 0)
+    { sr->if_list = iface; }
+    else
+    { table->ifaces[table->num_ifaces - 1].next = iface; }
+
+    table->num_ifaces++;
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
@@ -102,17 +156,13 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
 
 void sr_set_ether_addr(struct sr_instance* sr, const unsigned char* addr)
 {
-    struct sr_if* if_walker = 0;
+    struct sr_if_table* table = &(sr->if_table);
 
     /* -- REQUIRES -- */
-    assert(sr->if_list);
-    
-    if_walker = sr->if_list;
-    while(if_walker->next)
-    {if_walker = if_walker->next; }
+    assert(table->num_ifaces > 0);
 
     /* -- copy address -- */
-    memcpy(if_walker->addr,addr,6);
+    memcpy(table->ifaces[table->num_ifaces - 1].addr,addr,6);
 
 } /* -- sr_set_ether_addr -- */
 
@@ -126,20 +176,50 @@ void sr_set_ether_addr(struct sr_instance* sr, const unsigned char* addr)
 
 void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 {
-    struct sr_if* if_walker = 0;
+    struct sr_if_table* table = &(sr->if_table);
 
     /* -- REQUIRES -- */
-    assert(sr->if_list);
-    
-    if_walker = sr->if_list;
-    while(if_walker->next)
-    {if_walker = if_walker->next; }
+    assert(table->num_ifaces > 0);
 
     /* -- copy address -- */
-    if_walker->ip = ip_nbo;
+    table->ifaces[table->num_ifaces - 1].ip = ip_nbo;
+
+    if_table_index_ips(table);
 
 } /* -- sr_set_ether_ip -- */
 
+unsigned int if_name_hash(const char* name)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for(i = 0; i < sr_IFACE_NAMELEN && name[i] != '\0'; i++)
+    { h = (h ^ (uint8_t)name[i]) * 16777619u; }
+
+    return h & (SR_IF_NAME_SLOTS - 1);
+}
+
+/* Rebuilt from scratch since addresses are only set while starting up */
+void if_table_index_ips(struct sr_if_table* table)
+{
+    unsigned int i;
+
+    memset(table->local_ips, 0, sizeof(table->local_ips));
+
+    for(i = 0; i < table->num_ifaces; i++)
+    {
+        uint32_t ip_nbo = table->ifaces[i].ip;
+        unsigned int slot = (ip_nbo * 2654435761u) & (SR_LOCAL_IP_SLOTS - 1);
+
+        if(ip_nbo == 0)
+        { continue; }
+
+        while(table->local_ips[slot] != 0 && table->local_ips[slot] != ip_nbo)
+        { slot = (slot + 1) & (SR_LOCAL_IP_SLOTS - 1); }
+        table->local_ips[slot] = ip_nbo;
+    }
+}
+
 /*--------------------------------------------------------------------- 
  * Method: sr_print_if_list(..)
  * Scope: Global
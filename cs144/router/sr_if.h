@@ -24,9 +24,17 @@
 #include <inttypes.h>
 #endif
 
+#include <stdbool.h>
+
 #include "sr_protocol.h"
 
+#define SR_IFACE_MTU 1500 /* VNS doesn't report an MTU, so assume ethernet's */
+#define SR_MAX_IFACES 16
+#define SR_IF_NAME_SLOTS 32 /* must be a power of 2 */
+#define SR_LOCAL_IP_SLOTS 64 /* must be a power of 2 */
+
 struct sr_instance;
+struct sr_egress;
 
 /* ----------------------------------------------------------------------------
  * struct sr_if
@@ -41,10 +49,33 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  uint32_t mtu; /* largest IP packet that can be sent without fragmenting */
+  unsigned int idx; /* position in the interface table */
+  bool internal; /* on the NAT's internal side */
+  struct sr_egress* egress; /* frames wait here to be sent, NULL to send directly */
   struct sr_if* next;
 };
 
+/* ----------------------------------------------------------------------------
+ * struct sr_if_table
+ *
+ * Interfaces are stored densely and referred to by index once a packet has
+ * been received, so the per-packet path never compares names. The records are
+ * still linked through next for code that walks sr->if_list.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_if_table
+{
+  struct sr_if ifaces[SR_MAX_IFACES];
+  unsigned int num_ifaces;
+  int name_slots[SR_IF_NAME_SLOTS]; /* open addressed, holds idx + 1, 0 if empty */
+  uint32_t local_ips[SR_LOCAL_IP_SLOTS]; /* open addressed, nbo, 0 if empty */
+};
+
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
+struct sr_if* sr_get_interface_by_idx(struct sr_instance* sr, unsigned int idx);
+bool sr_is_local_ip(struct sr_instance* sr, uint32_t ip_nbo);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
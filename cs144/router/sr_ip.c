@@ -8,12 +8,16 @@
 #include "sr_icmp.h"
 #include "sr_ip.h"
 #include "sr_eth.h"
+#include "sr_pkt.h"
+#include "sr_flow.h"
 #include "sr_protocol.h"
 #include "sr_router.h"
 #include "sr_rt.h"
 #include "sr_utils.h"
 
 int get_prefix_len(unsigned long mask);
+void frwd_ip_pkt_to_next_hop(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, struct sr_rt *rt_entry, struct sr_if **egress);
+void frwd_ip_pkt_in_fragments(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, struct sr_rt *rt_entry, unsigned int mtu);
 
 bool sr_ip_checksum_matches(sr_ip_hdr_t *ip_hdr) {
   uint16_t ip_hdr_len = ip_hdr->ip_hl * 4;
@@ -34,21 +38,56 @@ bool sr_ip_checksum_matches(sr_ip_hdr_t *ip_hdr) {
   }
 }
 
-void sr_recv_tcp_or_udp_pkt_for_us(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, sr_ip_hdr_t* ip_hdr) {
-  sr_send_icmp_unreachable_pkt(sr, PORT_UNREACHABLE, ip_hdr);
+void sr_recv_tcp_or_udp_pkt_for_us(struct sr_instance* sr, struct sr_pkt_desc *desc) {
+  sr_send_icmp_unreachable_pkt(sr, PORT_UNREACHABLE, desc->ip_hdr);
 }
- 
-void sr_recv_ip_pkt_for_other(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, sr_ip_hdr_t* ip_hdr) {
-  ip_hdr->ip_ttl--;
 
-  if (ip_hdr->ip_ttl == 0) {
-    sr_send_icmp_time_exceeded_pkt(sr, TTL_EXCEEDED, ip_hdr); 
+/* Returns true if the packet would expire on its next hop, in which case a
+   time exceeded has already been sent back to its source. */
+bool sr_ip_ttl_expired(struct sr_instance* sr, struct sr_pkt_desc *desc) {
+  if (desc->ip_ttl > 1) {
+    return false;
+  }
+
+  sr_send_icmp_time_exceeded_pkt(sr, TTL_EXCEEDED, desc->ip_hdr);
+  return true;
+}
+
+/* Returns true if the packet has DF set and is too big for the interface it
+   would leave on, in which case a fragmentation needed has already been sent
+   back to its source. Packets without a route are left to sr_frwd_ip_pkt. */
+bool sr_ip_frag_needed(struct sr_instance* sr, struct sr_pkt_desc *desc) {
+  if (!(desc->ip_off & IP_DF)) {
+    return false;
+  }
+
+  struct sr_rt *rt_entry = sr_find_longest_prefix_match(sr, htonl(desc->ip_dst));
+  if (rt_entry == NULL || rt_entry->if_idx < 0) {
+    return false;
+  }
+
+  struct sr_if *rt_iface = sr_get_interface_by_idx(sr, rt_entry->if_idx);
+  if (desc->ip_len <= rt_iface->mtu) {
+    return false;
+  }
+
+  sr_send_icmp_frag_needed_pkt(sr, rt_iface->mtu, desc->ip_hdr);
+  return true;
+}
+ 
+void sr_recv_ip_pkt_for_other(struct sr_instance* sr, struct sr_pkt_desc *desc, struct sr_flow_key *flow_key) {
+  if (sr_ip_ttl_expired(sr, desc)) {
     return;
   }
+
+  sr_pkt_dec_ttl(desc);
  
-  int resp = sr_frwd_ip_pkt(sr, e_hdr);
+  struct sr_if *egress = NULL;
+  int resp = sr_frwd_ip_pkt(sr, (sr_ethernet_hdr_t *)desc->buf, &egress);
   if (resp == -1) {
-    sr_send_icmp_unreachable_pkt(sr, NET_UNREACHABLE, ip_hdr);
+    sr_send_icmp_unreachable_pkt(sr, NET_UNREACHABLE, desc->ip_hdr);
+  } else if (flow_key != NULL && egress != NULL) {
+    sr_flow_cache_learn(sr, flow_key, desc, egress->idx);
   }
 }
 
@@ -64,7 +103,7 @@ void sr_create_and_frwd_ip_pkt(
   uint8_t e_frame[e_len];
 
   sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)e_frame;
-  e_hdr->ether_type = ethertype_ip;
+  e_hdr->ether_type = htons(ethertype_ip);
 
   sr_ip_hdr_t *ip_hdr = sr_extract_ip_hdr(e_hdr);
   sr_init_ip_hdr(ip_hdr, ip_src, ip_dst, payload_len, protocol);
@@ -72,52 +111,113 @@ void sr_create_and_frwd_ip_pkt(
   uint8_t *ip_payload = ((uint8_t *)ip_hdr) + sizeof(sr_ip_hdr_t); 
   memcpy(ip_payload, payload, payload_len);
 
-  sr_frwd_ip_pkt(sr, e_hdr);
+  sr_frwd_ip_pkt(sr, e_hdr, NULL);
 }
 
-int sr_frwd_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr) {
+int sr_frwd_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, struct sr_if **egress) {
   sr_ip_hdr_t *ip_hdr = sr_extract_ip_hdr(e_hdr);
-  struct sr_rt *rt_entry = sr_find_longest_prefix_match(sr, htonl(ip_hdr->ip_dst));
-  if (rt_entry == NULL) {
+  struct sr_rt *rt_entry = sr_find_longest_prefix_match(sr, ip_hdr->ip_dst);
+  if (rt_entry == NULL || rt_entry->if_idx < 0) {
     fprintf(stderr, "Unable to find routing entry, dropping pkt: ");
-    print_addr_ip_int(ip_hdr->ip_dst);
+    print_addr_ip_int(ntohl(ip_hdr->ip_dst));
     return -1; 
   }
 
-  struct sr_if *rt_iface = sr_get_interface(sr, rt_entry->interface); 
+  struct sr_if *rt_iface = sr_get_interface_by_idx(sr, rt_entry->if_idx);
 
+  /* Only packets we generated ourselves can have a zero source address */
   if (ip_hdr->ip_src == 0) {
-    ip_hdr->ip_src = ntohl(rt_iface->ip);
+    ip_hdr->ip_src = rt_iface->ip;
+    ip_hdr->ip_sum = 0;
+    ip_hdr->ip_sum = cksum(ip_hdr, ip_hdr->ip_hl * 4);
   }
 
   memcpy(e_hdr->ether_shost, rt_iface->addr, ETHER_ADDR_LEN);
 
+  /* Fragmented packets never report an egress, so they are never cached */
+  if (ntohs(ip_hdr->ip_len) > rt_iface->mtu) {
+    if (ntohs(ip_hdr->ip_off) & IP_DF) {
+      sr_send_icmp_frag_needed_pkt(sr, rt_iface->mtu, ip_hdr);
+    } else {
+      frwd_ip_pkt_in_fragments(sr, e_hdr, rt_entry, rt_iface->mtu);
+    }
+    return 0;
+  }
+
+  frwd_ip_pkt_to_next_hop(sr, e_hdr, rt_entry, egress);
+  return 0;
+}
+
+void frwd_ip_pkt_to_next_hop(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, struct sr_rt *rt_entry, struct sr_if **egress) {
+  struct sr_if *rt_iface = sr_get_interface_by_idx(sr, rt_entry->if_idx);
+
   struct sr_arpentry *arp_entry = sr_arpcache_lookup(&sr->cache, rt_entry->gw.s_addr);
   if (arp_entry == NULL || !arp_entry->valid) {
     uint32_t e_len = get_eth_ip_pkt_len(e_hdr);
     struct sr_arpreq *arp_req = sr_arpcache_queuereq(&sr->cache, rt_entry->gw.s_addr,
       (uint8_t *)e_hdr, e_len, rt_entry->interface);
-    sr_handle_cached_arp_req(sr, arp_req);
+    if (arp_req != NULL) {
+      sr_handle_cached_arp_req(sr, arp_req);
+    }
   } else {
     memcpy(e_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN);
-    sr_send_ip_pkt(sr, e_hdr, rt_entry->interface);
+    sr_send_ip_pkt(sr, e_hdr, rt_iface);
+    if (egress != NULL) {
+      *egress = rt_iface;
+    }
   }
 
   if (arp_entry != NULL) {
     free(arp_entry);
   }
-
-  return 0;
 }
 
-void sr_send_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t *e_hdr, char* iface) {
+/* Splits the packet into fragments that fit in mtu (RFC 791). The packet may
+   itself be a fragment, so offsets are relative to its own and the last piece
+   keeps MF if the original had it. Options are copied into every fragment. */
+void frwd_ip_pkt_in_fragments(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, struct sr_rt *rt_entry, unsigned int mtu) {
   sr_ip_hdr_t *ip_hdr = sr_extract_ip_hdr(e_hdr);
-  uint32_t e_len = get_eth_ip_pkt_len(e_hdr);
+  unsigned int ip_hl = ip_hdr->ip_hl * 4;
+  unsigned int data_len = ntohs(ip_hdr->ip_len) - ip_hl;
+  uint16_t orig_off = ntohs(ip_hdr->ip_off);
+  uint8_t *data = ((uint8_t *)ip_hdr) + ip_hl;
+
+  /* Every fragment but the last has to carry a multiple of 8 bytes */
+  unsigned int frag_max = mtu > ip_hl ? (mtu - ip_hl) & ~7u : 0;
+  if (frag_max == 0) {
+    fprintf(stderr, "MTU %u too small to fragment pkt, dropping\n", mtu);
+    return;
+  }
+
+  uint8_t frame[sizeof(sr_ethernet_hdr_t) + ip_hl + frag_max];
+  sr_ethernet_hdr_t *frag_e_hdr = (sr_ethernet_hdr_t *)frame;
+  sr_ip_hdr_t *frag_ip_hdr = sr_extract_ip_hdr(frag_e_hdr);
+
+  unsigned int sent;
+  for (sent = 0; sent < data_len; sent += frag_max) {
+    unsigned int frag_len = data_len - sent < frag_max ? data_len - sent : frag_max;
+    bool last = sent + frag_len == data_len;
+
+    memcpy(frame, e_hdr, sizeof(sr_ethernet_hdr_t) + ip_hl);
+    memcpy(((uint8_t *)frag_ip_hdr) + ip_hl, data + sent, frag_len);
 
-  sr_eth_hdr_hton(e_hdr);
-  sr_ip_hdr_hton(ip_hdr);
+    uint16_t frag_off = (orig_off & ~IP_MF) + sent / 8;
+    if (!last || (orig_off & IP_MF)) {
+      frag_off |= IP_MF;
+    }
+
+    frag_ip_hdr->ip_len = htons(ip_hl + frag_len);
+    frag_ip_hdr->ip_off = htons(frag_off);
+    frag_ip_hdr->ip_sum = 0;
+    frag_ip_hdr->ip_sum = cksum(frag_ip_hdr, ip_hl);
 
-  sr_send_packet(sr, (uint8_t *)e_hdr, e_len, iface);
+    frwd_ip_pkt_to_next_hop(sr, frag_e_hdr, rt_entry, NULL);
+  }
+}
+
+void sr_send_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t *e_hdr, struct sr_if* iface) {
+  uint32_t e_len = get_eth_ip_pkt_len(e_hdr);
+  sr_send_packet_iface(sr, (uint8_t *)e_hdr, e_len, iface);
 }
 
 void sr_init_ip_hdr(
@@ -130,14 +230,16 @@ void sr_init_ip_hdr(
   hdr->ip_v = IP_VERSION; 
   hdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
   hdr->ip_tos = 0;
-  hdr->ip_len = sizeof(sr_ip_hdr_t) + payload_len;
+  hdr->ip_len = htons(sizeof(sr_ip_hdr_t) + payload_len);
   hdr->ip_id = 0;
   hdr->ip_off = 0;
   hdr->ip_ttl = INIT_TTL;
   hdr->ip_p = protocol;
+  hdr->ip_src = htonl(ip_src);
+  hdr->ip_dst = htonl(ip_dst); 
+
   hdr->ip_sum = 0;
-  hdr->ip_src = ip_src;
-  hdr->ip_dst = ip_dst; 
+  hdr->ip_sum = cksum(hdr, sizeof(sr_ip_hdr_t));
 }
 
 sr_ip_hdr_t *sr_extract_ip_hdr(sr_ethernet_hdr_t *e_hdr) {
@@ -147,40 +249,11 @@ sr_ip_hdr_t *sr_extract_ip_hdr(sr_ethernet_hdr_t *e_hdr) {
 
 uint32_t get_eth_ip_pkt_len(sr_ethernet_hdr_t *e_hdr) {
   sr_ip_hdr_t *ip_hdr = sr_extract_ip_hdr(e_hdr);
-  return sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_len;
-}
-
-void sr_ip_hdr_ntoh(sr_ip_hdr_t *hdr) {
-  hdr->ip_len = ntohs(hdr->ip_len);
-  hdr->ip_id = ntohs(hdr->ip_id);
-  hdr->ip_off = ntohs(hdr->ip_off);
-  hdr->ip_src = ntohl(hdr->ip_src);
-  hdr->ip_dst = ntohl(hdr->ip_dst);
-}
-
-void sr_ip_hdr_hton(sr_ip_hdr_t* hdr) {
-  hdr->ip_len = htons(hdr->ip_len);
-  hdr->ip_id = htons(hdr->ip_id);
-  hdr->ip_off = htons(hdr->ip_off);
-  hdr->ip_src = htonl(hdr->ip_src);
-  hdr->ip_dst = htonl(hdr->ip_dst);
-
-  hdr->ip_sum = 0;
-  hdr->ip_sum = cksum(hdr, sizeof(sr_ip_hdr_t));
+  return sizeof(sr_ethernet_hdr_t) + ntohs(ip_hdr->ip_len);
 }
 
 bool sr_is_router_ip(struct sr_instance *sr, uint32_t ip_dst) {
-  struct sr_if* iface;
-
-  uint32_t ip_dst_net = htonl(ip_dst);
-
-  for (iface = sr->if_list; iface != NULL; iface = iface->next) {
-    if (iface->ip == ip_dst_net) {
-      return true;
-    }
-  }
-
-  return false;
+  return sr_is_local_ip(sr, htonl(ip_dst));
 }
 
 struct sr_rt *sr_find_longest_prefix_match(struct sr_instance* sr, uint32_t ip_dst) {
@@ -4,6 +4,8 @@
 #include <stdbool.h>
 
 #include "sr_router.h"
+#include "sr_pkt.h"
+#include "sr_flow.h"
 
 #define IP_HDR_LEN 5
 #define IP_ADDR_LEN 4
@@ -11,9 +13,14 @@
 
 bool sr_ip_checksum_matches(sr_ip_hdr_t *ip_hdr);
 
-void sr_recv_tcp_or_udp_pkt_for_us(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, sr_ip_hdr_t* ip_hdr);
+void sr_recv_tcp_or_udp_pkt_for_us(struct sr_instance* sr, struct sr_pkt_desc *desc);
 
-void sr_recv_ip_pkt_for_other(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, sr_ip_hdr_t* ip_hdr);
+bool sr_ip_ttl_expired(struct sr_instance* sr, struct sr_pkt_desc *desc);
+bool sr_ip_frag_needed(struct sr_instance* sr, struct sr_pkt_desc *desc);
+
+/* flow_key is the packet's key before NAT translation, or NULL if the packet
+   can't be cached. Forwarded packets with a key are learned by the flow cache. */
+void sr_recv_ip_pkt_for_other(struct sr_instance* sr, struct sr_pkt_desc *desc, struct sr_flow_key *flow_key);
 
 void sr_create_and_frwd_ip_pkt(
   struct sr_instance* sr,
@@ -24,10 +31,16 @@ void sr_create_and_frwd_ip_pkt(
   uint8_t protocol
 );
 
-int sr_frwd_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr);
+/* Returns -1 if there is no route. Packets bigger than the egress MTU are
+   fragmented, or answered with a fragmentation needed if DF is set. If egress
+   is not NULL and the packet could be sent whole right away (rather than
+   queued on ARP), it is set to the egress interface. */
+int sr_frwd_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t* e_hdr, struct sr_if **egress);
 
-void sr_send_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t *e_hdr, char *iface); 
+void sr_send_ip_pkt(struct sr_instance* sr, sr_ethernet_hdr_t *e_hdr, struct sr_if *iface); 
 
+/* Fills in an IP header in network byte order, including its checksum.
+   ip_src and ip_dst are in host byte order. */
 void sr_init_ip_hdr(
   sr_ip_hdr_t* ip_hdr,
   uint32_t ip_src,
@@ -40,9 +53,6 @@ sr_ip_hdr_t *sr_extract_ip_hdr(sr_ethernet_hdr_t *e_hdr);
 
 uint32_t get_eth_ip_pkt_len(sr_ethernet_hdr_t *e_hdr);
 
-void sr_ip_hdr_ntoh(sr_ip_hdr_t *hdr);
-void sr_ip_hdr_hton(sr_ip_hdr_t *hdr);
-
 bool sr_is_router_ip(struct sr_instance *sr, uint32_t ip_dst);
 
 struct sr_rt *sr_find_longest_prefix_match(struct sr_instance* sr, uint32_t ip_dst);
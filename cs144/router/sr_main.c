@@ -23,7 +23,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -33,6 +36,10 @@
 #include "sr_router.h"
 #include "sr_rt.h"
 #include "sr_nat.h"
+#include "sr_nat_snapshot.h"
+#include "sr_egress.h"
+#include "sr_uring.h"
+#include "sr_poll.h"
 
 extern char* optarg;
 
@@ -69,13 +76,22 @@ int main(int argc, char **argv)
     struct sr_instance sr;
 
     bool use_nat = false;
+    bool use_uring = false;
+    bool busy_poll = false;
+    char *cpus = NULL;
     unsigned int icmp_query_timeout = 60;
     unsigned int tcp_established_idle_timeout = 7440;
     unsigned int tcp_transitory_idle_timeout = 300;
+    unsigned int nat_max_mappings = SR_NAT_DEFAULT_MAX_MAPPINGS;
+    unsigned int nat_max_conns = SR_NAT_DEFAULT_MAX_CONNS;
+    unsigned int arp_max_reqs = SR_ARPCACHE_DEFAULT_MAX_REQS;
+    unsigned int egress_rate = 0;
+    char *nat_snapshot_path = NULL;
+    unsigned int nat_snapshot_interval = SR_NAT_SNAPSHOT_DEFAULT_INTERVAL;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:ns:v:p:u:t:r:l:T:I:E:R")) != EOF)
+    while ((c = getopt(argc, argv, "hs:ns:v:p:u:t:r:l:T:I:E:R:M:C:A:S:W:B:UYP:")) != EOF)
     {
         switch (c)
         {
@@ -119,16 +135,72 @@ int main(int argc, char **argv)
             case 'R':
                 tcp_transitory_idle_timeout = atoi((char *) optarg);
                 break;
+            case 'M':
+                nat_max_mappings = atoi((char *) optarg);
+                break;
+            case 'C':
+                nat_max_conns = atoi((char *) optarg);
+                break;
+            case 'A':
+                arp_max_reqs = atoi((char *) optarg);
+                break;
+            case 'S':
+                nat_snapshot_path = optarg;
+                break;
+            case 'W':
+                nat_snapshot_interval = atoi((char *) optarg);
+                break;
+            case 'B':
+                egress_rate = atoi((char *) optarg);
+                break;
+            case 'U':
+                use_uring = true;
+                break;
+            case 'Y':
+                busy_poll = true;
+                break;
+            case 'P':
+                cpus = optarg;
+                break;
         } /* switch */
     } /* -- while -- */
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.arp_max_reqs = arp_max_reqs;
+    sr.egress_rate = egress_rate;
+
+    sr.poll = malloc(sizeof(struct sr_poll));
+    if(sr.poll == 0 || sr_poll_init(sr.poll, busy_poll, cpus) != 0)
+    { exit(1); }
+
+    /* -- threads inherit the affinity of whoever creates them, so everything
+          starts on the housekeeping CPUs and only the reader moves off -- */
+    sr_poll_pin_housekeeping(sr.poll);
 
     if (use_nat) {
+      /* The final snapshot is written by a thread that waits for SIGTERM, so
+         the signal has to be blocked before any other thread is created */
+      if (nat_snapshot_path != NULL) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+      }
+
       struct sr_nat *nat = malloc(sizeof(struct sr_nat));
-      sr_nat_init(&sr, nat, icmp_query_timeout, tcp_established_idle_timeout, tcp_transitory_idle_timeout);
+      sr_nat_init(&sr, nat, icmp_query_timeout, tcp_established_idle_timeout, tcp_transitory_idle_timeout,
+        nat_max_mappings, nat_max_conns);
       sr.nat = nat;
+
+      if (nat_snapshot_path != NULL) {
+        pthread_t snapshot_thread;
+        nat->snapshot_path = nat_snapshot_path;
+        nat->snapshot_interval = nat_snapshot_interval;
+        sr_nat_load_snapshot(nat, nat_snapshot_path);
+        pthread_create(&snapshot_thread, NULL, sr_nat_snapshot_on_signal, &sr);
+      }
     } else {
       sr.nat = NULL;
     }
@@ -185,9 +257,38 @@ int main(int argc, char **argv)
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr);
 
+    /* -- hand the socket to io_uring once the session is negotiated -- */
+    if(use_uring)
+    {
+        sr.uring = malloc(sizeof(struct sr_uring));
+        if(sr.uring == 0 || sr_uring_init(sr.uring, sr.sockfd) != 0)
+        {
+            fprintf(stderr, "Unable to set up io_uring, using blocking reads\n");
+            free(sr.uring);
+            sr.uring = 0;
+        }
+    }
+
+    /* -- have the kernel stamp arrivals for the latency report -- */
+    {
+        int on = 1;
+        setsockopt(sr.sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    }
+    sr_poll_pin_dataplane(sr.poll);
+
     /* -- whizbang main loop ;-) */
-    while( sr_read_from_server(&sr) == 1);
+    if(sr.uring != 0)
+    { sr_uring_run(&sr); }
+    else
+    { while( sr_read_from_server(&sr) == 1); }
 
+    sr_egress_print_stats(&sr);
+    sr_poll_report(sr.poll);
+    if(sr.uring != 0)
+    {
+        fprintf(stderr, "io_uring: %lu write batches, %lu frames dropped\n",
+                sr.uring->send_batches, sr.uring->send_drops);
+    }
     sr_destroy_instance(&sr);
 
     return 0;
@@ -208,6 +309,16 @@ static void usage(char* argv0)
     printf("           [-I INTEGER -- ICMP query timeout interval in seconds (default to 60)] \n");
     printf("           [-E INTEGER -- TCP Established Idle Timeout in seconds (default to 7440) \n");
     printf("           [-R INTEGER -- TCP Transitory Idle Timeout in seconds (default to 300) \n");
+    printf("           [-M INTEGER -- max NAT mappings (default to %d)] \n", SR_NAT_DEFAULT_MAX_MAPPINGS);
+    printf("           [-C INTEGER -- max NAT TCP connections (default to %d)] \n", SR_NAT_DEFAULT_MAX_CONNS);
+    printf("           [-A INTEGER -- max pending ARP requests (default to %d)] \n", SR_ARPCACHE_DEFAULT_MAX_REQS);
+    printf("           [-S FILE -- save NAT state to FILE and restore it on startup] \n");
+    printf("           [-W INTEGER -- seconds between NAT snapshots, 0 for only on exit (default to %d)] \n",
+            SR_NAT_SNAPSHOT_DEFAULT_INTERVAL);
+    printf("           [-B INTEGER -- kbit/s to pace each interface to, 0 for unpaced (default to 0)] \n");
+    printf("           [-U -- use io_uring for the server socket] \n");
+    printf("           [-Y -- busy poll the server socket instead of blocking] \n");
+    printf("           [-P CPUS -- pin the reader to the first CPU and other threads to the rest, e.g. 2,0-1] \n");
 
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
@@ -281,8 +392,12 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
+    memset(&(sr->if_table), 0, sizeof(struct sr_if_table));
     sr->routing_table = 0;
+    sr->rt_generation = 0;
     sr->logfile = 0;
+    sr->uring = 0;
+    sr->poll = 0;
 } /* -- sr_init_instance -- */
 
 /*-----------------------------------------------------------------------------
@@ -319,16 +434,12 @@ int sr_verify_routing_table(struct sr_instance* sr)
     while(rt_walker)
     {
         /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
+        /* -- the routing table may have been loaded before the
+              interfaces were known, so resolve them here -- */
+        if_walker = sr_get_interface(sr, rt_walker->interface);
         if(if_walker == 0)
         { ret++; } /* -- interface not found! -- */
+        rt_walker->if_idx = if_walker ? (int)if_walker->idx : -1;
 
         rt_walker = rt_walker->next;
     } /* -- while -- */
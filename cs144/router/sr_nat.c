@@ -15,25 +15,32 @@
 #include "sr_utils.h"
 #include "sr_tcp.h"
 #include "sr_icmp.h"
+#include "sr_pkt.h"
+#include "sr_nat_snapshot.h"
 
 #define MIN_TCP_PORT 1024
 
 #define UNSOLICITED_SYN_TIMEOUT 6
 
-void nat_remove_stale_mappings(struct sr_nat *nat, time_t curtime);
+void nat_remove_stale_mappings(struct sr_nat *nat, struct sr_nat_shard *shard, time_t curtime);
 void nat_respond_to_unsolicited_syns(struct sr_instance *sr, struct sr_nat *nat, time_t curtime);
 
-void timeout_connections(struct sr_nat *nat, struct sr_nat_mapping *mapping, time_t curtime);
+void timeout_connections(struct sr_nat *nat, struct sr_nat_shard *shard, struct sr_nat_mapping *mapping, time_t curtime);
 bool should_timeout_connection(struct sr_nat *nat, struct sr_nat_connection *conn, time_t curtime);
 
+int nat_init_shard(struct sr_nat *nat, unsigned int idx, unsigned int max_mappings, unsigned int max_conns);
+uint16_t nat_next_id(uint16_t *next_id, uint16_t first_id);
+
+/* The _no_lock lookups return the live mapping rather than a copy, so the
+   caller must hold the shard lock for as long as it uses the result. */
 struct sr_nat_mapping *nat_lookup_external_no_lock(
-  struct sr_nat *nat,
+  struct sr_nat_shard *shard,
   uint16_t aux_ext,
   sr_nat_mapping_type type
 );
 
 struct sr_nat_mapping *nat_lookup_internal_no_lock(
-  struct sr_nat *nat,
+  struct sr_nat_shard *shard,
   uint32_t ip_int,
   uint16_t aux_int,
   sr_nat_mapping_type type
@@ -45,6 +52,12 @@ struct sr_nat_connection *nat_lookup_connection(
   uint16_t port_ext
 );
 
+void nat_init_syn_table(struct sr_nat_syn_table *table);
+unsigned int nat_syn_bucket(uint32_t ip_src, uint16_t port_src, uint16_t port_dst);
+bool nat_syn_table_under_pressure(struct sr_nat_syn_table *table);
+void nat_evict_random_unsolicited_syn(struct sr_nat_syn_table *table);
+void nat_unlink_unsolicited_syn(struct sr_nat_syn_table *table, struct sr_nat_unsolicited_syn *entry);
+
 struct sr_nat_unsolicited_syn *nat_lookup_unsolicited_syn(
   struct sr_nat *nat,
   uint32_t ip_src,
@@ -52,12 +65,7 @@ struct sr_nat_unsolicited_syn *nat_lookup_unsolicited_syn(
   uint16_t port_dst
 );
 
-void nat_insert_unsolicited_syn(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  uint16_t port_src,
-  uint16_t port_dst
-);
+void nat_insert_unsolicited_syn(struct sr_nat *nat, struct sr_pkt_desc *desc);
 
 void nat_remove_unsolicited_syn(
   struct sr_nat *nat,
@@ -71,7 +79,9 @@ int sr_nat_init(
   struct sr_nat *nat,
   unsigned int icmp_query_timeout,
   unsigned int tcp_established_idle_timeout,
-  unsigned int tcp_transitory_idle_timeout
+  unsigned int tcp_transitory_idle_timeout,
+  unsigned int max_mappings,
+  unsigned int max_conns
 ) {
 
   assert(nat);
@@ -81,7 +91,26 @@ int sr_nat_init(
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
   int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
 
-  /* Initialize timeout thread */
+  nat_init_syn_table(&(nat->unsolicited_syns));
+
+  unsigned int i;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    if (nat_init_shard(nat, i, max_mappings, max_conns) != 0) {
+      success = -1;
+    }
+  }
+
+  nat->icmp_query_timeout = icmp_query_timeout;
+  nat->tcp_established_idle_timeout = tcp_established_idle_timeout;
+  nat->tcp_transitory_idle_timeout = tcp_transitory_idle_timeout;
+
+
+  nat->snapshot_path = NULL;
+  nat->snapshot_interval = 0;
+  nat->last_snapshot = time(NULL);
+
+  /* Initialize timeout thread, only once every shard it sweeps is ready */
+  sr->nat = nat;
 
   pthread_attr_init(&(nat->thread_attr));
   pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
@@ -89,19 +118,27 @@ int sr_nat_init(
   pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
   pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, sr);
 
-  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
+  return success;
+}
 
-  nat->mappings = NULL;
-  nat->unsolicited_syns = NULL;
+/* Each shard gets an equal share of the pools and starts its allocators at
+   the first port/id that belongs to it */
+int nat_init_shard(struct sr_nat *nat, unsigned int idx, unsigned int max_mappings, unsigned int max_conns) {
+  struct sr_nat_shard *shard = &(nat->shards[idx]);
 
-  nat->icmp_query_timeout = icmp_query_timeout;
-  nat->tcp_established_idle_timeout = tcp_established_idle_timeout;
-  nat->tcp_transitory_idle_timeout = tcp_transitory_idle_timeout;
+  shard->mappings = NULL;
+  shard->generation = 0;
+  shard->tcp_id = MIN_TCP_PORT + idx;
+  shard->icmp_id = idx;
 
-  nat->tcp_id = MIN_TCP_PORT;
-  nat->icmp_id = 0;
+  pthread_mutex_init(&(shard->lock), &(nat->attr));
 
-  return success;
+  if (sr_slab_init(&(shard->mapping_slab), sizeof(struct sr_nat_mapping), (max_mappings + SR_NAT_SHARDS - 1) / SR_NAT_SHARDS) != 0 ||
+      sr_slab_init(&(shard->conn_slab), sizeof(struct sr_nat_connection), (max_conns + SR_NAT_SHARDS - 1) / SR_NAT_SHARDS) != 0) {
+    return -1;
+  }
+
+  return 0;
 }
 
 
@@ -109,15 +146,11 @@ int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
   pthread_mutex_lock(&(nat->lock));
 
-  struct sr_nat_mapping *mapping, *mapping_next = NULL;
-  for (mapping = nat->mappings; mapping != NULL; mapping = mapping_next) {
-    struct sr_nat_connection *conn, *conn_next = NULL;
-    for (conn = mapping->conns; conn != NULL; conn = conn_next) {
-      conn_next = conn->next;
-      free(conn);
-    }
-    mapping_next = mapping->next;
-    free(mapping);
+  unsigned int i;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    sr_slab_destroy(&(nat->shards[i].mapping_slab));
+    sr_slab_destroy(&(nat->shards[i].conn_slab));
+    pthread_mutex_destroy(&(nat->shards[i].lock));
   }
 
   free(nat);
@@ -132,25 +165,43 @@ void *sr_nat_timeout(void *sr_ptr) {  /* Periodic Timout handling */
   struct sr_nat *nat = sr->nat;
   while (1) {
     sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
 
     time_t curtime = time(NULL);
-    nat_remove_stale_mappings(nat, curtime);
+
+    /* One shard at a time, so translation only ever waits on a small sweep */
+    unsigned int i;
+    for (i = 0; i < SR_NAT_SHARDS; i++) {
+      pthread_mutex_lock(&(nat->shards[i].lock));
+      nat_remove_stale_mappings(nat, &(nat->shards[i]), curtime);
+      pthread_mutex_unlock(&(nat->shards[i].lock));
+    }
+
+    pthread_mutex_lock(&(nat->lock));
     nat_respond_to_unsolicited_syns(sr, nat, curtime);
 
+    bool snapshot_due = nat->snapshot_path != NULL && nat->snapshot_interval > 0 &&
+      difftime(curtime, nat->last_snapshot) >= nat->snapshot_interval;
+    if (snapshot_due) {
+      nat->last_snapshot = curtime;
+    }
+
     pthread_mutex_unlock(&(nat->lock));
+
+    if (snapshot_due) {
+      sr_nat_save_snapshot(nat, nat->snapshot_path);
+    }
   }
   return NULL;
 }
 
-void nat_remove_stale_mappings(struct sr_nat *nat, time_t curtime) {
+void nat_remove_stale_mappings(struct sr_nat *nat, struct sr_nat_shard *shard, time_t curtime) {
   struct sr_nat_mapping *mapping, *prev = NULL, *next = NULL;
-  for (mapping = nat->mappings; mapping != NULL; mapping = next) {
+  for (mapping = shard->mappings; mapping != NULL; mapping = next) {
     bool remove_mapping = false;
     if (mapping->type == nat_mapping_icmp) {
       remove_mapping = difftime(curtime, mapping->last_updated) >= nat->icmp_query_timeout;
     } else if (mapping->type == nat_mapping_tcp) {
-      timeout_connections(nat, mapping, curtime);
+      timeout_connections(nat, shard, mapping, curtime);
       remove_mapping = mapping->conns == NULL; 
     }
 
@@ -160,9 +211,10 @@ void nat_remove_stale_mappings(struct sr_nat *nat, time_t curtime) {
         prev->next = next;
       } else {
         next = mapping->next;
-        nat->mappings = next;
+        shard->mappings = next;
       }
-      free(mapping);
+      sr_slab_free(&(shard->mapping_slab), mapping);
+      shard->generation++;
     } else {
       prev = mapping;
       next = mapping->next;
@@ -171,26 +223,19 @@ void nat_remove_stale_mappings(struct sr_nat *nat, time_t curtime) {
 }
 
 void nat_respond_to_unsolicited_syns(struct sr_instance *sr, struct sr_nat *nat, time_t curtime) {
-  struct sr_nat_unsolicited_syn *curr, *next = NULL, *prev = NULL;
-  for (curr = nat->unsolicited_syns; curr != NULL; curr = next) {
-    if (difftime(curtime, curr->timestamp) >= UNSOLICITED_SYN_TIMEOUT) {
-      sr_send_icmp_unreachable_pkt(sr, PORT_UNREACHABLE, curr->ip_hdr);
-      if (prev) {
-        next = curr->next;
-        prev->next = next;
-      } else {
-        next = curr->next;
-        nat->unsolicited_syns = next;
-      }
-      free(curr);
-    } else {
-      prev = curr;
-      next = curr->next;
+  struct sr_nat_syn_table *table = &(nat->unsolicited_syns);
+
+  int i;
+  for (i = 0; i < SR_NAT_SYN_TABLE_SZ && table->count > 0; i++) {
+    struct sr_nat_unsolicited_syn *curr = &(table->entries[i]);
+    if (curr->in_use && difftime(curtime, curr->timestamp) >= UNSOLICITED_SYN_TIMEOUT) {
+      sr_send_icmp_unreachable_pkt(sr, PORT_UNREACHABLE, (sr_ip_hdr_t *)curr->orig_dgram);
+      nat_unlink_unsolicited_syn(table, curr);
     }
   }
 }
 
-void timeout_connections(struct sr_nat *nat, struct sr_nat_mapping *mapping, time_t curtime) {
+void timeout_connections(struct sr_nat *nat, struct sr_nat_shard *shard, struct sr_nat_mapping *mapping, time_t curtime) {
   struct sr_nat_connection *conn, *prev = NULL, *next = NULL;
   for (conn = mapping->conns; conn != NULL; conn = next) {
     if (should_timeout_connection(nat, conn, curtime)) {
@@ -201,7 +246,8 @@ void timeout_connections(struct sr_nat *nat, struct sr_nat_mapping *mapping, tim
         next = conn->next;
         mapping->conns = next;
       }
-      free(conn);
+      sr_slab_free(&(shard->conn_slab), conn);
+      shard->generation++;
     } else {
       prev = conn;
       next = conn->next;
@@ -220,91 +266,88 @@ bool should_timeout_connection(struct sr_nat *nat, struct sr_nat_connection *con
 }
 
 /* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
-  pthread_mutex_lock(&(nat->lock));
-  struct sr_nat_mapping *copy = nat_lookup_external_no_lock(nat, aux_ext, type);
-  pthread_mutex_unlock(&(nat->lock));
+   Returns false if there is none. */
+bool sr_nat_lookup_external(struct sr_nat *nat,
+    uint16_t aux_ext, sr_nat_mapping_type type, struct sr_nat_mapping *copy ) {
+  struct sr_nat_shard *shard = sr_nat_shard_for_external(nat, aux_ext);
+
+  pthread_mutex_lock(&(shard->lock));
+  struct sr_nat_mapping *mapping = nat_lookup_external_no_lock(shard, aux_ext, type);
+  if (mapping != NULL) {
+    memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
+  }
+  pthread_mutex_unlock(&(shard->lock));
 
-  return copy;
+  return mapping != NULL;
 }
 
-struct sr_nat_mapping *nat_lookup_external_no_lock(struct sr_nat *nat,
+struct sr_nat_mapping *nat_lookup_external_no_lock(struct sr_nat_shard *shard,
     uint16_t aux_ext, sr_nat_mapping_type type ) {
 
-  /* handle lookup here, malloc and assign to copy */
-  struct sr_nat_mapping *copy = NULL;
-
   struct sr_nat_mapping *mapping;
-  for (mapping = nat->mappings; mapping != NULL; mapping = mapping->next) {
+  for (mapping = shard->mappings; mapping != NULL; mapping = mapping->next) {
     if (mapping->aux_ext == aux_ext && mapping->type == type) {
-      break;
+      mapping->last_updated = time(NULL);
+      return mapping;
     }
   }
 
-  if (mapping != NULL) {
-    mapping->last_updated = time(NULL);
-
-    copy = malloc(sizeof(struct sr_nat_mapping));
-    memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-  }
-
-  return copy;
+  return NULL;
 }
 
 /* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+   Returns false if there is none. */
+bool sr_nat_lookup_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *copy ) {
+  struct sr_nat_shard *shard = sr_nat_shard_for_internal(nat, ip_int, aux_int);
 
-  pthread_mutex_lock(&(nat->lock));
-  struct sr_nat_mapping *copy = nat_lookup_internal_no_lock(nat, ip_int, aux_int, type);
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_lock(&(shard->lock));
+  struct sr_nat_mapping *mapping = nat_lookup_internal_no_lock(shard, ip_int, aux_int, type);
+  if (mapping != NULL) {
+    memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
+  }
+  pthread_mutex_unlock(&(shard->lock));
 
-  return copy;
+  return mapping != NULL;
 }
 
-struct sr_nat_mapping *nat_lookup_internal_no_lock(struct sr_nat *nat,
+struct sr_nat_mapping *nat_lookup_internal_no_lock(struct sr_nat_shard *shard,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *copy = NULL;
-
   struct sr_nat_mapping *mapping;
-  for (mapping = nat->mappings; mapping != NULL; mapping = mapping->next) {
+  for (mapping = shard->mappings; mapping != NULL; mapping = mapping->next) {
     if (mapping->ip_int == ip_int && mapping->aux_int == aux_int && mapping->type == type) {
-      break;
+      mapping->last_updated = time(NULL);
+      return mapping;
     }
   }
 
-  if (mapping != NULL) {
-    mapping->last_updated = time(NULL);
-
-    copy = malloc(sizeof(struct sr_nat_mapping));
-    memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-  }
-
-  return copy;
+  return NULL;
 }
 
 /* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
+   Actually fills in a copy of the new mapping, for thread safety.
  */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+bool sr_nat_insert_mapping(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *copy ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *shard = sr_nat_shard_for_internal(nat, ip_int, aux_int);
+  pthread_mutex_lock(&(shard->lock));
 
-  struct sr_nat_mapping *existing = nat_lookup_internal_no_lock(nat, ip_int, aux_int, type);
+  struct sr_nat_mapping *existing = nat_lookup_internal_no_lock(shard, ip_int, aux_int, type);
   if (existing != NULL) {
-    pthread_mutex_unlock(&(nat->lock));
-    return existing;
+    memcpy(copy, existing, sizeof(struct sr_nat_mapping));
+    pthread_mutex_unlock(&(shard->lock));
+    return true;
   }
 
   /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = malloc(sizeof(struct sr_nat_mapping));
-  struct sr_nat_mapping *copy = malloc(sizeof(struct sr_nat_mapping));
+  struct sr_nat_mapping *mapping = sr_slab_alloc(&(shard->mapping_slab));
+  if (mapping == NULL) {
+    fprintf(stderr, "Nat mapping pool exhausted (%u in use)\n", shard->mapping_slab.in_use);
+    pthread_mutex_unlock(&(shard->lock));
+    return false;
+  }
 
   mapping->type = type;
   mapping->ip_int = ip_int;
@@ -312,88 +355,136 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   mapping->last_updated = time(NULL);
   mapping->conns = NULL;
 
-  mapping->next = nat->mappings;
-  nat->mappings = mapping;
+  mapping->next = shard->mappings;
+  shard->mappings = mapping;
 
+  unsigned int idx = shard - nat->shards;
   if (type == nat_mapping_icmp) {
-    mapping->aux_ext = nat->icmp_id++;
-    if (nat->icmp_id == USHRT_MAX) {
-      nat->icmp_id = 0;
-    }
+    mapping->aux_ext = nat_next_id(&(shard->icmp_id), idx);
   } else if (type == nat_mapping_tcp) {
-    mapping->aux_ext = nat->tcp_id++;
-    if (nat->tcp_id == USHRT_MAX) {
-      nat->tcp_id = MIN_TCP_PORT;
-    }
+    mapping->aux_ext = nat_next_id(&(shard->tcp_id), MIN_TCP_PORT + idx);
   }
  
   memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
  
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  pthread_mutex_unlock(&(shard->lock));
+  return true;
 }
 
-void sr_nat_update_tcp_sent_state(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  struct tcphdr *tcp_hdr
-) {
-  pthread_mutex_lock(&(nat->lock));
+/* Steps through the ids congruent to first_id, wrapping before USHRT_MAX */
+uint16_t nat_next_id(uint16_t *next_id, uint16_t first_id) {
+  uint16_t id = *next_id;
+  if (*next_id >= USHRT_MAX - SR_NAT_SHARDS) {
+    *next_id = first_id;
+  } else {
+    *next_id += SR_NAT_SHARDS;
+  }
+  return id;
+}
+
+struct sr_nat_shard *sr_nat_shard_for_internal(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int) {
+  uint32_t h = ip_int * 2654435761u;
+  h ^= aux_int * 2246822519u;
+  h ^= h >> 16;
+  return &(nat->shards[h & (SR_NAT_SHARDS - 1)]);
+}
+
+struct sr_nat_shard *sr_nat_shard_for_external(struct sr_nat *nat, uint16_t aux_ext) {
+  return &(nat->shards[aux_ext & (SR_NAT_SHARDS - 1)]);
+}
+
+unsigned int sr_nat_generation(struct sr_nat *nat) {
+  unsigned int generation = 0;
+
+  unsigned int i;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    generation += nat->shards[i].generation;
+  }
+
+  return generation;
+}
+
+void sr_nat_update_tcp_sent_state(struct sr_nat *nat, struct sr_pkt_desc *desc) {
+  struct sr_nat_shard *shard = sr_nat_shard_for_internal(nat, desc->ip_src, desc->aux_src);
+  pthread_mutex_lock(&(shard->lock));
 
-  struct sr_nat_mapping *mapping = nat_lookup_internal_no_lock(nat, ip_hdr->ip_src, tcp_hdr->source, nat_mapping_tcp);
+  struct sr_nat_mapping *mapping = nat_lookup_internal_no_lock(shard, desc->ip_src, desc->aux_src, nat_mapping_tcp);
   if (mapping == NULL) {
-    pthread_mutex_unlock(&(nat->lock));
+    pthread_mutex_unlock(&(shard->lock));
     return;
   }
 
-  struct sr_nat_connection *conn = nat_lookup_connection(mapping, ip_hdr->ip_dst, tcp_hdr->dest);
+  struct sr_nat_connection *conn = nat_lookup_connection(mapping, desc->ip_dst, desc->aux_dst);
   if (conn == NULL) {
-    conn = malloc(sizeof(struct sr_nat_connection));
-    conn->ip_ext = ip_hdr->ip_dst;
-    conn->port_ext = tcp_hdr->dest;
-    conn->curr_state = sr_get_tcp_transition(tcp_hdr, TCP_CLOSE, true);
+    conn = sr_slab_alloc(&(shard->conn_slab));
+    if (conn == NULL) {
+      fprintf(stderr, "Nat connection pool exhausted (%u in use)\n", shard->conn_slab.in_use);
+      pthread_mutex_unlock(&(shard->lock));
+      return;
+    }
+    conn->ip_ext = desc->ip_dst;
+    conn->port_ext = desc->aux_dst;
+    conn->curr_state = sr_get_tcp_transition(desc->tcp_flags, TCP_CLOSE, true);
     conn->last_updated_state = time(NULL);
     conn->next = mapping->conns;
     mapping->conns = conn;
   } else {
-    conn->curr_state = sr_get_tcp_transition(tcp_hdr, conn->curr_state, true);
+    conn->curr_state = sr_get_tcp_transition(desc->tcp_flags, conn->curr_state, true);
     conn->last_updated_state = time(NULL);
   }
 
-  if (tcp_hdr->syn) {
-    nat_remove_unsolicited_syn(nat, ip_hdr->ip_dst, tcp_hdr->dest, mapping->aux_ext);
-  }
+  uint16_t aux_ext = mapping->aux_ext;
+  pthread_mutex_unlock(&(shard->lock));
 
-  pthread_mutex_unlock(&(nat->lock));
+  if (desc->tcp_flags & TH_SYN) {
+    pthread_mutex_lock(&(nat->lock));
+    nat_remove_unsolicited_syn(nat, desc->ip_dst, desc->aux_dst, aux_ext);
+    pthread_mutex_unlock(&(nat->lock));
+  }
 }
 
 
-void sr_nat_handle_unsolicited_syn(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  struct tcphdr *tcp_hdr
-) {
+void sr_nat_handle_unsolicited_syn(struct sr_nat *nat, struct sr_pkt_desc *desc) {
   pthread_mutex_lock(&(nat->lock));
 
   struct sr_nat_unsolicited_syn *existing = nat_lookup_unsolicited_syn(
-    nat, ip_hdr->ip_src, tcp_hdr->source, tcp_hdr->dest);
+    nat, desc->ip_src, desc->aux_src, desc->aux_dst);
 
   if (existing == NULL) {
-    nat_insert_unsolicited_syn(nat, ip_hdr, tcp_hdr->source, tcp_hdr->dest);
+    nat_insert_unsolicited_syn(nat, desc);
   }
   
   pthread_mutex_unlock(&(nat->lock));
 }
 
+void nat_init_syn_table(struct sr_nat_syn_table *table) {
+  memset(table, 0, sizeof(struct sr_nat_syn_table));
+
+  int i;
+  for (i = SR_NAT_SYN_TABLE_SZ - 1; i >= 0; i--) {
+    table->entries[i].next = table->free_list;
+    table->free_list = &(table->entries[i]);
+  }
+}
+
+unsigned int nat_syn_bucket(uint32_t ip_src, uint16_t port_src, uint16_t port_dst) {
+  uint32_t h = ip_src * 2654435761u;
+  h ^= ((uint32_t)port_src << 16 | port_dst) * 2246822519u;
+  h ^= h >> 15;
+  return h & (SR_NAT_SYN_BUCKETS - 1);
+}
+
 struct sr_nat_unsolicited_syn *nat_lookup_unsolicited_syn(
   struct sr_nat *nat,
   uint32_t ip_src,
   uint16_t port_src,
   uint16_t port_dst
 ) {
+  struct sr_nat_syn_table *table = &(nat->unsolicited_syns);
+
   struct sr_nat_unsolicited_syn *curr;
-  for (curr = nat->unsolicited_syns; curr != NULL; curr = curr->next) {
-    if (curr->ip_hdr->ip_src == ip_src && curr->port_src == port_src && curr->port_dst == port_dst) {
+  for (curr = table->buckets[nat_syn_bucket(ip_src, port_src, port_dst)]; curr != NULL; curr = curr->next) {
+    if (curr->ip_src == ip_src && curr->port_src == port_src && curr->port_dst == port_dst) {
       return curr;
     }
   }
@@ -401,21 +492,71 @@ struct sr_nat_unsolicited_syn *nat_lookup_unsolicited_syn(
   return NULL;
 }
 
-void nat_insert_unsolicited_syn(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  uint16_t port_src,
-  uint16_t port_dst
-) {
-  struct sr_nat_unsolicited_syn *unsolicited_syn = malloc(sizeof(struct sr_nat_unsolicited_syn));
+/* Returns true if the next insert should first evict a random entry. Below
+   SR_NAT_SYN_EARLY_EVICT never evicts, at capacity always evicts, and in
+   between evicts with linearly increasing probability. */
+bool nat_syn_table_under_pressure(struct sr_nat_syn_table *table) {
+  if (table->count >= SR_NAT_SYN_TABLE_SZ) {
+    return true;
+  } else if (table->count < SR_NAT_SYN_EARLY_EVICT) {
+    return false;
+  } else {
+    return (unsigned int)(rand() % (SR_NAT_SYN_TABLE_SZ - SR_NAT_SYN_EARLY_EVICT))
+      < table->count - SR_NAT_SYN_EARLY_EVICT;
+  }
+}
+
+void nat_evict_random_unsolicited_syn(struct sr_nat_syn_table *table) {
+  int start = rand() % SR_NAT_SYN_TABLE_SZ;
 
-  unsolicited_syn->ip_hdr = ip_hdr;
-  unsolicited_syn->port_src = port_src;
-  unsolicited_syn->port_dst = port_dst;
+  int i;
+  for (i = 0; i < SR_NAT_SYN_TABLE_SZ; i++) {
+    struct sr_nat_unsolicited_syn *victim = &(table->entries[(start + i) % SR_NAT_SYN_TABLE_SZ]);
+    if (victim->in_use) {
+      nat_unlink_unsolicited_syn(table, victim);
+      table->overflows++;
+      return;
+    }
+  }
+}
+
+void nat_insert_unsolicited_syn(struct sr_nat *nat, struct sr_pkt_desc *desc) {
+  struct sr_nat_syn_table *table = &(nat->unsolicited_syns);
+
+  if (nat_syn_table_under_pressure(table)) {
+    nat_evict_random_unsolicited_syn(table);
+  }
+
+  struct sr_nat_unsolicited_syn *unsolicited_syn = table->free_list;
+  table->free_list = unsolicited_syn->next;
+  table->count++;
+
+  unsolicited_syn->ip_src = desc->ip_src;
+  unsolicited_syn->port_src = desc->aux_src;
+  unsolicited_syn->port_dst = desc->aux_dst;
   unsolicited_syn->timestamp = time(NULL);
+  unsolicited_syn->in_use = true;
+
+  /* The packet buffer is freed once the packet has been handled, so keep our own
+     copy of what the ICMP port unreachable needs to quote */
+  memcpy(unsolicited_syn->orig_dgram, desc->ip_hdr, ICMP_DATA_SIZE);
 
-  unsolicited_syn->next = nat->unsolicited_syns;
-  nat->unsolicited_syns = unsolicited_syn;
+  unsigned int bucket = nat_syn_bucket(unsolicited_syn->ip_src, unsolicited_syn->port_src, unsolicited_syn->port_dst);
+  unsolicited_syn->next = table->buckets[bucket];
+  table->buckets[bucket] = unsolicited_syn;
+}
+
+void nat_unlink_unsolicited_syn(struct sr_nat_syn_table *table, struct sr_nat_unsolicited_syn *entry) {
+  struct sr_nat_unsolicited_syn **link = &(table->buckets[nat_syn_bucket(entry->ip_src, entry->port_src, entry->port_dst)]);
+  while (*link != entry) {
+    link = &((*link)->next);
+  }
+  *link = entry->next;
+
+  entry->in_use = false;
+  entry->next = table->free_list;
+  table->free_list = entry;
+  table->count--;
 }
 
 void nat_remove_unsolicited_syn(
@@ -424,45 +565,29 @@ void nat_remove_unsolicited_syn(
   uint16_t port_src,
   uint16_t port_dst
 ) {
-  struct sr_nat_unsolicited_syn *curr, *prev = NULL, *next = NULL;
-  for (curr = nat->unsolicited_syns; curr != NULL; curr = next) {
-    if (curr->ip_hdr->ip_src == ip_src && curr->port_src == port_src && curr->port_dst == port_dst) {
-      if (prev) {
-        next = curr->next;
-        prev->next = next;
-      } else {
-        next = curr->next;
-        nat->unsolicited_syns = next;
-      }
-      free(curr);
-      break;
-    } else {
-      prev = curr;
-      next = curr->next;
-    }
+  struct sr_nat_unsolicited_syn *existing = nat_lookup_unsolicited_syn(nat, ip_src, port_src, port_dst);
+  if (existing != NULL) {
+    nat_unlink_unsolicited_syn(&(nat->unsolicited_syns), existing);
   }
 }
 
-void sr_nat_update_tcp_recvd_state(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  struct tcphdr *tcp_hdr
-) {
-  pthread_mutex_lock(&(nat->lock));
+void sr_nat_update_tcp_recvd_state(struct sr_nat *nat, struct sr_pkt_desc *desc) {
+  struct sr_nat_shard *shard = sr_nat_shard_for_external(nat, desc->aux_dst);
+  pthread_mutex_lock(&(shard->lock));
 
-  struct sr_nat_mapping *mapping = nat_lookup_external_no_lock(nat, tcp_hdr->dest, nat_mapping_tcp);
+  struct sr_nat_mapping *mapping = nat_lookup_external_no_lock(shard, desc->aux_dst, nat_mapping_tcp);
   if (mapping == NULL) {
-    pthread_mutex_unlock(&(nat->lock));
+    pthread_mutex_unlock(&(shard->lock));
     return;
   }
 
-  struct sr_nat_connection *conn = nat_lookup_connection(mapping, ip_hdr->ip_src, tcp_hdr->source);
+  struct sr_nat_connection *conn = nat_lookup_connection(mapping, desc->ip_src, desc->aux_src);
   if (conn != NULL) {
-    conn->curr_state = sr_get_tcp_transition(tcp_hdr, conn->curr_state, false);
+    conn->curr_state = sr_get_tcp_transition(desc->tcp_flags, conn->curr_state, false);
     conn->last_updated_state = time(NULL);
   }
 
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&(shard->lock));
 }
 
 struct sr_nat_connection *nat_lookup_connection(struct sr_nat_mapping *mapping, uint32_t ip_ext, uint16_t port_ext) {
@@ -478,11 +603,26 @@ struct sr_nat_connection *nat_lookup_connection(struct sr_nat_mapping *mapping,
 
 void sr_print_nat_mappings(struct sr_nat *nat) {
   struct sr_nat_mapping *mapping;
-  fprintf(stderr, "ip_int\taux_int\taux_ext\n");
-  for (mapping = nat->mappings; mapping != NULL; mapping = mapping->next) {
-    print_addr_ip_int(mapping->ip_int);
-    fprintf(stderr, "\t%u", mapping->aux_int);    
-    fprintf(stderr, "\t%u", mapping->aux_ext);    
-    fprintf(stderr, "\n"); 
+  fprintf(stderr, "shard\tip_int\taux_int\taux_ext\n");
+
+  unsigned int i;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    for (mapping = nat->shards[i].mappings; mapping != NULL; mapping = mapping->next) {
+      fprintf(stderr, "%u\t", i);
+      print_addr_ip_int(mapping->ip_int);
+      fprintf(stderr, "\t%u", mapping->aux_int);    
+      fprintf(stderr, "\t%u", mapping->aux_ext);    
+      fprintf(stderr, "\n"); 
+    }
+  }
+  fprintf(stderr, "unsolicited syns: %u tracked, %lu evicted\n",
+    nat->unsolicited_syns.count, nat->unsolicited_syns.overflows);
+
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    fprintf(stderr, "shard %u pools: %u/%u mappings, %u/%u connections, %lu failed allocations\n", i,
+      shard->mapping_slab.in_use, shard->mapping_slab.capacity,
+      shard->conn_slab.in_use, shard->conn_slab.capacity,
+      shard->mapping_slab.exhausted + shard->conn_slab.exhausted);
   }
 }
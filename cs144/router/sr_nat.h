@@ -3,12 +3,15 @@
 #define SR_NAT_TABLE_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <time.h>
 #include <pthread.h>
 #include <netinet/tcp.h>
 
 #include "sr_protocol.h"
 #include "sr_router.h"
+#include "sr_pkt.h"
+#include "sr_slab.h"
 
 typedef enum {
   nat_mapping_icmp,
@@ -35,31 +38,74 @@ struct sr_nat_mapping {
   struct sr_nat_mapping *next;
 };
 
+#define INTERNAL_IFACE "eth1" /* interface on the private side of the NAT */
+#define SR_NAT_DEFAULT_MAX_MAPPINGS 16384
+#define SR_NAT_DEFAULT_MAX_CONNS 65536
+#define SR_NAT_SHARDS 8 /* must be a power of 2 */
+#define SR_NAT_SYN_TABLE_SZ 1024 /* max # of unsolicited syns tracked at once */
+#define SR_NAT_SYN_BUCKETS 1024 /* # of hash buckets, must be a power of 2 */
+#define SR_NAT_SYN_EARLY_EVICT 768 /* occupancy at which random early eviction starts */
+
 struct sr_nat_unsolicited_syn {
-  sr_ip_hdr_t *ip_hdr; /* originating IP hdr of the unsolicited syn */ 
+  uint32_t ip_src; /* originating IP addr of the unsolicited syn */
   uint16_t port_src; /* originating TCP port of the unsolicited syn */
   uint16_t port_dst; /* destination TCP port of the unsolicited syn */
   time_t timestamp; /* the time of the syn measured as seconds since unix epoch */
-  struct sr_nat_unsolicited_syn *next;
+  uint8_t orig_dgram[ICMP_DATA_SIZE]; /* first ICMP_DATA_SIZE bytes of the originating datagram, in network byte order */
+  bool in_use;
+  struct sr_nat_unsolicited_syn *next; /* next entry in the hash bucket, or in the free list */
+};
+
+/* Fixed-size hash table of unsolicited syns keyed by (ip_src, port_src, port_dst).
+   All entries are preallocated so a syn flood can't grow memory use. Once the
+   table is SR_NAT_SYN_EARLY_EVICT full, inserts evict a random entry with a
+   probability that grows linearly until the table is full. */
+struct sr_nat_syn_table {
+  struct sr_nat_unsolicited_syn entries[SR_NAT_SYN_TABLE_SZ];
+  struct sr_nat_unsolicited_syn *buckets[SR_NAT_SYN_BUCKETS];
+  struct sr_nat_unsolicited_syn *free_list;
+  unsigned int count; /* # of entries in use */
+  unsigned long overflows; /* # of entries evicted because the table was under pressure */
+};
+
+/* Mappings are spread over shards by a hash of their internal endpoint, and
+   each shard only hands out external ports/ids that are congruent to its
+   index mod SR_NAT_SHARDS, so an inbound packet's destination port alone says
+   which shard to look in. Each shard has its own lock and pools, so
+   translating packets of different flows doesn't contend on one lock. */
+struct sr_nat_shard {
+  struct sr_nat_mapping *mappings;
+
+  /* Mappings and connections come from fixed pools sized at startup */
+  struct sr_slab mapping_slab;
+  struct sr_slab conn_slab;
+
+  uint16_t tcp_id; /* next external port to hand out */
+  uint16_t icmp_id; /* next external icmp id to hand out */
+
+  unsigned int generation; /* bumped whenever a mapping or connection is removed */
+
+  pthread_mutex_t lock;
 };
 
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping *mappings;
-  struct sr_nat_unsolicited_syn *unsolicited_syns;
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+  struct sr_nat_syn_table unsolicited_syns;
 
   /* threading */
-  pthread_mutex_t lock;
+  pthread_mutex_t lock; /* protects unsolicited_syns */
   pthread_mutexattr_t attr;
   pthread_attr_t thread_attr;
   pthread_t thread;
 
-  uint16_t tcp_id;
-  uint16_t icmp_id;
-
   unsigned int icmp_query_timeout; /* ICMP query timeout interval in seconds */;
   unsigned int tcp_established_idle_timeout; /* TCP Established Idle Timeout in seconds */
   unsigned int tcp_transitory_idle_timeout; /* TCP Transitory Idle Timeout in seconds */
+
+  char *snapshot_path; /* where the tables are saved for a warm restart, NULL if never */
+  unsigned int snapshot_interval; /* seconds between periodic snapshots, 0 for only on exit */
+  time_t last_snapshot;
 };
 
 
@@ -68,43 +114,43 @@ int sr_nat_init(
   struct sr_nat *nat,
   unsigned int icmp_query_timeout,
   unsigned int tcp_established_idle_timeout,
-  unsigned int tcp_transitory_idle_timeout
+  unsigned int tcp_transitory_idle_timeout,
+  unsigned int max_mappings,
+  unsigned int max_conns
 );     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
 
+/* The functions below copy the mapping into the caller's struct, since the
+   table's own copy can be removed as soon as the nat lock is released. The
+   conns and next pointers of a copy must not be followed. */
+
 /* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+   Returns false if there is none. */
+bool sr_nat_lookup_external(struct sr_nat *nat,
+    uint16_t aux_ext, sr_nat_mapping_type type, struct sr_nat_mapping *mapping );
 
 /* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+   Returns false if there is none. */
+bool sr_nat_lookup_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *mapping );
 
-/* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+/* Insert a new mapping into the nat's mapping table, or get the existing one.
+   Returns false if the mapping pool is exhausted. */
+bool sr_nat_insert_mapping(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *mapping );
 
-void sr_nat_handle_unsolicited_syn(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  struct tcphdr *tcp_hdr
-);
+void sr_nat_handle_unsolicited_syn(struct sr_nat *nat, struct sr_pkt_desc *desc);
 
-void sr_nat_update_tcp_sent_state(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  struct tcphdr *tcp_hdr
-);
+void sr_nat_update_tcp_sent_state(struct sr_nat *nat, struct sr_pkt_desc *desc);
 
-void sr_nat_update_tcp_recvd_state(
-  struct sr_nat *nat,
-  sr_ip_hdr_t *ip_hdr,
-  struct tcphdr *tcp_hdr
-);
+void sr_nat_update_tcp_recvd_state(struct sr_nat *nat, struct sr_pkt_desc *desc);
+
+/* Changes whenever a mapping or connection is removed from any shard */
+unsigned int sr_nat_generation(struct sr_nat *nat);
+
+struct sr_nat_shard *sr_nat_shard_for_internal(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int);
+struct sr_nat_shard *sr_nat_shard_for_external(struct sr_nat *nat, uint16_t aux_ext);
 
 void sr_print_nat_mappings(struct sr_nat *nat);
 
@@ -1,12 +1,20 @@
 #ifndef SR_NAT_HANDLER_H
 #define SR_NAT_HANDLER_H
 
+#include <stdbool.h>
+
+#include "sr_pkt.h"
+
 enum sr_nat_response {
   nat_no_mapping,
   nat_mapped,
   nat_ignored
 };
 
-enum sr_nat_response sr_rewrite_pkt_for_nat(struct sr_instance *sr, sr_ethernet_hdr_t *e_hdr, sr_ip_hdr_t *ip_hdr, char *interface); 
+/* Returns true if the packet crosses the NAT and is of a protocol it translates */
+bool sr_nat_should_rewrite(struct sr_instance *sr, struct sr_pkt_desc *desc);
+
+/* Translates the packet in place, keeping desc in sync with the rewritten frame */
+enum sr_nat_response sr_rewrite_pkt_for_nat(struct sr_instance *sr, struct sr_pkt_desc *desc);
 
 #endif
@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sr_router.h"
+#include "sr_nat.h"
+#include "sr_nat_snapshot.h"
+#include "sr_slab.h"
+
+#define SNAPSHOT_PATH_MAX 4096
+
+uint64_t snapshot_len(uint32_t num_mappings, uint32_t num_conns);
+void snapshot_lock_shards(struct sr_nat *nat);
+void snapshot_unlock_shards(struct sr_nat *nat);
+uint8_t *snapshot_serialize(struct sr_nat *nat, unsigned int *len);
+int snapshot_write_file(const char *path, uint8_t *buf, unsigned int len);
+bool snapshot_valid(uint8_t *buf, uint64_t len);
+int snapshot_restore(struct sr_nat *nat, uint8_t *buf, uint64_t len);
+
+int sr_nat_save_snapshot(struct sr_nat *nat, const char *path) {
+  unsigned int len;
+
+  /* Only copying the tables happens under the locks, the file IO doesn't */
+  snapshot_lock_shards(nat);
+  uint8_t *buf = snapshot_serialize(nat, &len);
+  snapshot_unlock_shards(nat);
+
+  if (buf == NULL) {
+    fprintf(stderr, "Unable to allocate nat snapshot\n");
+    return -1;
+  }
+
+  int ret = snapshot_write_file(path, buf, len);
+  free(buf);
+
+  return ret;
+}
+
+int sr_nat_load_snapshot(struct sr_nat *nat, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "No nat snapshot at %s, starting with empty tables\n", path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct sr_nat_snapshot_hdr)) {
+    fprintf(stderr, "Ignoring truncated nat snapshot %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  uint8_t *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  snapshot_lock_shards(nat);
+  int ret = snapshot_restore(nat, buf, st.st_size);
+  snapshot_unlock_shards(nat);
+
+  munmap(buf, st.st_size);
+
+  return ret;
+}
+
+void *sr_nat_snapshot_on_signal(void *sr_ptr) {
+  struct sr_instance *sr = (struct sr_instance *)sr_ptr;
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+
+  int sig;
+  sigwait(&set, &sig);
+
+  fprintf(stderr, "Caught signal %d, saving nat snapshot to %s\n", sig, sr->nat->snapshot_path);
+  sr_nat_save_snapshot(sr->nat, sr->nat->snapshot_path);
+  exit(0);
+
+  return NULL;
+}
+
+/* Always taken in index order, so two threads holding several shards at once
+   can't deadlock */
+void snapshot_lock_shards(struct sr_nat *nat) {
+  unsigned int i;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_lock(&(nat->shards[i].lock));
+  }
+}
+
+void snapshot_unlock_shards(struct sr_nat *nat) {
+  unsigned int i;
+  for (i = SR_NAT_SHARDS; i > 0; i--) {
+    pthread_mutex_unlock(&(nat->shards[i - 1].lock));
+  }
+}
+
+/* 64 bit, so the counts in a corrupted header can't wrap around to a
+   plausible length */
+uint64_t snapshot_len(uint32_t num_mappings, uint32_t num_conns) {
+  return sizeof(struct sr_nat_snapshot_hdr) +
+    SR_NAT_SHARDS * sizeof(struct sr_nat_snapshot_shard) +
+    (uint64_t)num_mappings * sizeof(struct sr_nat_snapshot_mapping) +
+    (uint64_t)num_conns * sizeof(struct sr_nat_snapshot_conn);
+}
+
+/* Must be called with every shard lock held */
+uint8_t *snapshot_serialize(struct sr_nat *nat, unsigned int *len) {
+  uint32_t num_mappings = 0, num_conns = 0;
+
+  unsigned int s;
+  for (s = 0; s < SR_NAT_SHARDS; s++) {
+    num_mappings += nat->shards[s].mapping_slab.in_use;
+    num_conns += nat->shards[s].conn_slab.in_use;
+  }
+
+  *len = snapshot_len(num_mappings, num_conns);
+  uint8_t *buf = calloc(1, *len);
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  struct sr_nat_snapshot_hdr *hdr = (struct sr_nat_snapshot_hdr *)buf;
+  hdr->magic = SR_NAT_SNAPSHOT_MAGIC;
+  hdr->version = SR_NAT_SNAPSHOT_VERSION;
+  hdr->num_mappings = num_mappings;
+  hdr->num_conns = num_conns;
+  hdr->num_shards = SR_NAT_SHARDS;
+  hdr->saved = time(NULL);
+
+  uint8_t *pos = buf + sizeof(struct sr_nat_snapshot_hdr);
+
+  for (s = 0; s < SR_NAT_SHARDS; s++) {
+    struct sr_nat_snapshot_shard *shard_rec = (struct sr_nat_snapshot_shard *)pos;
+    shard_rec->tcp_id = nat->shards[s].tcp_id;
+    shard_rec->icmp_id = nat->shards[s].icmp_id;
+    pos += sizeof(struct sr_nat_snapshot_shard);
+  }
+
+  struct sr_nat_mapping *mapping;
+  for (s = 0; s < SR_NAT_SHARDS; s++) {
+    for (mapping = nat->shards[s].mappings; mapping != NULL; mapping = mapping->next) {
+      struct sr_nat_snapshot_mapping *rec = (struct sr_nat_snapshot_mapping *)pos;
+      rec->ip_int = mapping->ip_int;
+      rec->ip_ext = mapping->ip_ext;
+      rec->aux_int = mapping->aux_int;
+      rec->aux_ext = mapping->aux_ext;
+      rec->type = mapping->type;
+      rec->last_updated = mapping->last_updated;
+      pos += sizeof(struct sr_nat_snapshot_mapping);
+
+      struct sr_nat_connection *conn;
+      for (conn = mapping->conns; conn != NULL; conn = conn->next) {
+        struct sr_nat_snapshot_conn *conn_rec = (struct sr_nat_snapshot_conn *)pos;
+        conn_rec->ip_ext = conn->ip_ext;
+        conn_rec->port_ext = conn->port_ext;
+        conn_rec->curr_state = conn->curr_state;
+        conn_rec->last_updated_state = conn->last_updated_state;
+        pos += sizeof(struct sr_nat_snapshot_conn);
+        rec->num_conns++;
+      }
+    }
+  }
+
+  return buf;
+}
+
+/* Written to a temporary file first so a crash mid-write never leaves a torn
+   snapshot behind */
+int snapshot_write_file(const char *path, uint8_t *buf, unsigned int len) {
+  char tmp_path[SNAPSHOT_PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    perror("open");
+    return -1;
+  }
+
+  unsigned int written = 0;
+  while (written < len) {
+    ssize_t ret = write(fd, buf + written, len - written);
+    if (ret == -1) {
+      perror("write");
+      close(fd);
+      unlink(tmp_path);
+      return -1;
+    }
+    written += ret;
+  }
+
+  if (fsync(fd) == -1 || close(fd) == -1 || rename(tmp_path, path) == -1) {
+    perror("nat snapshot");
+    unlink(tmp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Walks every record before anything is restored, so a corrupted file is
+   rejected as a whole instead of being read past its end or restored in
+   part. len is at least the size of the header. */
+bool snapshot_valid(uint8_t *buf, uint64_t len) {
+  struct sr_nat_snapshot_hdr *hdr = (struct sr_nat_snapshot_hdr *)buf;
+  if (hdr->magic != SR_NAT_SNAPSHOT_MAGIC || hdr->version != SR_NAT_SNAPSHOT_VERSION ||
+      hdr->num_shards != SR_NAT_SHARDS || len != snapshot_len(hdr->num_mappings, hdr->num_conns)) {
+    return false;
+  }
+
+  uint64_t off = sizeof(struct sr_nat_snapshot_hdr) + SR_NAT_SHARDS * sizeof(struct sr_nat_snapshot_shard);
+  uint64_t num_conns = 0;
+
+  uint32_t i;
+  for (i = 0; i < hdr->num_mappings; i++) {
+    if (off + sizeof(struct sr_nat_snapshot_mapping) > len) {
+      return false;
+    }
+    struct sr_nat_snapshot_mapping *rec = (struct sr_nat_snapshot_mapping *)(buf + off);
+    off += sizeof(struct sr_nat_snapshot_mapping) +
+      (uint64_t)rec->num_conns * sizeof(struct sr_nat_snapshot_conn);
+    num_conns += rec->num_conns;
+  }
+
+  return off == len && num_conns == hdr->num_conns;
+}
+
+/* Must be called with every shard lock held, before any mappings exist */
+int snapshot_restore(struct sr_nat *nat, uint8_t *buf, uint64_t len) {
+  if (!snapshot_valid(buf, len)) {
+    fprintf(stderr, "Ignoring bad nat snapshot\n");
+    return -1;
+  }
+
+  struct sr_nat_snapshot_hdr *hdr = (struct sr_nat_snapshot_hdr *)buf;
+
+  uint8_t *pos = buf + sizeof(struct sr_nat_snapshot_hdr);
+  struct sr_nat_mapping *tails[SR_NAT_SHARDS];
+  unsigned int restored = 0, dropped = 0;
+
+  uint32_t i;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_snapshot_shard *shard_rec = (struct sr_nat_snapshot_shard *)pos;
+    nat->shards[i].tcp_id = shard_rec->tcp_id;
+    nat->shards[i].icmp_id = shard_rec->icmp_id;
+    nat->shards[i].generation++;
+    tails[i] = NULL;
+    pos += sizeof(struct sr_nat_snapshot_shard);
+  }
+
+  for (i = 0; i < hdr->num_mappings; i++) {
+    struct sr_nat_snapshot_mapping *rec = (struct sr_nat_snapshot_mapping *)pos;
+    pos += sizeof(struct sr_nat_snapshot_mapping);
+
+    /* Lookups from either side have to land on the shard holding the mapping,
+       so a record whose two keys disagree can't be placed anywhere */
+    struct sr_nat_shard *shard = sr_nat_shard_for_external(nat, rec->aux_ext);
+    struct sr_nat_mapping *mapping = NULL;
+    if (shard == sr_nat_shard_for_internal(nat, rec->ip_int, rec->aux_int)) {
+      mapping = sr_slab_alloc(&(shard->mapping_slab));
+    }
+    if (mapping == NULL) {
+      pos += rec->num_conns * sizeof(struct sr_nat_snapshot_conn);
+      dropped++;
+      continue;
+    }
+
+    mapping->type = rec->type;
+    mapping->ip_int = rec->ip_int;
+    mapping->ip_ext = rec->ip_ext;
+    mapping->aux_int = rec->aux_int;
+    mapping->aux_ext = rec->aux_ext;
+    mapping->last_updated = rec->last_updated;
+
+    uint32_t j;
+    for (j = 0; j < rec->num_conns; j++) {
+      struct sr_nat_snapshot_conn *conn_rec = (struct sr_nat_snapshot_conn *)pos;
+      pos += sizeof(struct sr_nat_snapshot_conn);
+
+      struct sr_nat_connection *conn = sr_slab_alloc(&(shard->conn_slab));
+      if (conn == NULL) {
+        continue;
+      }
+      conn->ip_ext = conn_rec->ip_ext;
+      conn->port_ext = conn_rec->port_ext;
+      conn->curr_state = conn_rec->curr_state;
+      conn->last_updated_state = conn_rec->last_updated_state;
+      conn->next = mapping->conns;
+      mapping->conns = conn;
+    }
+
+    /* Appended so the table keeps the order it was saved in */
+    unsigned int idx = shard - nat->shards;
+    if (tails[idx] == NULL) {
+      shard->mappings = mapping;
+    } else {
+      tails[idx]->next = mapping;
+    }
+    tails[idx] = mapping;
+    restored++;
+  }
+
+  fprintf(stderr, "Restored %u nat mappings from snapshot taken %.0f seconds ago (%u didn't fit)\n",
+    restored, difftime(time(NULL), (time_t)hdr->saved), dropped);
+
+  return 0;
+}
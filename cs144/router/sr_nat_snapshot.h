@@ -0,0 +1,63 @@
+#ifndef SR_NAT_SNAPSHOT_H
+#define SR_NAT_SNAPSHOT_H
+
+#include <inttypes.h>
+
+#include "sr_nat.h"
+
+#define SR_NAT_SNAPSHOT_MAGIC 0x534e4154 /* "SNAT" */
+#define SR_NAT_SNAPSHOT_VERSION 2
+#define SR_NAT_SNAPSHOT_DEFAULT_INTERVAL 10 /* seconds between periodic snapshots */
+
+/* A snapshot is the header, the allocator state of each shard, then every
+   mapping, each one followed by its connections. Records are fixed size and
+   in host byte order, since the file is only meant to be read back by a
+   restarted router on the same machine.
+   Timestamps are absolute, so idle timeouts carry on where they left off. */
+struct sr_nat_snapshot_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_mappings;
+  uint32_t num_conns;
+  uint32_t num_shards; /* a snapshot only restores into the same # of shards */
+  uint32_t pad;
+  int64_t saved;
+};
+
+struct sr_nat_snapshot_shard {
+  uint16_t tcp_id; /* next external port the shard's allocator hands out */
+  uint16_t icmp_id; /* next external icmp id the shard's allocator hands out */
+};
+
+struct sr_nat_snapshot_mapping {
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  uint32_t type;
+  uint32_t num_conns;
+  uint32_t pad;
+  int64_t last_updated;
+};
+
+struct sr_nat_snapshot_conn {
+  uint32_t ip_ext;
+  uint16_t port_ext;
+  uint8_t curr_state;
+  uint8_t pad;
+  int64_t last_updated_state;
+};
+
+/* Writes the nat tables to path, atomically replacing any older snapshot.
+   Returns 0 on success. */
+int sr_nat_save_snapshot(struct sr_nat *nat, const char *path);
+
+/* Restores the tables from a snapshot written by sr_nat_save_snapshot. Must be
+   called before the router starts handling packets. Returns 0 on success. */
+int sr_nat_load_snapshot(struct sr_nat *nat, const char *path);
+
+/* Waits for SIGTERM or SIGINT, writes a final snapshot and exits. Those
+   signals must be blocked in every other thread. */
+void *sr_nat_snapshot_on_signal(void *sr_ptr);
+
+#endif /* -- SR_NAT_SNAPSHOT_H -- */
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <netinet/tcp.h>
+
+#include "sr_protocol.h"
+#include "sr_icmp.h"
+#include "sr_pkt.h"
+#include "sr_utils.h"
+
+#define TCP_CKSUM_OFFSET 16
+#define UDP_CKSUM_OFFSET 6
+#define UDP_HDR_LEN 8
+#define ICMP_HDR_LEN 8 /* type, code, checksum and the 4 type specific bytes */
+
+void pkt_parse_l4(struct sr_pkt_desc *desc);
+void pkt_update_pseudo_hdr_cksum(struct sr_pkt_desc *desc, uint32_t old_val, uint32_t new_val);
+void pkt_set_port(struct sr_pkt_desc *desc, unsigned int offset, uint16_t port);
+void pkt_set_icmp_id(struct sr_pkt_desc *desc, uint16_t id);
+
+bool sr_pkt_parse(struct sr_pkt_desc *desc, uint8_t *buf, unsigned int len, unsigned int iface) {
+  memset(desc, 0, sizeof(struct sr_pkt_desc));
+  desc->buf = buf;
+  desc->len = len;
+  desc->iface = iface;
+
+  if (len < sizeof(sr_ethernet_hdr_t)) {
+    return false;
+  }
+
+  sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)buf;
+  desc->ether_type = ntohs(e_hdr->ether_type);
+
+  if (desc->ether_type != ethertype_ip || len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+    return true;
+  }
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+  unsigned int ip_hl = ip_hdr->ip_hl * 4;
+  unsigned int ip_len = ntohs(ip_hdr->ip_len);
+
+  if (ip_hl < sizeof(sr_ip_hdr_t) || ip_len < ip_hl || ip_len > len - sizeof(sr_ethernet_hdr_t)) {
+    return true;
+  }
+
+  desc->ip_hdr = ip_hdr;
+  desc->ip_hl = ip_hl;
+  desc->ip_len = ip_len;
+  desc->ip_off = ntohs(ip_hdr->ip_off);
+  desc->ip_ttl = ip_hdr->ip_ttl;
+  desc->ip_p = ip_hdr->ip_p;
+  desc->ip_src = ntohl(ip_hdr->ip_src);
+  desc->ip_dst = ntohl(ip_hdr->ip_dst);
+
+  /* Only the first fragment carries the transport header */
+  if ((desc->ip_off & IP_OFFMASK) == 0) {
+    pkt_parse_l4(desc);
+  }
+
+  return true;
+}
+
+void pkt_parse_l4(struct sr_pkt_desc *desc) {
+  uint8_t *l4_hdr = ((uint8_t *)desc->ip_hdr) + desc->ip_hl;
+  unsigned int l4_len = desc->ip_len - desc->ip_hl;
+
+  if (desc->ip_p == ip_protocol_tcp && l4_len >= sizeof(struct tcphdr)) {
+    struct tcphdr *tcp_hdr = (struct tcphdr *)l4_hdr;
+    desc->aux_src = ntohs(tcp_hdr->source);
+    desc->aux_dst = ntohs(tcp_hdr->dest);
+    desc->tcp_flags = l4_hdr[13];
+  } else if (desc->ip_p == ip_protocol_udp && l4_len >= UDP_HDR_LEN) {
+    desc->aux_src = ntohs(*(uint16_t *)l4_hdr);
+    desc->aux_dst = ntohs(*(uint16_t *)(l4_hdr + 2));
+  } else if (desc->ip_p == ip_protocol_icmp && l4_len >= ICMP_HDR_LEN) {
+    sr_icmp_t3_hdr_t *icmp_hdr = (sr_icmp_t3_hdr_t *)l4_hdr;
+    desc->icmp_type = icmp_hdr->icmp_type;
+    if (desc->icmp_type == ECHO_REQUEST || desc->icmp_type == ECHO_REPLY) {
+      desc->aux_src = ntohs(icmp_hdr->iden);
+      desc->aux_dst = desc->aux_src;
+    }
+  } else {
+    return;
+  }
+
+  desc->l4_hdr = l4_hdr;
+  desc->l4_len = l4_len;
+}
+
+void sr_pkt_set_ip_src(struct sr_pkt_desc *desc, uint32_t ip_src) {
+  uint32_t old_val = desc->ip_hdr->ip_src;
+  uint32_t new_val = htonl(ip_src);
+
+  desc->ip_hdr->ip_src = new_val;
+  desc->ip_hdr->ip_sum = cksum_update32(desc->ip_hdr->ip_sum, old_val, new_val);
+  pkt_update_pseudo_hdr_cksum(desc, old_val, new_val);
+
+  desc->ip_src = ip_src;
+}
+
+void sr_pkt_set_ip_dst(struct sr_pkt_desc *desc, uint32_t ip_dst) {
+  uint32_t old_val = desc->ip_hdr->ip_dst;
+  uint32_t new_val = htonl(ip_dst);
+
+  desc->ip_hdr->ip_dst = new_val;
+  desc->ip_hdr->ip_sum = cksum_update32(desc->ip_hdr->ip_sum, old_val, new_val);
+  pkt_update_pseudo_hdr_cksum(desc, old_val, new_val);
+
+  desc->ip_dst = ip_dst;
+}
+
+void sr_pkt_set_aux_src(struct sr_pkt_desc *desc, uint16_t aux_src) {
+  if (desc->ip_p == ip_protocol_icmp) {
+    pkt_set_icmp_id(desc, aux_src);
+  } else {
+    pkt_set_port(desc, 0, aux_src);
+    desc->aux_src = aux_src;
+  }
+}
+
+void sr_pkt_set_aux_dst(struct sr_pkt_desc *desc, uint16_t aux_dst) {
+  if (desc->ip_p == ip_protocol_icmp) {
+    pkt_set_icmp_id(desc, aux_dst);
+  } else {
+    pkt_set_port(desc, 2, aux_dst);
+    desc->aux_dst = aux_dst;
+  }
+}
+
+/* The TTL shares a 16 bit word with the protocol, so that is the word the
+   checksum update is computed over. */
+void sr_pkt_dec_ttl(struct sr_pkt_desc *desc) {
+  uint8_t *ttl_word = &(desc->ip_hdr->ip_ttl);
+  uint16_t old_val, new_val;
+
+  memcpy(&old_val, ttl_word, sizeof(uint16_t));
+  desc->ip_hdr->ip_ttl--;
+  memcpy(&new_val, ttl_word, sizeof(uint16_t));
+
+  desc->ip_hdr->ip_sum = cksum_update16(desc->ip_hdr->ip_sum, old_val, new_val);
+  desc->ip_ttl = desc->ip_hdr->ip_ttl;
+}
+
+/* TCP and UDP checksums cover the IP addresses through the pseudo header, so
+   they need to be patched whenever an address is rewritten. */
+void pkt_update_pseudo_hdr_cksum(struct sr_pkt_desc *desc, uint32_t old_val, uint32_t new_val) {
+  if (desc->l4_hdr == NULL) {
+    return;
+  }
+
+  if (desc->ip_p == ip_protocol_tcp) {
+    uint16_t *sum = (uint16_t *)(desc->l4_hdr + TCP_CKSUM_OFFSET);
+    *sum = cksum_update32(*sum, old_val, new_val);
+  } else if (desc->ip_p == ip_protocol_udp) {
+    /* A zero UDP checksum means the sender didn't compute one */
+    uint16_t *sum = (uint16_t *)(desc->l4_hdr + UDP_CKSUM_OFFSET);
+    if (*sum != 0) {
+      *sum = cksum_update32(*sum, old_val, new_val);
+    }
+  }
+}
+
+void pkt_set_port(struct sr_pkt_desc *desc, unsigned int offset, uint16_t port) {
+  if (desc->l4_hdr == NULL) {
+    return;
+  }
+
+  uint16_t *field = (uint16_t *)(desc->l4_hdr + offset);
+  uint16_t old_val = *field;
+  uint16_t new_val = htons(port);
+  *field = new_val;
+
+  if (desc->ip_p == ip_protocol_tcp) {
+    uint16_t *sum = (uint16_t *)(desc->l4_hdr + TCP_CKSUM_OFFSET);
+    *sum = cksum_update16(*sum, old_val, new_val);
+  } else {
+    uint16_t *sum = (uint16_t *)(desc->l4_hdr + UDP_CKSUM_OFFSET);
+    if (*sum != 0) {
+      *sum = cksum_update16(*sum, old_val, new_val);
+    }
+  }
+}
+
+void pkt_set_icmp_id(struct sr_pkt_desc *desc, uint16_t id) {
+  if (desc->l4_hdr == NULL) {
+    return;
+  }
+
+  sr_icmp_t3_hdr_t *icmp_hdr = (sr_icmp_t3_hdr_t *)desc->l4_hdr;
+  uint16_t old_val = icmp_hdr->iden;
+  uint16_t new_val = htons(id);
+
+  icmp_hdr->iden = new_val;
+  icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_val, new_val);
+
+  desc->aux_src = id;
+  desc->aux_dst = id;
+}
@@ -0,0 +1,51 @@
+#ifndef SR_PKT_H
+#define SR_PKT_H
+
+#include <stdbool.h>
+
+#include "sr_protocol.h"
+
+/* Describes a received frame. It is filled in once by sr_pkt_parse when the
+   frame arrives and then handed to every stage instead of the raw headers.
+   The frame itself always stays in network byte order; the key fields copied
+   out below are in host byte order. Stages that rewrite the frame must go
+   through the sr_pkt_set_* helpers, which keep the frame, its checksums and
+   the descriptor in sync. */
+struct sr_pkt_desc {
+  uint8_t *buf; /* ethernet frame */
+  unsigned int len; /* length of the ethernet frame */
+  unsigned int iface; /* index of the receiving interface */
+
+  uint16_t ether_type;
+
+  /* IP fields. ip_hdr is NULL unless this is a well-formed IP packet */
+  sr_ip_hdr_t *ip_hdr;
+  unsigned int ip_hl; /* IP header length in bytes */
+  uint16_t ip_len;
+  uint16_t ip_off;
+  uint8_t ip_ttl;
+  uint8_t ip_p;
+  uint32_t ip_src;
+  uint32_t ip_dst;
+
+  /* Transport fields. l4_hdr is NULL unless the packet carries a complete
+     TCP, UDP or ICMP header */
+  uint8_t *l4_hdr;
+  unsigned int l4_len; /* transport header + payload */
+  uint16_t aux_src; /* TCP/UDP source port or ICMP echo identifier */
+  uint16_t aux_dst; /* TCP/UDP destination port or ICMP echo identifier */
+  uint8_t tcp_flags;
+  uint8_t icmp_type;
+};
+
+/* Fills in desc for the given frame. Returns false if the frame is too short
+   to hold an ethernet header. */
+bool sr_pkt_parse(struct sr_pkt_desc *desc, uint8_t *buf, unsigned int len, unsigned int iface);
+
+void sr_pkt_set_ip_src(struct sr_pkt_desc *desc, uint32_t ip_src);
+void sr_pkt_set_ip_dst(struct sr_pkt_desc *desc, uint32_t ip_dst);
+void sr_pkt_set_aux_src(struct sr_pkt_desc *desc, uint16_t aux_src);
+void sr_pkt_set_aux_dst(struct sr_pkt_desc *desc, uint16_t aux_dst);
+void sr_pkt_dec_ttl(struct sr_pkt_desc *desc);
+
+#endif /* -- SR_PKT_H -- */
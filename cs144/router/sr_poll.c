@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "sr_poll.h"
+
+int poll_parse_cpus(struct sr_poll *poll, const char *cpus);
+int poll_cmp_samples(const void *a, const void *b);
+
+int sr_poll_init(struct sr_poll *poll, bool busy_poll, const char *cpus) {
+  memset(poll, 0, sizeof(struct sr_poll));
+  poll->busy_poll = busy_poll;
+  poll->dataplane_cpu = -1;
+  CPU_ZERO(&(poll->housekeeping));
+
+  if (cpus == NULL) {
+    if (busy_poll) {
+      fprintf(stderr, "Busy polling without -P, the reader shares its CPU with every other thread\n");
+    }
+    return 0;
+  }
+
+  if (poll_parse_cpus(poll, cpus) != 0) {
+    fprintf(stderr, "Bad CPU list %s\n", cpus);
+    return -1;
+  }
+
+  /* With only the reader's CPU given, everything else goes wherever it isn't */
+  if (CPU_COUNT(&(poll->housekeeping)) == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu;
+    for (cpu = 0; cpu < online && cpu < CPU_SETSIZE; cpu++) {
+      if (cpu != poll->dataplane_cpu) {
+        CPU_SET(cpu, &(poll->housekeeping));
+      }
+    }
+  }
+
+  if (CPU_COUNT(&(poll->housekeeping)) == 0) {
+    fprintf(stderr, "No CPU left for the other threads, sharing CPU %d with them\n", poll->dataplane_cpu);
+    CPU_SET(poll->dataplane_cpu, &(poll->housekeeping));
+  }
+
+  poll->pinned = true;
+  return 0;
+}
+
+void sr_poll_pin_housekeeping(struct sr_poll *poll) {
+  if (!poll->pinned) {
+    return;
+  }
+
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &(poll->housekeeping));
+  if (err != 0) {
+    fprintf(stderr, "Unable to pin threads to the housekeeping CPUs: %s\n", strerror(err));
+  }
+}
+
+void sr_poll_pin_dataplane(struct sr_poll *poll) {
+  if (!poll->pinned) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(poll->dataplane_cpu, &set);
+
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+  if (err != 0) {
+    fprintf(stderr, "Unable to pin the reader to CPU %d: %s\n", poll->dataplane_cpu, strerror(err));
+  }
+}
+
+void sr_poll_housekeeping_attr(struct sr_poll *poll, pthread_attr_t *attr) {
+  if (poll->pinned) {
+    pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &(poll->housekeeping));
+  }
+}
+
+void sr_poll_stamp_now(struct sr_poll *poll) {
+  clock_gettime(CLOCK_REALTIME, &(poll->rx_stamp));
+}
+
+void sr_poll_record(struct sr_poll *poll) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  int64_t ns = (int64_t)(now.tv_sec - poll->rx_stamp.tv_sec) * 1000000000 + (now.tv_nsec - poll->rx_stamp.tv_nsec);
+  if (ns < 0) {
+    ns = 0;
+  } else if (ns > UINT32_MAX) {
+    ns = UINT32_MAX;
+  }
+
+  poll->samples[poll->count % SR_POLL_SAMPLES] = ns;
+  poll->count++;
+}
+
+void sr_poll_report(struct sr_poll *poll) {
+  unsigned long n = poll->count < SR_POLL_SAMPLES ? poll->count : SR_POLL_SAMPLES;
+  if (n == 0) {
+    return;
+  }
+
+  uint32_t *sorted = malloc(n * sizeof(uint32_t));
+  if (sorted == NULL) {
+    return;
+  }
+  memcpy(sorted, poll->samples, n * sizeof(uint32_t));
+  qsort(sorted, n, sizeof(uint32_t), poll_cmp_samples);
+
+  fprintf(stderr, "%s reader%s: %lu packets, latency us p50 %.1f p99 %.1f p999 %.1f max %.1f (of the last %lu)\n",
+    poll->busy_poll ? "busy-poll" : "blocking",
+    poll->pinned ? " (pinned)" : "",
+    poll->count,
+    sorted[n * 50 / 100] / 1000.0,
+    sorted[n * 99 / 100] / 1000.0,
+    sorted[n * 999 / 1000] / 1000.0,
+    sorted[n - 1] / 1000.0,
+    n);
+
+  free(sorted);
+}
+
+/* Takes "a,b,c-d". The first CPU is the reader's, the rest are housekeeping. */
+int poll_parse_cpus(struct sr_poll *poll, const char *cpus) {
+  const char *pos = cpus;
+
+  while (*pos != '\0') {
+    char *end;
+    long first = strtol(pos, &end, 10);
+    long last = first;
+    if (end == pos) {
+      return -1;
+    }
+    if (*end == '-') {
+      pos = end + 1;
+      last = strtol(pos, &end, 10);
+      if (end == pos) {
+        return -1;
+      }
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return -1;
+    }
+
+    long cpu;
+    for (cpu = first; cpu <= last; cpu++) {
+      if (poll->dataplane_cpu == -1) {
+        poll->dataplane_cpu = cpu;
+      } else if (cpu != poll->dataplane_cpu) {
+        CPU_SET(cpu, &(poll->housekeeping));
+      }
+    }
+
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    pos = end;
+  }
+
+  return poll->dataplane_cpu == -1 ? -1 : 0;
+}
+
+int poll_cmp_samples(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
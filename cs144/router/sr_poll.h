@@ -0,0 +1,50 @@
+#ifndef SR_POLL_H
+#define SR_POLL_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define SR_POLL_SAMPLES 65536 /* latencies kept for the percentiles, the most recent ones win */
+
+/* How the thread reading from the server waits for packets, and where the
+   router's threads run.
+
+   In busy-poll mode the reader never sleeps: it spins on non-blocking reads,
+   so a packet is picked up as soon as it reaches the socket rather than
+   after the scheduler gets around to waking the thread. With a CPU list the
+   reader is pinned to the first CPU and every other thread (timeouts, egress,
+   snapshots) to the rest, so the spinning core isn't shared.
+
+   Per-packet latency is measured from when the kernel received the data (or
+   when the ring reported it with io_uring) to when sr_handlepacket returned. */
+struct sr_poll {
+  bool busy_poll;
+  bool pinned;
+  int dataplane_cpu;
+  cpu_set_t housekeeping;
+
+  struct timespec rx_stamp; /* CLOCK_REALTIME, when the packet being handled reached the socket */
+  uint32_t samples[SR_POLL_SAMPLES]; /* ns, saturating */
+  unsigned long count;
+};
+
+/* cpus is NULL or a list like "2,3" or "2-5", the first being the reader's.
+   Returns 0 on success, -1 if the list can't be used. */
+int sr_poll_init(struct sr_poll *poll, bool busy_poll, const char *cpus);
+
+/* Pins the calling thread to the housekeeping CPUs, so every thread it
+   creates afterwards starts there too */
+void sr_poll_pin_housekeeping(struct sr_poll *poll);
+void sr_poll_pin_dataplane(struct sr_poll *poll);
+
+/* Makes threads created with attr run on the housekeeping CPUs */
+void sr_poll_housekeeping_attr(struct sr_poll *poll, pthread_attr_t *attr);
+
+void sr_poll_stamp_now(struct sr_poll *poll);
+void sr_poll_record(struct sr_poll *poll);
+void sr_poll_report(struct sr_poll *poll);
+
+#endif /* -- SR_POLL_H -- */
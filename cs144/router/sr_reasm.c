@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_icmp.h"
+#include "sr_reasm.h"
+#include "sr_utils.h"
+
+struct sr_reasm_ctx *reasm_lookup(struct sr_reasm *reasm, struct sr_pkt_desc *desc);
+struct sr_reasm_ctx *reasm_alloc(struct sr_reasm *reasm, struct sr_pkt_desc *desc);
+void reasm_free(struct sr_reasm *reasm, struct sr_reasm_ctx *ctx);
+void reasm_mark_recvd(struct sr_reasm_ctx *ctx, unsigned int offset, unsigned int len);
+void reasm_build_frame(struct sr_reasm_ctx *ctx, struct sr_pkt_desc *desc);
+
+void sr_reasm_init(struct sr_reasm *reasm) {
+  memset(reasm->slots, 0, sizeof(reasm->slots));
+  reasm->dropped = 0;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&(reasm->lock), &attr);
+}
+
+struct sr_reasm_ctx *sr_reasm_add(struct sr_reasm *reasm, struct sr_pkt_desc *desc) {
+  unsigned int offset = (desc->ip_off & IP_OFFMASK) * 8;
+  unsigned int len = desc->ip_len - desc->ip_hl;
+  bool more_frags = (desc->ip_off & IP_MF) != 0;
+  uint8_t *data = ((uint8_t *)desc->ip_hdr) + desc->ip_hl;
+
+  /* Every fragment but the last has to carry a multiple of 8 bytes */
+  if (len == 0 || (more_frags && len % 8 != 0) || offset + len > SR_REASM_MAX_PAYLOAD) {
+    reasm->dropped++;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&(reasm->lock));
+
+  struct sr_reasm_ctx *ctx = reasm_lookup(reasm, desc);
+  if (ctx == NULL) {
+    ctx = reasm_alloc(reasm, desc);
+    if (ctx == NULL) {
+      reasm->dropped++;
+      pthread_mutex_unlock(&(reasm->lock));
+      return NULL;
+    }
+  }
+
+  /* Fragments that disagree about where the datagram ends mean it can't be
+     put back together */
+  unsigned int end = offset + len;
+  bool bad_len = ctx->payload_len != 0 && (end > ctx->payload_len || (!more_frags && end != ctx->payload_len));
+  bad_len = bad_len || (!more_frags && ctx->max_end > end);
+  if (bad_len) {
+    reasm->dropped++;
+    reasm_free(reasm, ctx);
+    pthread_mutex_unlock(&(reasm->lock));
+    return NULL;
+  }
+
+  if (!more_frags) {
+    ctx->payload_len = end;
+  }
+  if (end > ctx->max_end) {
+    ctx->max_end = end;
+  }
+
+  uint8_t *payload = ctx->buf + SR_REASM_HDR_ROOM;
+  memcpy(payload + offset, data, len);
+
+  if (offset == 0) {
+    ctx->ip_hl = desc->ip_hl;
+    memcpy(payload - desc->ip_hl, desc->ip_hdr, desc->ip_hl);
+  }
+
+  reasm_mark_recvd(ctx, offset, len);
+
+  bool complete = ctx->payload_len != 0 && ctx->ip_hl != 0 &&
+    ctx->blocks_recvd == (ctx->payload_len + 7) / 8;
+  if (complete && ctx->ip_hl + ctx->payload_len > USHRT_MAX) {
+    reasm->dropped++;
+    reasm_free(reasm, ctx);
+    pthread_mutex_unlock(&(reasm->lock));
+    return NULL;
+  } else if (complete) {
+    reasm_build_frame(ctx, desc);
+    ctx->delivering = true;
+  }
+
+  pthread_mutex_unlock(&(reasm->lock));
+
+  return complete ? ctx : NULL;
+}
+
+void sr_reasm_release(struct sr_reasm *reasm, struct sr_reasm_ctx *ctx) {
+  pthread_mutex_lock(&(reasm->lock));
+  reasm_free(reasm, ctx);
+  pthread_mutex_unlock(&(reasm->lock));
+}
+
+void *sr_reasm_timeout(void *sr_ptr) {
+  struct sr_instance *sr = (struct sr_instance *)sr_ptr;
+  struct sr_reasm *reasm = sr->reasm;
+
+  while (1) {
+    sleep(1.0);
+    pthread_mutex_lock(&(reasm->lock));
+
+    time_t curtime = time(NULL);
+
+    int i;
+    for (i = 0; i < SR_REASM_SLOTS; i++) {
+      struct sr_reasm_ctx *ctx = &(reasm->slots[i]);
+      if (!ctx->in_use || ctx->delivering || difftime(curtime, ctx->started) < SR_REASM_TIMEOUT) {
+        continue;
+      }
+
+      /* Only tell the source if we got the first fragment (RFC 792) */
+      if (ctx->ip_hl != 0) {
+        uint8_t *orig_ip_hdr = ctx->buf + SR_REASM_HDR_ROOM - ctx->ip_hl;
+        sr_send_icmp_time_exceeded_pkt(sr, FRAG_TTL_EXCEEDED, (sr_ip_hdr_t *)orig_ip_hdr);
+      }
+
+      reasm_free(reasm, ctx);
+    }
+
+    pthread_mutex_unlock(&(reasm->lock));
+  }
+
+  return NULL;
+}
+
+struct sr_reasm_ctx *reasm_lookup(struct sr_reasm *reasm, struct sr_pkt_desc *desc) {
+  uint16_t ip_id = ntohs(desc->ip_hdr->ip_id);
+
+  int i;
+  for (i = 0; i < SR_REASM_SLOTS; i++) {
+    struct sr_reasm_ctx *ctx = &(reasm->slots[i]);
+    if (ctx->in_use && !ctx->delivering && ctx->ip_src == desc->ip_src && ctx->ip_dst == desc->ip_dst &&
+        ctx->ip_id == ip_id && ctx->ip_p == desc->ip_p) {
+      return ctx;
+    }
+  }
+
+  return NULL;
+}
+
+struct sr_reasm_ctx *reasm_alloc(struct sr_reasm *reasm, struct sr_pkt_desc *desc) {
+  struct sr_reasm_ctx *free_slot = NULL, *oldest = NULL;
+  int from_src = 0;
+
+  int i;
+  for (i = 0; i < SR_REASM_SLOTS; i++) {
+    struct sr_reasm_ctx *ctx = &(reasm->slots[i]);
+    if (!ctx->in_use) {
+      if (free_slot == NULL) {
+        free_slot = ctx;
+      }
+    } else if (!ctx->delivering) {
+      if (ctx->ip_src == desc->ip_src) {
+        from_src++;
+      }
+      if (oldest == NULL || ctx->started < oldest->started) {
+        oldest = ctx;
+      }
+    }
+  }
+
+  if (from_src >= SR_REASM_PER_SRC) {
+    return NULL;
+  }
+
+  if (free_slot == NULL) {
+    if (oldest == NULL) {
+      return NULL;
+    }
+    reasm_free(reasm, oldest);
+    free_slot = oldest;
+  }
+
+  free_slot->in_use = true;
+  free_slot->ip_src = desc->ip_src;
+  free_slot->ip_dst = desc->ip_dst;
+  free_slot->ip_id = ntohs(desc->ip_hdr->ip_id);
+  free_slot->ip_p = desc->ip_p;
+  free_slot->started = time(NULL);
+
+  return free_slot;
+}
+
+void reasm_free(struct sr_reasm *reasm, struct sr_reasm_ctx *ctx) {
+  ctx->in_use = false;
+  ctx->delivering = false;
+  ctx->payload_len = 0;
+  ctx->max_end = 0;
+  ctx->ip_hl = 0;
+  ctx->blocks_recvd = 0;
+  ctx->frame = NULL;
+  ctx->frame_len = 0;
+  memset(ctx->recvd, 0, sizeof(ctx->recvd));
+}
+
+void reasm_mark_recvd(struct sr_reasm_ctx *ctx, unsigned int offset, unsigned int len) {
+  unsigned int block;
+  for (block = offset / 8; block < (offset + len + 7) / 8; block++) {
+    uint8_t bit = 1 << (block % 8);
+    if ((ctx->recvd[block / 8] & bit) == 0) {
+      ctx->recvd[block / 8] |= bit;
+      ctx->blocks_recvd++;
+    }
+  }
+}
+
+/* Lays the ethernet hdr of the last fragment and the IP hdr of the first one
+   in front of the payload, fixing up the IP hdr to describe the whole datagram */
+void reasm_build_frame(struct sr_reasm_ctx *ctx, struct sr_pkt_desc *desc) {
+  uint8_t *payload = ctx->buf + SR_REASM_HDR_ROOM;
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(payload - ctx->ip_hl);
+  ctx->frame = ((uint8_t *)ip_hdr) - sizeof(sr_ethernet_hdr_t);
+  ctx->frame_len = sizeof(sr_ethernet_hdr_t) + ctx->ip_hl + ctx->payload_len;
+
+  memcpy(ctx->frame, desc->buf, sizeof(sr_ethernet_hdr_t));
+
+  ip_hdr->ip_len = htons(ctx->ip_hl + ctx->payload_len);
+  ip_hdr->ip_off = 0;
+  ip_hdr->ip_sum = 0;
+  ip_hdr->ip_sum = cksum(ip_hdr, ctx->ip_hl);
+}
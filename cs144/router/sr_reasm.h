@@ -0,0 +1,65 @@
+#ifndef SR_REASM_H
+#define SR_REASM_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sr_protocol.h"
+#include "sr_pkt.h"
+
+#define SR_REASM_SLOTS 32 /* # of datagrams that can be reassembled at once */
+#define SR_REASM_PER_SRC 4 /* # of slots a single source IP may hold */
+#define SR_REASM_TIMEOUT 15 /* seconds to wait for the rest of a datagram */
+#define SR_REASM_MAX_PAYLOAD 65535 /* largest reassembled payload */
+#define SR_IP_MAX_HDR_LEN 60
+
+/* Room left in front of the payload for the ethernet and IP hdrs, so the
+   whole frame can be handed back without copying the payload again */
+#define SR_REASM_HDR_ROOM (sizeof(sr_ethernet_hdr_t) + SR_IP_MAX_HDR_LEN)
+
+struct sr_reasm_ctx {
+  bool in_use;
+  bool delivering; /* handed back by sr_reasm_add, waiting for sr_reasm_release */
+
+  /* Fragments belong to the same datagram if these all match (RFC 791) */
+  uint32_t ip_src;
+  uint32_t ip_dst;
+  uint16_t ip_id;
+  uint8_t ip_p;
+
+  time_t started;
+  unsigned int payload_len; /* known once the last fragment arrives, 0 until then */
+  unsigned int max_end; /* furthest payload byte any fragment reached */
+  unsigned int ip_hl; /* hdr length of the first fragment, 0 until it arrives */
+  unsigned int blocks_recvd; /* # of distinct 8 byte blocks received */
+  uint8_t recvd[SR_REASM_MAX_PAYLOAD / 64 + 1]; /* bitmap of received 8 byte blocks */
+
+  /* The first fragment's IP hdr is kept right in front of the payload */
+  uint8_t buf[SR_REASM_HDR_ROOM + SR_REASM_MAX_PAYLOAD];
+
+  uint8_t *frame; /* the reassembled ethernet frame, set once complete */
+  unsigned int frame_len;
+};
+
+/* All slots are allocated up front, so fragments can never make the router
+   allocate more memory. A source that already holds SR_REASM_PER_SRC slots has
+   its new datagrams dropped, and when every slot is taken the oldest datagram
+   is abandoned to make room. */
+struct sr_reasm {
+  struct sr_reasm_ctx slots[SR_REASM_SLOTS];
+  unsigned long dropped; /* fragments dropped because of quotas or bad offsets */
+  pthread_mutex_t lock;
+};
+
+void sr_reasm_init(struct sr_reasm *reasm);
+
+/* Adds the fragment in desc to its datagram. Returns the context if that
+   completed the datagram, NULL otherwise. The caller must give a returned
+   context back with sr_reasm_release once it is done with ctx->frame. */
+struct sr_reasm_ctx *sr_reasm_add(struct sr_reasm *reasm, struct sr_pkt_desc *desc);
+void sr_reasm_release(struct sr_reasm *reasm, struct sr_reasm_ctx *ctx);
+
+void *sr_reasm_timeout(void *sr_ptr);
+
+#endif /* -- SR_REASM_H -- */
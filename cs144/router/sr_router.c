@@ -28,20 +28,14 @@
 #include "sr_ip.h"
 #include "sr_eth.h"
 #include "sr_nat_handler.h"
+#include "sr_pkt.h"
+#include "sr_flow.h"
+#include "sr_reasm.h"
+#include "sr_poll.h"
 
-void sr_recv_ip_pkt(
-  struct sr_instance* sr,
-  sr_ethernet_hdr_t* e_hdr,
-  unsigned int len,
-  char *interface
-);
+void sr_recv_ip_pkt(struct sr_instance* sr, struct sr_pkt_desc *desc);
 
-void sr_recv_arp_pkt(
-  struct sr_instance* sr,
-  sr_ethernet_hdr_t* e_hdr,
-  unsigned int len,
-  char* interface
-);
+void sr_recv_arp_pkt(struct sr_instance* sr, struct sr_pkt_desc *desc);
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -57,30 +51,36 @@ void sr_init(struct sr_instance* sr)
     assert(sr);
 
     /* Initialize cache and cache cleanup thread */
-    sr_arpcache_init(&(sr->cache));
+    sr_arpcache_init(&(sr->cache), sr->arp_max_reqs);
 
     pthread_attr_init(&(sr->attr));
     pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
+    sr_poll_housekeeping_attr(sr->poll, &(sr->attr));
     pthread_t thread;
 
     pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+
+    sr->reasm = calloc(1, sizeof(struct sr_reasm));
+    sr_reasm_init(sr->reasm);
+    pthread_create(&thread, &(sr->attr), sr_reasm_timeout, sr);
     
     /* Add initialization code here! */
 } /* -- sr_init -- */
 
 /*---------------------------------------------------------------------
- * Method: sr_handlepacket(uint8_t* p,char* interface)
+ * Method: sr_handlepacket(uint8_t* p,unsigned int interface)
  * Scope:  Global
  *
  * This method is called each time the router receives a packet on the
  * interface.  The packet buffer, the packet length and the receiving
  * interface are passed in as parameters. The packet is complete with
- * ethernet headers.
+ * ethernet headers. The interface is its index in sr->if_table, resolved
+ * from the name VNS gives us by sr_vns_comm.c.
  *
- * Note: Both the packet buffer and the character's memory are handled
- * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
+ * Note: The packet buffer is handled by sr_vns_comm.c that means do
+ * NOT delete it.  Make a copy of the
  * packet instead if you intend to keep it around beyond the scope of
  * the method call.
  *
@@ -90,57 +90,78 @@ void sr_handlepacket(
     struct sr_instance* sr,
     uint8_t * packet/* lent */,
     unsigned int len,
-    char* interface/* lent */
+    unsigned int interface
 ) {
   /* REQUIRES */
   assert(sr);
   assert(packet);
-  assert(interface);
 
   printf("*** -> Received packet of length %d \n", len);
 
-  int minlength = sizeof(sr_ethernet_hdr_t);
-  if (len < minlength) {
+  /* The frame stays in network byte order from here on. Everything the
+     later stages need is parsed out into desc exactly once. */
+  struct sr_pkt_desc desc;
+  if (!sr_pkt_parse(&desc, packet, len, interface)) {
     fprintf(stderr, "Failed to process packet, insufficient length\n");
     return;
   }
 
-  sr_ethernet_hdr_t* e_hdr = (sr_ethernet_hdr_t *)packet;
-  sr_eth_hdr_ntoh(e_hdr);
-
-  if (e_hdr->ether_type == ethertype_ip) {
-    sr_recv_ip_pkt(sr, e_hdr, len, interface);
-  } else if (e_hdr->ether_type == ethertype_arp) {
-    sr_recv_arp_pkt(sr, e_hdr, len, interface);
+  if (desc.ether_type == ethertype_ip) {
+    sr_recv_ip_pkt(sr, &desc);
+  } else if (desc.ether_type == ethertype_arp) {
+    sr_recv_arp_pkt(sr, &desc);
   } else {
-    fprintf(stderr, "Ignoring ethernet packet with type %x\n", e_hdr->ether_type);
+    fprintf(stderr, "Ignoring ethernet packet with type %x\n", desc.ether_type);
   }
 
 }/* end sr_ForwardPacket */
 
-void sr_recv_ip_pkt(
-    struct sr_instance* sr,
-    sr_ethernet_hdr_t* e_hdr,
-    unsigned int len,
-    char *interface
-) {
-  int minlength = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);
-  if (len < minlength) {
+void sr_recv_ip_pkt(struct sr_instance* sr, struct sr_pkt_desc *desc) {
+  if (desc->ip_hdr == NULL) {
     fprintf(stderr, "Failed to process IP packet, insufficient length\n");
     return;
   }
 
-  sr_ip_hdr_t *ip_hdr = sr_extract_ip_hdr(e_hdr);
-
-  if (sr_ip_checksum_matches(ip_hdr) == false) {
+  if (sr_ip_checksum_matches(desc->ip_hdr) == false) {
     fprintf(stderr, "Failed to process IP packet, checksum mismatch\n");
     return;
   }
 
-  sr_ip_hdr_ntoh(ip_hdr);
+  /* Fragments only need putting back together if we have to look past the IP
+     hdr, i.e. they are for us or the NAT has to translate them. Everything
+     else is forwarded as is. */
+  bool is_frag = (desc->ip_off & (IP_MF | IP_OFFMASK)) != 0;
+  if (is_frag && (sr_is_router_ip(sr, desc->ip_dst) || (sr->nat != NULL && sr_nat_should_rewrite(sr, desc)))) {
+    struct sr_reasm_ctx *ctx = sr_reasm_add(sr->reasm, desc);
+    if (ctx != NULL) {
+      struct sr_pkt_desc whole;
+      sr_pkt_parse(&whole, ctx->frame, ctx->frame_len, desc->iface);
+      sr_recv_ip_pkt(sr, &whole);
+      sr_reasm_release(sr->reasm, ctx);
+    }
+    return;
+  }
+
+  /* Established flows skip the NAT, routing and ARP lookups entirely */
+  struct sr_flow_key flow_key;
+  struct sr_flow_key *flow = NULL;
+  if (sr_flow_key_init(&flow_key, desc)) {
+    if (sr_flow_cache_forward(sr, &flow_key, desc)) {
+      return;
+    }
+    flow = &flow_key;
+  }
+
+  /* Check the TTL and MTU before the NAT gets a chance to rewrite the source,
+     so the ICMP error goes back to the host that actually sent the packet and
+     quotes the header it sent */
+  if (!sr_is_router_ip(sr, desc->ip_dst) &&
+      (sr_ip_ttl_expired(sr, desc) || sr_ip_frag_needed(sr, desc))) {
+    return;
+  }
 
   if (sr->nat != NULL) {
-    enum sr_nat_response resp = sr_rewrite_pkt_for_nat(sr, e_hdr, ip_hdr, interface); 
+    enum sr_nat_response resp = sr_rewrite_pkt_for_nat(sr, desc); 
 
     if (resp == nat_no_mapping) {
       fprintf(stderr, "Nat no mapping!\n");
@@ -148,49 +169,42 @@ void sr_recv_ip_pkt(
     }
   }
 
-  if (!sr_is_router_ip(sr, ip_hdr->ip_dst)) {
-    sr_recv_ip_pkt_for_other(sr, e_hdr, ip_hdr);
+  if (!sr_is_router_ip(sr, desc->ip_dst)) {
+    sr_recv_ip_pkt_for_other(sr, desc, flow);
     return;
   }
 
-  if (ip_hdr->ip_p == ip_protocol_icmp) {
-    minlength += sizeof(sr_icmp_hdr_t);
-    if (len < minlength) {
+  if (desc->ip_p == ip_protocol_icmp) {
+    if (desc->l4_hdr == NULL) {
       fprintf(stderr, "Failed to process ICMP packet, insufficient length\n");
       return;
     }
 
-    sr_icmp_hdr_t *icmp_hdr = sr_extract_icmp_hdr(e_hdr);
-    sr_recv_icmp_pkt_for_us(sr, e_hdr, ip_hdr, icmp_hdr);
+    sr_recv_icmp_pkt_for_us(sr, desc);
     return;
   }
 
-  if(ip_hdr->ip_p == ip_protocol_tcp || ip_hdr->ip_p == ip_protocol_udp) {
-    sr_recv_tcp_or_udp_pkt_for_us(sr, e_hdr, ip_hdr);
+  if(desc->ip_p == ip_protocol_tcp || desc->ip_p == ip_protocol_udp) {
+    sr_recv_tcp_or_udp_pkt_for_us(sr, desc);
     return;
   }
 
-  fprintf(stderr, "Ignoring IP packet with protocol %x\n", ip_hdr->ip_p);
+  fprintf(stderr, "Ignoring IP packet with protocol %x\n", desc->ip_p);
 }
 
-void sr_recv_arp_pkt(
-    struct sr_instance *sr,
-    sr_ethernet_hdr_t* e_hdr,
-    unsigned int len,
-    char *interface
-) {
+void sr_recv_arp_pkt(struct sr_instance *sr, struct sr_pkt_desc *desc) {
   int minlength = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
-  if (len < minlength) {
+  if (desc->len < minlength) {
     fprintf(stderr, "Failed to process ARP packet, insufficient length\n");
     return;
   }
 
+  sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)desc->buf;
   sr_arp_hdr_t *arp_hdr = sr_extract_arp_hdr(e_hdr);
-  sr_arp_hdr_ntoh(arp_hdr);
 
-  if (arp_hdr->ar_op == arp_op_request) {
-    sr_recv_arp_req(sr, e_hdr, arp_hdr, interface);
+  if (ntohs(arp_hdr->ar_op) == arp_op_request) {
+    sr_recv_arp_req(sr, e_hdr, arp_hdr, sr_get_interface_by_idx(sr, desc->iface));
   } else {
-    sr_recv_arp_reply(sr, e_hdr, arp_hdr, interface);
+    sr_recv_arp_reply(sr, e_hdr, arp_hdr, sr_get_interface_by_idx(sr, desc->iface));
   }
 }
@@ -15,6 +15,7 @@
 #include <stdbool.h>
 
 #include "sr_protocol.h"
+#include "sr_if.h"
 #include "sr_arpcache.h"
 #include "sr_nat.h"
 
@@ -33,8 +34,10 @@
 #define PACKET_DUMP_SIZE 1024
 
 /* forward declare */
-struct sr_if;
 struct sr_rt;
+struct sr_reasm;
+struct sr_uring;
+struct sr_poll;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -52,12 +55,19 @@ struct sr_instance
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
+    struct sr_if_table if_table; /* the same interfaces, indexed */
     struct sr_rt* routing_table; /* routing table */
+    unsigned int rt_generation; /* bumped whenever the routing table changes */
     struct sr_arpcache cache;   /* ARP cache */
+    unsigned int arp_max_reqs;  /* size of the pending ARP request pool */
+    unsigned int egress_rate;   /* kbit/s each interface is paced to, 0 for unpaced */
     pthread_attr_t attr;
     FILE* logfile;
 
     struct sr_nat *nat; /* Contains NAT mappings. Will be NULL if nat is disabled */
+    struct sr_reasm *reasm; /* fragments of datagrams for us or the NAT */
+    struct sr_uring *uring; /* drives the server socket with -U, NULL otherwise */
+    struct sr_poll *poll; /* how the reader waits, CPU pinning and packet latencies */
 };
 
 /* -- sr_main.c -- */
@@ -65,12 +75,15 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packet_iface(struct sr_instance* , uint8_t* , unsigned int , struct sr_if*);
+int sr_write_packet_iface(struct sr_instance* , uint8_t* , unsigned int , struct sr_if*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_handle_command(struct sr_instance* , unsigned char* , int , int );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , unsigned int );
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
@@ -22,6 +22,8 @@
 #include "sr_rt.h"
 #include "sr_router.h"
 
+int rt_if_idx(struct sr_instance* sr, const char* if_name);
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -99,6 +101,8 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     assert(if_name);
     assert(sr);
 
+    sr->rt_generation++;
+
     /* -- empty list special case -- */
     if(sr->routing_table == 0)
     {
@@ -109,6 +113,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        sr->routing_table->if_idx = rt_if_idx(sr, if_name);
 
         return;
     }
@@ -128,9 +133,16 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker->if_idx = rt_if_idx(sr, if_name);
 
 } /* -- sr_add_entry -- */
 
+int rt_if_idx(struct sr_instance* sr, const char* if_name)
+{
+    struct sr_if* iface = sr_get_interface(sr, if_name);
+    return iface ? (int)iface->idx : -1;
+}
+
 /*---------------------------------------------------------------------
  * Method:
  *
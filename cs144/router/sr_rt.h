@@ -33,6 +33,7 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    int    if_idx; /* index of interface, -1 until it is known */
     struct sr_rt* next;
 };
 
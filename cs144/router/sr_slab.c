@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_slab.h"
+
+int sr_slab_init(struct sr_slab *slab, size_t obj_size, unsigned int capacity) {
+  /* Free objects hold the free list link, so they must fit and align a pointer */
+  size_t align = sizeof(void *);
+  obj_size = (obj_size + align - 1) / align * align;
+
+  memset(slab, 0, sizeof(struct sr_slab));
+  slab->obj_size = obj_size;
+  slab->capacity = capacity;
+
+  if (capacity == 0) {
+    return 0;
+  }
+
+  slab->mem = malloc(obj_size * capacity);
+  if (slab->mem == NULL) {
+    fprintf(stderr, "Unable to allocate slab of %u objects of %lu bytes\n", capacity, (unsigned long)obj_size);
+    slab->capacity = 0;
+    return -1;
+  }
+
+  int i;
+  for (i = capacity - 1; i >= 0; i--) {
+    void **obj = (void **)(slab->mem + i * obj_size);
+    *obj = slab->free_list;
+    slab->free_list = obj;
+  }
+
+  return 0;
+}
+
+void sr_slab_destroy(struct sr_slab *slab) {
+  free(slab->mem);
+  memset(slab, 0, sizeof(struct sr_slab));
+}
+
+void *sr_slab_alloc(struct sr_slab *slab) {
+  void **obj = slab->free_list;
+  if (obj == NULL) {
+    slab->exhausted++;
+    return NULL;
+  }
+
+  slab->free_list = *obj;
+  slab->in_use++;
+
+  memset(obj, 0, slab->obj_size);
+  return obj;
+}
+
+void sr_slab_free(struct sr_slab *slab, void *obj) {
+  assert((uint8_t *)obj >= slab->mem && (uint8_t *)obj < slab->mem + slab->obj_size * slab->capacity);
+
+  *(void **)obj = slab->free_list;
+  slab->free_list = obj;
+  slab->in_use--;
+}
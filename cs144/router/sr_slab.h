@@ -0,0 +1,28 @@
+#ifndef SR_SLAB_H
+#define SR_SLAB_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* A pool of equally sized objects carved out of a single allocation made up
+   front. Allocating and freeing just pop and push the free list, so objects
+   that come and go with every flow never touch malloc. Not thread safe: the
+   owner's lock must be held around every call. */
+struct sr_slab {
+  uint8_t *mem;
+  size_t obj_size;
+  unsigned int capacity;
+  unsigned int in_use;
+  unsigned long exhausted; /* # of allocations that failed because the pool was empty */
+  void *free_list;
+};
+
+/* Returns 0 on success, -1 if the pool couldn't be allocated */
+int sr_slab_init(struct sr_slab *slab, size_t obj_size, unsigned int capacity);
+void sr_slab_destroy(struct sr_slab *slab);
+
+/* Returns a zeroed object, or NULL if every object is in use */
+void *sr_slab_alloc(struct sr_slab *slab);
+void sr_slab_free(struct sr_slab *slab, void *obj);
+
+#endif /* -- SR_SLAB_H -- */
@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "sr_router.h"
+#include "sr_uring.h"
+#include "sr_poll.h"
+
+#ifdef _LINUX_
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_RECV 1 /* user_data of the multishot recv */
+#define URING_SEND 2 /* user_data of the write of a send buffer */
+#define URING_BUF_GROUP 0
+#define URING_MAX_CMD 10000 /* same limit sr_read_from_server enforces */
+
+int uring_map_rings(struct sr_uring *uring, struct io_uring_params *params);
+int uring_setup_recv_bufs(struct sr_uring *uring);
+int uring_setup_send_bufs(struct sr_uring *uring);
+struct io_uring_sqe *uring_get_sqe(struct sr_uring *uring);
+int uring_submit(struct sr_uring *uring);
+void uring_arm_recv(struct sr_uring *uring);
+void uring_submit_write(struct sr_uring *uring);
+void uring_flush_sends(struct sr_uring *uring);
+void uring_send_done(struct sr_uring *uring, int res);
+int uring_recv_done(struct sr_instance *sr, struct io_uring_cqe *cqe);
+int uring_handle_stream(struct sr_instance *sr);
+
+int sr_uring_init(struct sr_uring *uring, int sockfd) {
+  memset(uring, 0, sizeof(struct sr_uring));
+  uring->sockfd = sockfd;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  uring->ring_fd = syscall(__NR_io_uring_setup, SR_URING_ENTRIES, &params);
+  if (uring->ring_fd < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+
+  if (uring_map_rings(uring, &params) != 0 || uring_setup_recv_bufs(uring) != 0 ||
+      uring_setup_send_bufs(uring) != 0) {
+    close(uring->ring_fd);
+    return -1;
+  }
+
+  uring->stream = malloc(SR_URING_STREAM_SZ);
+  if (uring->stream == NULL) {
+    close(uring->ring_fd);
+    return -1;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&(uring->lock), &attr);
+  pthread_cond_init(&(uring->send_done), NULL);
+
+  return 0;
+}
+
+int sr_uring_run(struct sr_instance *sr) {
+  struct sr_uring *uring = sr->uring;
+
+  pthread_mutex_lock(&(uring->lock));
+  uring->loop_thread = pthread_self();
+  uring_arm_recv(uring);
+  uring_submit(uring);
+  pthread_mutex_unlock(&(uring->lock));
+
+  /* Busy polling only reaps, it never waits for a completion */
+  unsigned int min_complete = sr->poll->busy_poll ? 0 : 1;
+
+  while (1) {
+    int ret = syscall(__NR_io_uring_enter, uring->ring_fd, 0, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR) {
+      perror("io_uring_enter");
+      return -1;
+    }
+
+    unsigned int head = *(uring->cq_head);
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe cqe = uring->cqes[head & *(uring->cq_mask)];
+
+      /* Handed back before acting on it, since a command can take a while */
+      head++;
+      __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+      if (cqe.user_data == URING_SEND) {
+        pthread_mutex_lock(&(uring->lock));
+        uring_send_done(uring, cqe.res);
+        pthread_mutex_unlock(&(uring->lock));
+      } else if (cqe.user_data == URING_RECV) {
+        ret = uring_recv_done(sr, &cqe);
+        if (ret != 1) {
+          return ret;
+        }
+      }
+    }
+  }
+
+  return -1;
+}
+
+int sr_uring_send(struct sr_uring *uring, uint8_t *buf, unsigned int len) {
+  pthread_mutex_lock(&(uring->lock));
+
+  bool loop_thread = pthread_equal(pthread_self(), uring->loop_thread);
+  while (uring->send_len[uring->staging] + len > SR_URING_SEND_BUF_SZ) {
+    if (loop_thread || len > SR_URING_SEND_BUF_SZ) {
+      uring->send_drops++;
+      pthread_mutex_unlock(&(uring->lock));
+      return -1;
+    }
+    pthread_cond_wait(&(uring->send_done), &(uring->lock));
+  }
+
+  unsigned int staging = uring->staging;
+  memcpy(uring->send_bufs[staging] + uring->send_len[staging], buf, len);
+  uring->send_len[staging] += len;
+
+  if (!uring->send_inflight) {
+    uring_flush_sends(uring);
+  }
+
+  pthread_mutex_unlock(&(uring->lock));
+  return 0;
+}
+
+int uring_map_rings(struct sr_uring *uring, struct io_uring_params *params) {
+  uring->sq_ring_sz = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+  uring->cq_ring_sz = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+  /* Newer kernels put both rings in one mapping */
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_sz > uring->sq_ring_sz) {
+      uring->sq_ring_sz = uring->cq_ring_sz;
+    }
+    uring->cq_ring_sz = uring->sq_ring_sz;
+  }
+
+  uring->sq_ring = mmap(NULL, uring->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    uring->ring_fd, IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) {
+    perror("mmap sq ring");
+    return -1;
+  }
+
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ring = uring->sq_ring;
+  } else {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      uring->ring_fd, IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED) {
+      perror("mmap cq ring");
+      return -1;
+    }
+  }
+
+  uring->sqes_sz = params->sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    uring->ring_fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    perror("mmap sqes");
+    return -1;
+  }
+
+  uint8_t *sq = uring->sq_ring;
+  uring->sq_head = (unsigned int *)(sq + params->sq_off.head);
+  uring->sq_tail = (unsigned int *)(sq + params->sq_off.tail);
+  uring->sq_mask = (unsigned int *)(sq + params->sq_off.ring_mask);
+  uring->sq_array = (unsigned int *)(sq + params->sq_off.array);
+
+  uint8_t *cq = uring->cq_ring;
+  uring->cq_head = (unsigned int *)(cq + params->cq_off.head);
+  uring->cq_tail = (unsigned int *)(cq + params->cq_off.tail);
+  uring->cq_mask = (unsigned int *)(cq + params->cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+
+  return 0;
+}
+
+/* Registers a ring of receive buffers for the kernel to fill (needs 5.19+) */
+int uring_setup_recv_bufs(struct sr_uring *uring) {
+  uring->buf_ring_sz = SR_URING_RECV_BUFS * sizeof(struct io_uring_buf);
+  uring->buf_ring = mmap(NULL, uring->buf_ring_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  uring->recv_bufs = malloc(SR_URING_RECV_BUFS * SR_URING_RECV_BUF_SZ);
+  if (uring->buf_ring == MAP_FAILED || uring->recv_bufs == NULL) {
+    fprintf(stderr, "Unable to allocate io_uring receive buffers\n");
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)uring->buf_ring;
+  reg.ring_entries = SR_URING_RECV_BUFS;
+  reg.bgid = URING_BUF_GROUP;
+  if (syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    perror("io_uring_register pbuf ring");
+    return -1;
+  }
+
+  unsigned int i;
+  for (i = 0; i < SR_URING_RECV_BUFS; i++) {
+    struct io_uring_buf *buf = &(uring->buf_ring->bufs[i]);
+    buf->addr = (unsigned long)(uring->recv_bufs + i * SR_URING_RECV_BUF_SZ);
+    buf->len = SR_URING_RECV_BUF_SZ;
+    buf->bid = i;
+  }
+  uring->buf_ring_tail = SR_URING_RECV_BUFS;
+  __atomic_store_n(&(uring->buf_ring->tail), uring->buf_ring_tail, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Registered up front so writes don't have to map the pages every time */
+int uring_setup_send_bufs(struct sr_uring *uring) {
+  struct iovec iov[2];
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    uring->send_bufs[i] = malloc(SR_URING_SEND_BUF_SZ);
+    if (uring->send_bufs[i] == NULL) {
+      fprintf(stderr, "Unable to allocate io_uring send buffers\n");
+      return -1;
+    }
+    iov[i].iov_base = uring->send_bufs[i];
+    iov[i].iov_len = SR_URING_SEND_BUF_SZ;
+  }
+
+  if (syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_BUFFERS, iov, 2) != 0) {
+    perror("io_uring_register buffers");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Must be called with the uring lock held. The ring is far bigger than the
+   two requests that are ever outstanding, so it can't run out. */
+struct io_uring_sqe *uring_get_sqe(struct sr_uring *uring) {
+  unsigned int tail = *(uring->sq_tail);
+  unsigned int idx = tail & *(uring->sq_mask);
+  struct io_uring_sqe *sqe = &(uring->sqes[idx]);
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  uring->sq_array[idx] = idx;
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  return sqe;
+}
+
+/* Hands everything queued to the kernel without waiting for any of it */
+int uring_submit(struct sr_uring *uring) {
+  unsigned int pending = *(uring->sq_tail) - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  if (pending == 0) {
+    return 0;
+  }
+
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, uring->ring_fd, pending, 0, 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0) {
+    perror("io_uring_enter submit");
+  }
+  return ret;
+}
+
+void uring_arm_recv(struct sr_uring *uring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uring->sockfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = URING_RECV;
+}
+
+/* Writes whatever of the in flight buffer hasn't been written yet */
+void uring_submit_write(struct sr_uring *uring) {
+  unsigned int inflight = uring->staging ^ 1;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = uring->sockfd;
+  sqe->addr = (unsigned long)(uring->send_bufs[inflight] + uring->send_off);
+  sqe->len = uring->send_len[inflight] - uring->send_off;
+  sqe->buf_index = inflight;
+  sqe->user_data = URING_SEND;
+
+  uring_submit(uring);
+}
+
+/* Must be called with the uring lock held and no write in flight */
+void uring_flush_sends(struct sr_uring *uring) {
+  if (uring->send_len[uring->staging] == 0) {
+    return;
+  }
+
+  uring->staging ^= 1;
+  uring->send_inflight = true;
+  uring->send_off = 0;
+  uring->send_batches++;
+  uring_submit_write(uring);
+}
+
+/* Must be called with the uring lock held */
+void uring_send_done(struct sr_uring *uring, int res) {
+  unsigned int inflight = uring->staging ^ 1;
+
+  if (res < 0 && res != -EINTR && res != -EAGAIN) {
+    fprintf(stderr, "Error writing packets: %s\n", strerror(-res));
+    uring->send_drops++;
+    res = uring->send_len[inflight] - uring->send_off;
+  } else if (res < 0) {
+    res = 0;
+  }
+
+  uring->send_off += res;
+  if (uring->send_off < uring->send_len[inflight]) {
+    uring_submit_write(uring);
+    return;
+  }
+
+  uring->send_len[inflight] = 0;
+  uring->send_inflight = false;
+  uring_flush_sends(uring);
+  pthread_cond_broadcast(&(uring->send_done));
+}
+
+int uring_recv_done(struct sr_instance *sr, struct io_uring_cqe *cqe) {
+  struct sr_uring *uring = sr->uring;
+
+  if (cqe->res == -ENOBUFS) {
+    /* Every buffer was full, they have all been recycled by now */
+    pthread_mutex_lock(&(uring->lock));
+    uring_arm_recv(uring);
+    uring_submit(uring);
+    pthread_mutex_unlock(&(uring->lock));
+    return 1;
+  } else if (cqe->res <= 0) {
+    fprintf(stderr, "Error: lost connection to server (%s)\n", cqe->res == 0 ? "closed" : strerror(-cqe->res));
+    return -1;
+  }
+
+  sr_poll_stamp_now(sr->poll);
+
+  unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  uint8_t *data = uring->recv_bufs + bid * SR_URING_RECV_BUF_SZ;
+  unsigned int len = cqe->res;
+
+  if (uring->stream_len + len > SR_URING_STREAM_SZ) {
+    fprintf(stderr, "Error: command stream overflowed\n");
+    return -1;
+  }
+  memcpy(uring->stream + uring->stream_len, data, len);
+  uring->stream_len += len;
+
+  /* Give the buffer straight back to the kernel */
+  struct io_uring_buf *buf = &(uring->buf_ring->bufs[uring->buf_ring_tail & (SR_URING_RECV_BUFS - 1)]);
+  buf->addr = (unsigned long)data;
+  buf->len = SR_URING_RECV_BUF_SZ;
+  buf->bid = bid;
+  uring->buf_ring_tail++;
+  __atomic_store_n(&(uring->buf_ring->tail), uring->buf_ring_tail, __ATOMIC_RELEASE);
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    pthread_mutex_lock(&(uring->lock));
+    uring_arm_recv(uring);
+    uring_submit(uring);
+    pthread_mutex_unlock(&(uring->lock));
+  }
+
+  return uring_handle_stream(sr);
+}
+
+/* Hands every complete command in the stream to sr_handle_command. Commands
+   are moved to the front of the stream first so their fields are aligned. */
+int uring_handle_stream(struct sr_instance *sr) {
+  struct sr_uring *uring = sr->uring;
+
+  while (uring->stream_len >= sizeof(uint32_t)) {
+    uint32_t len;
+    memcpy(&len, uring->stream, sizeof(uint32_t));
+    len = ntohl(len);
+
+    if (len > URING_MAX_CMD || len < 2 * sizeof(uint32_t)) {
+      fprintf(stderr, "Error: command length to large %u\n", len);
+      return -1;
+    }
+    if (uring->stream_len < len) {
+      break;
+    }
+
+    int ret = sr_handle_command(sr, uring->stream, len, 0);
+    if (ret != 1) {
+      return ret;
+    }
+
+    uring->stream_len -= len;
+    memmove(uring->stream, uring->stream + len, uring->stream_len);
+  }
+
+  return 1;
+}
+
+#else /* -- _LINUX_ -- */
+
+int sr_uring_init(struct sr_uring *uring, int sockfd) {
+  fprintf(stderr, "io_uring is only available on Linux\n");
+  return -1;
+}
+
+int sr_uring_run(struct sr_instance *sr) {
+  return -1;
+}
+
+int sr_uring_send(struct sr_uring *uring, uint8_t *buf, unsigned int len) {
+  return -1;
+}
+
+#endif /* -- _LINUX_ -- */
@@ -0,0 +1,86 @@
+#ifndef SR_URING_H
+#define SR_URING_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+struct sr_instance;
+
+#define SR_URING_ENTRIES 64
+#define SR_URING_RECV_BUFS 64 /* must be a power of 2 */
+#define SR_URING_RECV_BUF_SZ 4096
+#define SR_URING_STREAM_SZ 32768 /* room for a few of the largest commands (10000 bytes) */
+#define SR_URING_SEND_BUF_SZ 65536
+
+/* An io_uring driving the socket to the VNS server.
+
+   Receives use a single multishot recv that picks buffers from a ring the
+   kernel owns, so one submission keeps delivering data until the socket
+   closes. The bytes are collected into a stream buffer and split into
+   commands there.
+
+   Sends are appended to whichever of two registered buffers is staging while
+   the other is being written, so only one write is ever in flight (keeping
+   commands in order on the stream) and everything queued behind it goes out
+   in the next one. Senders never wait on the socket. If the staging buffer
+   fills up, other threads wait for the write in flight to finish (so the
+   egress queues see backpressure like they would from a blocking write),
+   while the thread running the ring, which is the one that would finish it,
+   drops the frame. */
+struct sr_uring {
+  int ring_fd;
+  int sockfd;
+
+  /* submission queue */
+  void *sq_ring;
+  size_t sq_ring_sz;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_sz;
+
+  /* completion queue */
+  void *cq_ring;
+  size_t cq_ring_sz;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* buffers the multishot recv picks from */
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_sz;
+  uint8_t *recv_bufs;
+  uint16_t buf_ring_tail;
+
+  uint8_t *stream;
+  unsigned int stream_len;
+
+  uint8_t *send_bufs[2];
+  unsigned int send_len[2];
+  unsigned int staging; /* buffer new frames are appended to */
+  bool send_inflight; /* the other buffer is being written */
+  unsigned int send_off; /* bytes of the in flight buffer already written */
+  unsigned long send_batches;
+  unsigned long send_drops;
+
+  pthread_t loop_thread; /* the thread in sr_uring_run */
+  pthread_mutex_t lock; /* protects the submission queue and the send buffers */
+  pthread_cond_t send_done;
+};
+
+/* Sets up the ring for an already connected socket. Returns 0 on success, -1
+   if io_uring isn't available, in which case the blocking path must be used. */
+int sr_uring_init(struct sr_uring *uring, int sockfd);
+
+/* Handles commands from the server until the session ends. Returns what
+   sr_read_from_server would have when the loop stopped. */
+int sr_uring_run(struct sr_instance *sr);
+
+/* Queues a complete command for the server. Returns 0 if it was queued. */
+int sr_uring_send(struct sr_uring *uring, uint8_t *buf, unsigned int len);
+
+#endif /* -- SR_URING_H -- */
@@ -21,6 +21,31 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+uint32_t cksum_delta16(uint16_t old_val, uint16_t new_val) {
+  return (uint16_t)~old_val + (uint32_t)new_val;
+}
+
+uint32_t cksum_delta32(uint32_t old_val, uint32_t new_val) {
+  return cksum_delta16(old_val >> 16, new_val >> 16) +
+    cksum_delta16(old_val & 0xffff, new_val & 0xffff);
+}
+
+uint16_t cksum_apply_delta(uint16_t sum, uint32_t delta) {
+  uint32_t acc = (delta & 0xffff) + (delta >> 16);
+  acc += (uint16_t)~sum;
+  while (acc > 0xffff)
+    acc = (acc >> 16) + (acc & 0xffff);
+  return (uint16_t)~acc;
+}
+
+uint16_t cksum_update16(uint16_t sum, uint16_t old_val, uint16_t new_val) {
+  return cksum_apply_delta(sum, cksum_delta16(old_val, new_val));
+}
+
+uint16_t cksum_update32(uint16_t sum, uint32_t old_val, uint32_t new_val) {
+  return cksum_apply_delta(sum, cksum_delta32(old_val, new_val));
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
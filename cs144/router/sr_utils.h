@@ -30,6 +30,17 @@
 
 uint16_t cksum(const void *_data, int len);
 
+/* Incrementally update a checksum after a field changed from old_val to
+   new_val (RFC 1624). All values are in network byte order. */
+uint16_t cksum_update16(uint16_t sum, uint16_t old_val, uint16_t new_val);
+uint16_t cksum_update32(uint16_t sum, uint32_t old_val, uint32_t new_val);
+
+/* The same update split in two, so the delta for a set of field changes can
+   be computed once and applied to many packets. Deltas can be summed. */
+uint32_t cksum_delta16(uint16_t old_val, uint16_t new_val);
+uint32_t cksum_delta32(uint32_t old_val, uint32_t new_val);
+uint16_t cksum_apply_delta(uint16_t sum, uint32_t delta);
+
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
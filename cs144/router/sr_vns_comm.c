@@ -40,15 +40,19 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_egress.h"
+#include "sr_uring.h"
+#include "sr_poll.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
 static void sr_log_packet(struct sr_instance* , uint8_t* , int );
+static int  sr_recv_cmd(struct sr_instance* , uint8_t* , int , struct timespec* );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
-                                  char* interface  /* lent */);
+                                  struct sr_if* iface  /* lent */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
 
 /*-----------------------------------------------------------------------------
@@ -229,6 +233,9 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
     printf("Router interfaces:\n");
     sr_print_if_list(sr);
 
+    /* -- interfaces are only known now, so this is where they get queues -- */
+    sr_egress_init(sr, sr->egress_rate);
+
     return num_entries;
 } /* -- sr_handle_hwinfo -- */
 
@@ -333,9 +340,8 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
 
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
 {
-    int command, len;
+    int len;
     unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
     int ret = 0, bytes_read = 0;
 
     /* REQUIRES */
@@ -353,8 +359,9 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         do
         { /* -- just in case SIGALRM breaks recv -- */
             errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
+            if((ret = sr_recv_cmd(sr,((uint8_t*)&len) + bytes_read,
+                            4 - bytes_read,
+                            bytes_read == 0 ? &(sr->poll->rx_stamp) : 0)) == -1)
             {
                 if ( errno == EINTR )
                 { continue; }
@@ -362,6 +369,11 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 perror("recv(..):sr_client.c::sr_read_from_server");
                 return -1;
             }
+            if ( ret == 0 )
+            {
+                fprintf(stderr,"Server closed the connection\n");
+                return -1;
+            }
             bytes_read += ret;
         } while ( errno == EINTR); /* be mindful of signals */
 
@@ -393,7 +405,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         do
         {/* -- just in case SIGALRM breaks recv -- */
             errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
+            if ((ret = sr_recv_cmd(sr, buf+4+bytes_read, len - 4 - bytes_read, 0)) ==
                     -1)
             {
                 if ( errno == EINTR )
@@ -402,10 +414,87 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 close(sr->sockfd);
                 return -1;
             }
+            if ( ret == 0 )
+            {
+                fprintf(stderr,"Error: server closed mid command\n");
+                free(buf);
+                return -1;
+            }
             bytes_read += ret;
         } while (errno == EINTR); /* be mindful of signals */
     }
 
+    ret = sr_handle_command(sr, buf, len, expected_cmd);
+
+    free(buf);
+    return ret;
+}/* -- sr_read_from_server -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_recv_cmd(..)
+ * Scope: Local
+ *
+ * recv() that spins instead of sleeping in busy-poll mode. If stamp is given
+ * it is set to when the data reached the socket, or to now if the kernel
+ * doesn't say.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_recv_cmd(struct sr_instance* sr, uint8_t* buf, int len,
+                       struct timespec* stamp)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    do
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(sr->sockfd, &msg, sr->poll->busy_poll ? MSG_DONTWAIT : 0);
+    } while ( ret == -1 && (errno == EINTR ||
+              (sr->poll->busy_poll && (errno == EAGAIN || errno == EWOULDBLOCK))) );
+
+    if ( ret > 0 && stamp != 0 )
+    {
+        clock_gettime(CLOCK_REALTIME, stamp);
+        for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+        {
+            if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS )
+            { memcpy(stamp, CMSG_DATA(cmsg), sizeof(struct timespec)); }
+        }
+    }
+
+    return ret;
+} /* -- sr_recv_cmd -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_command(..)
+ * Scope: global
+ *
+ * Acts on a complete command from the server. buf holds the whole command,
+ * length field included, and is left for the caller to free.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_handle_command(struct sr_instance* sr /* borrowed */,
+                      unsigned char* buf /* borrowed */,
+                      int len, int expected_cmd)
+{
+    int command;
+    c_packet_ethernet_header* sr_pkt = 0;
+    struct sr_if* iface = 0;
+    int ret = 0;
+
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
     command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
@@ -426,12 +515,22 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         case VNSPACKET:
             sr_pkt = (c_packet_ethernet_header *)buf;
 
+            /* -- the interface name is only looked at here, the router
+                  refers to interfaces by index from now on -- */
+            iface = sr_get_interface(sr, (char*)(buf + sizeof(c_base)));
+            if ( iface == 0 )
+            {
+                fprintf(stderr, "** Error, packet on unknown interface %s\n",
+                        (char*)(buf + sizeof(c_base)));
+                break;
+            }
+
             /* -- check if it is an ARP to another router if so drop   -- */
             if ( sr_arp_req_not_for_us(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
+                    iface) )
             { break; }
 
             /* -- log packet -- */
@@ -443,7 +542,8 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+                    iface->idx);
+            sr_poll_record(sr->poll);
 
             break;
 
@@ -454,8 +554,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
 
-            if(buf)
-            { free(buf); }
             return 0;
             break;
 
@@ -501,10 +599,8 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
     return ret;
-}/* -- sr_read_from_server -- */
+}/* -- sr_handle_command -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
@@ -517,23 +613,16 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 static int
 sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
                                 uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+                                struct sr_if* iface /* borrowed */ )
 {
     struct sr_ethernet_hdr* ether_hdr = 0;
-    struct sr_if* iface = 0;
 
     /* -- REQUIRES -- */
     assert(sr);
     assert(buf);
-    assert(name);
+    assert(iface);
 
     ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
-
-    if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
-        return 0;
-    }
 
     if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
         fprintf( stderr, "** Error, source address does not match interface\n");
@@ -562,7 +651,63 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
 int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          uint8_t* buf /* borrowed */ ,
                          unsigned int len,
-                         const char* iface /* borrowed */)
+                         const char* name /* borrowed */)
+{
+    struct sr_if* iface = 0;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(name);
+
+    iface = sr_get_interface(sr, name);
+    if ( iface == 0 ){
+        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
+        return -1;
+    }
+
+    return sr_send_packet_iface(sr, buf, len, iface);
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet_iface(..)
+ * Scope: Global
+ *
+ * Same as sr_send_packet, for callers that already have the interface record.
+ * The frame is copied onto the interface's egress queue when it has one, so
+ * the buffer can be reused as soon as this returns.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet_iface(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         struct sr_if* iface /* borrowed */)
+{
+    /* REQUIRES */
+    assert(iface);
+
+    if ( iface->egress != 0 && len <= SR_EGRESS_FRAME_MAX ){
+        return sr_egress_enqueue(iface->egress, buf, len);
+    }
+
+    return sr_write_packet_iface(sr, buf, len, iface);
+} /* -- sr_send_packet_iface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_write_packet_iface(..)
+ * Scope: Global
+ *
+ * Writes the frame to the server right away, bypassing the egress queues.
+ * With io_uring the frame is queued on the ring instead. When every send
+ * buffer is in use, other threads wait for one to free up, but the loop
+ * thread drops the frame rather than block.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_write_packet_iface(struct sr_instance* sr /* borrowed */,
+                          uint8_t* buf /* borrowed */ ,
+                          unsigned int len,
+                          struct sr_if* iface /* borrowed */)
 {
     c_packet_header *sr_pkt;
     unsigned int total_len =  len + (sizeof(c_packet_header));
@@ -584,7 +729,7 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
     assert(sr_pkt);
     sr_pkt->mLen  = htonl(total_len);
     sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
+    strncpy(sr_pkt->mInterfaceName,iface->name,16);
     memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
             buf,len);
 
@@ -597,6 +742,12 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
+    if ( sr->uring != 0 ){
+        int ret = sr_uring_send(sr->uring, (uint8_t*)sr_pkt, total_len);
+        free(sr_pkt);
+        return ret;
+    }
+
     if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
         fprintf(stderr, "Error writing packet\n");
         free(sr_pkt);
@@ -606,7 +757,7 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
     free(sr_pkt);
 
     return 0;
-} /* -- sr_send_packet -- */
+} /* -- sr_write_packet_iface -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
@@ -644,9 +795,8 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
 int  sr_arp_req_not_for_us(struct sr_instance* sr,
                            uint8_t * packet /* lent */,
                            unsigned int len,
-                           char* interface  /* lent */)
+                           struct sr_if* iface  /* lent */)
 {
-    struct sr_if* iface = sr_get_interface(sr, interface);
     struct sr_ethernet_hdr* e_hdr = 0;
     struct sr_arp_hdr*       a_hdr = 0;
 
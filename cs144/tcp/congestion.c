@@ -0,0 +1,162 @@
+#include <string.h>
+#include <math.h>
+
+#include "congestion.h"
+
+static const double INITIAL_CWND = 4; /* RFC 5681's initial window for 500 byte packets */
+static const double MIN_SSTHRESH = 2;
+
+static const double CUBIC_C = 0.4;
+static const double CUBIC_BETA = 0.7;
+
+void newreno_init(struct congestion *cc);
+double newreno_ssthresh(struct congestion *cc, uint32_t flight, uint64_t now_millis);
+void newreno_cong_avoid(struct congestion *cc, uint32_t acked, uint64_t now_millis, int srtt_millis);
+
+void cubic_init(struct congestion *cc);
+double cubic_ssthresh(struct congestion *cc, uint32_t flight, uint64_t now_millis);
+void cubic_cong_avoid(struct congestion *cc, uint32_t acked, uint64_t now_millis, int srtt_millis);
+
+void clamp_cwnd(struct congestion *cc);
+
+const struct congestion_ops congestion_newreno = {
+  "newreno", newreno_init, newreno_ssthresh, newreno_cong_avoid
+};
+
+const struct congestion_ops congestion_cubic = {
+  "cubic", cubic_init, cubic_ssthresh, cubic_cong_avoid
+};
+
+const struct congestion_ops *congestion_find(const char *name) {
+  if (strcmp(name, congestion_newreno.name) == 0) {
+    return &congestion_newreno;
+  } else if (strcmp(name, congestion_cubic.name) == 0) {
+    return &congestion_cubic;
+  } else {
+    return NULL;
+  }
+}
+
+void congestion_init(struct congestion *cc, const struct congestion_ops *ops, int max_cwnd) {
+  memset(cc, 0, sizeof(*cc));
+  cc->ops = ops;
+  cc->max_cwnd = max_cwnd;
+  cc->cwnd = INITIAL_CWND;
+  cc->ssthresh = max_cwnd;
+  clamp_cwnd(cc);
+  cc->ops->init(cc);
+}
+
+uint32_t congestion_window(struct congestion *cc) {
+  return cc->cwnd;
+}
+
+void congestion_on_ack(struct congestion *cc, uint32_t acked, uint64_t now_millis, int srtt_millis) {
+  if (cc->cwnd < cc->ssthresh) {
+    double slow_start = fmin(acked, cc->ssthresh - cc->cwnd);
+    cc->cwnd += slow_start;
+    acked -= slow_start;
+  }
+
+  if (acked > 0) {
+    cc->ops->cong_avoid(cc, acked, now_millis, srtt_millis);
+  }
+
+  clamp_cwnd(cc);
+}
+
+void congestion_on_loss(struct congestion *cc, uint32_t flight, uint32_t left_network, uint64_t now_millis) {
+  cc->ssthresh = fmax(cc->ops->ssthresh(cc, flight, now_millis), MIN_SSTHRESH);
+  cc->cwnd = cc->ssthresh + left_network;
+  clamp_cwnd(cc);
+}
+
+void congestion_on_dup_ack(struct congestion *cc) {
+  cc->cwnd += 1;
+  clamp_cwnd(cc);
+}
+
+/* RFC 6582: deflate by what was acked, then add back the retransmission */
+void congestion_on_partial_ack(struct congestion *cc, uint32_t acked) {
+  cc->cwnd = fmax(cc->cwnd - acked + 1, 1);
+  clamp_cwnd(cc);
+}
+
+void congestion_exit_recovery(struct congestion *cc) {
+  cc->cwnd = cc->ssthresh;
+  clamp_cwnd(cc);
+}
+
+void congestion_on_timeout(struct congestion *cc, uint32_t flight, uint64_t now_millis) {
+  cc->ssthresh = fmax(cc->ops->ssthresh(cc, flight, now_millis), MIN_SSTHRESH);
+  cc->cwnd = 1;
+}
+
+void clamp_cwnd(struct congestion *cc) {
+  cc->cwnd = fmax(fmin(cc->cwnd, cc->max_cwnd), 1);
+}
+
+void newreno_init(struct congestion *cc) {
+}
+
+double newreno_ssthresh(struct congestion *cc, uint32_t flight, uint64_t now_millis) {
+  return flight / 2.0;
+}
+
+/* About one packet per round trip */
+void newreno_cong_avoid(struct congestion *cc, uint32_t acked, uint64_t now_millis, int srtt_millis) {
+  cc->cwnd += acked / cc->cwnd;
+}
+
+void cubic_init(struct congestion *cc) {
+  cc->epoch_start = 0;
+  cc->w_max = 0;
+  cc->w_last_max = 0;
+}
+
+/* RFC 8312, 4.5 and 4.6 */
+double cubic_ssthresh(struct congestion *cc, uint32_t flight, uint64_t now_millis) {
+  cc->epoch_start = 0;
+
+  /* Fast convergence: give up bandwidth sooner if the last loss came at a
+   * smaller window, since a new flow is probably taking its share */
+  if (cc->cwnd < cc->w_last_max) {
+    cc->w_last_max = cc->cwnd;
+    cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+  } else {
+    cc->w_last_max = cc->cwnd;
+    cc->w_max = cc->cwnd;
+  }
+
+  return cc->cwnd * CUBIC_BETA;
+}
+
+/* RFC 8312, 4.1 to 4.4: grow toward the cubic curve's value one round trip
+ * from now, but never slower than standard TCP would */
+void cubic_cong_avoid(struct congestion *cc, uint32_t acked, uint64_t now_millis, int srtt_millis) {
+  if (cc->epoch_start == 0) {
+    cc->epoch_start = now_millis;
+    if (cc->cwnd < cc->w_max) {
+      cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+      cc->origin = cc->w_max;
+    } else {
+      cc->k = 0;
+      cc->origin = cc->cwnd;
+    }
+    cc->w_est = cc->cwnd;
+  }
+
+  double t = (now_millis - cc->epoch_start + srtt_millis) / 1000.0;
+  double target = cc->origin + CUBIC_C * pow(t - cc->k, 3);
+
+  cc->w_est += acked * (3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA)) / cc->cwnd;
+  if (cc->w_est > target) {
+    target = cc->w_est;
+  }
+
+  if (target > cc->cwnd) {
+    cc->cwnd += acked * (target - cc->cwnd) / cc->cwnd;
+  } else {
+    cc->cwnd += acked * 0.01 / cc->cwnd;
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Congestion control for the sliding window.
+
+   The congestion window (cwnd) is counted in packets, since that is what
+   the protocol numbers, and is never larger than the configured window.
+   Below ssthresh the window grows by a packet per packet acked (slow
+   start). Above it, growth is up to the algorithm (congestion
+   avoidance). On a loss the algorithm picks the new ssthresh. Fast
+   recovery then runs at ssthresh plus the packets known to have left the
+   network. A timeout restarts slow start from a single packet.
+
+   Detecting losses and running recovery is up to the caller, which tells
+   the controller about each event through the functions below.
+
+ */
+
+struct congestion;
+
+/* An algorithm, in the spirit of Linux's tcp_congestion_ops */
+struct congestion_ops {
+  const char *name;
+
+  /* Sets up any algorithm state, called once when the connection starts */
+  void (*init)(struct congestion *cc);
+
+  /* Returns the slow start threshold to use after a loss with flight
+   * packets outstanding */
+  double (*ssthresh)(struct congestion *cc, uint32_t flight, uint64_t now_millis);
+
+  /* Grows cwnd for acked packets at or above ssthresh */
+  void (*cong_avoid)(struct congestion *cc, uint32_t acked, uint64_t now_millis, int srtt_millis);
+};
+
+struct congestion {
+  const struct congestion_ops *ops;
+
+  double cwnd;                /* Packets allowed in flight */
+  double ssthresh;            /* Slow start threshold */
+  int max_cwnd;               /* The configured window */
+
+  /* CUBIC */
+  uint64_t epoch_start;       /* When the current growth epoch started, 0 if none */
+  double w_max;               /* cwnd at the last loss, reduced for fast convergence */
+  double w_last_max;          /* cwnd at the loss before that */
+  double k;                   /* Seconds from the epoch start to reach origin */
+  double origin;              /* The plateau of the cubic curve */
+  double w_est;               /* What standard TCP would have grown to (TCP-friendly region) */
+};
+
+extern const struct congestion_ops congestion_newreno;
+extern const struct congestion_ops congestion_cubic;
+
+/* Looks up an algorithm by name ("newreno" or "cubic"), or returns NULL
+ * if there is none */
+const struct congestion_ops *congestion_find(const char *name);
+
+void congestion_init(struct congestion *cc, const struct congestion_ops *ops, int max_cwnd);
+
+/* Packets that may be in flight right now */
+uint32_t congestion_window(struct congestion *cc);
+
+/* acked packets were newly acknowledged outside of recovery */
+void congestion_on_ack(struct congestion *cc, uint32_t acked, uint64_t now_millis, int srtt_millis);
+
+/* Fast retransmit: sets ssthresh and inflates cwnd by the packets known
+ * to have left the network (the duplicate acks that triggered it, or 0
+ * when the caller tracks that itself from SACKs) */
+void congestion_on_loss(struct congestion *cc, uint32_t flight, uint32_t left_network, uint64_t now_millis);
+
+/* One more packet has left the network during recovery */
+void congestion_on_dup_ack(struct congestion *cc);
+
+/* A partial ack during recovery acknowledged acked packets */
+void congestion_on_partial_ack(struct congestion *cc, uint32_t acked);
+
+/* Everything outstanding at the loss has been acked */
+void congestion_exit_recovery(struct congestion *cc);
+
+/* The retransmission timer expired */
+void congestion_on_timeout(struct congestion *cc, uint32_t flight, uint64_t now_millis);
+
+#endif /* CONGESTION_H */
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Drives a "reliable -s" server with many simulated clients, each its own
+ * UDP socket (and so its own address to demultiplex), and reports how fast
+ * the server turns data packets into acks.  The server must relay to the
+ * TCP port given here, where a child process accepts and holds the
+ * connections. */
+
+char *progname;
+
+#define PAYLOAD_LEN 16
+#define LOSS_TIMEOUT_MS 200
+#define SETUP_TRIES 10
+
+struct client {
+  int s;
+  uint32_t seqno;		/* next seqno to send */
+  int established;		/* the server has acked something */
+};
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Same checksum as rlib.c */
+static uint16_t
+cksum (const void *_data, int len)
+{
+  const uint8_t *data = _data;
+  uint32_t sum;
+
+  for (sum = 0;len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons (~sum);
+  return sum ? sum : 0xffff;
+}
+
+static void
+send_data (struct client *cl)
+{
+  struct {
+    uint16_t cksum;
+    uint16_t len;
+    uint32_t ackno;
+    uint32_t seqno;
+    char data[PAYLOAD_LEN];
+  } pkt;
+
+  memset (&pkt, 'x', sizeof (pkt));
+  pkt.len = htons (sizeof (pkt));
+  pkt.ackno = htonl (1);
+  pkt.seqno = htonl (cl->seqno++);
+  pkt.cksum = 0;
+  pkt.cksum = cksum (&pkt, sizeof (pkt));
+  if (send (cl->s, &pkt, sizeof (pkt), 0) < 0 && errno != EAGAIN)
+    perror ("send");
+}
+
+/* Accepts and holds the server's relay connections, never reading; the
+ * payloads are small enough to sit in the socket buffers */
+static pid_t
+start_sink (char *port)
+{
+  struct sockaddr_in sin;
+  int n = 1;
+  int sl = socket (AF_INET, SOCK_STREAM, 0);
+  pid_t pid;
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (atoi (port));
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  setsockopt (sl, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+  if (bind (sl, (struct sockaddr *) &sin, sizeof (sin)) < 0
+      || listen (sl, 4096) < 0) {
+    perror ("sink");
+    exit (1);
+  }
+
+  if ((pid = fork ()) == 0) {
+    for (;;)
+      if (accept (sl, NULL, NULL) < 0 && errno == EMFILE) {
+	fprintf (stderr, "%s: sink out of descriptors\n", progname);
+	pause ();
+      }
+  }
+  close (sl);
+  return pid;
+}
+
+/* Receives acks until every outstanding packet is acked or nothing has
+ * arrived for LOSS_TIMEOUT_MS, returning how many acks were received */
+static long
+collect_acks (int ep, long outstanding, long want_below)
+{
+  struct epoll_event ev[256];
+  char buf[600];
+  long acks = 0;
+
+  while (outstanding - acks > want_below) {
+    int i, n = epoll_wait (ep, ev, 256, LOSS_TIMEOUT_MS);
+    if (n <= 0)
+      break;
+    for (i = 0; i < n; i++) {
+      struct client *cl = ev[i].data.ptr;
+      while (recv (cl->s, buf, sizeof (buf), 0) > 0) {
+	cl->established = 1;
+	acks++;
+      }
+    }
+  }
+  return acks;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-n clients] [-r rounds] [-o outstanding]"
+	   " server-host:udp-port tcp-port\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  int nclients = 10000;
+  int rounds = 20;
+  int max_outstanding = 256;
+  int opt, i, r;
+  struct addrinfo hints, *ai;
+  struct client *clients;
+  struct rlimit rl;
+  char *host, *port;
+  uint64_t start, setup_us, steady_us;
+  long sent = 0, acked = 0, outstanding = 0, setup_acks;
+  pid_t sink;
+  int ep;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  while ((opt = getopt (argc, argv, "n:r:o:")) != -1)
+    switch (opt) {
+    case 'n':
+      nclients = atoi (optarg);
+      break;
+    case 'r':
+      rounds = atoi (optarg);
+      break;
+    case 'o':
+      max_outstanding = atoi (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (optind + 2 != argc || nclients < 1 || rounds < 1 || max_outstanding < 1)
+    usage ();
+
+  /* One descriptor per client, plus a few */
+  getrlimit (RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit (RLIMIT_NOFILE, &rl);
+  if (rl.rlim_cur < (rlim_t) nclients + 16) {
+    fprintf (stderr, "%s: %d clients need more than the %lu descriptors"
+	     " allowed\n", progname, nclients, (unsigned long) rl.rlim_cur);
+    exit (1);
+  }
+
+  host = strsep (&argv[optind], ":");
+  port = argv[optind];
+  if (!port) {
+    port = host;
+    host = NULL;
+  }
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo (host, port, &hints, &ai)) {
+    fprintf (stderr, "%s: can't resolve server\n", progname);
+    exit (1);
+  }
+
+  sink = start_sink (argv[optind + 1]);
+
+  ep = epoll_create1 (0);
+  clients = calloc (nclients, sizeof (*clients));
+  for (i = 0; i < nclients; i++) {
+    struct epoll_event ev;
+    struct client *cl = &clients[i];
+    cl->s = socket (AF_INET, SOCK_DGRAM, 0);
+    if (cl->s < 0 || connect (cl->s, ai->ai_addr, ai->ai_addrlen) < 0) {
+      perror ("client socket");
+      exit (1);
+    }
+    fcntl (cl->s, F_SETFL, fcntl (cl->s, F_GETFL) | O_NONBLOCK);
+    cl->seqno = 1;
+    ev.events = EPOLLIN;
+    ev.data.ptr = cl;
+    epoll_ctl (ep, EPOLL_CTL_ADD, cl->s, &ev);
+  }
+  freeaddrinfo (ai);
+
+  /* Every client's first packet makes the server create a session.  A
+   * client whose first packet is lost has no session and would have the
+   * rest ignored, so it is resent until acked. */
+  start = now_us ();
+  setup_acks = 0;
+  for (r = 0; r < SETUP_TRIES; r++) {
+    int pending = 0;
+    for (i = 0; i < nclients; i++) {
+      if (clients[i].established)
+	continue;
+      clients[i].seqno = 1;
+      send_data (&clients[i]);
+      pending++;
+      if (++outstanding >= max_outstanding) {
+	setup_acks += collect_acks (ep, outstanding, max_outstanding / 2);
+	outstanding = max_outstanding / 2;
+      }
+    }
+    if (!pending)
+      break;
+    setup_acks += collect_acks (ep, outstanding, 0);
+    outstanding = 0;
+  }
+  setup_us = now_us () - start;
+  outstanding = 0;
+
+  /* Then packets round robin across all of them */
+  start = now_us ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < nclients; i++) {
+      send_data (&clients[i]);
+      sent++;
+      if (++outstanding >= max_outstanding) {
+	long acks = collect_acks (ep, outstanding, max_outstanding / 2);
+	acked += acks;
+	/* Anything not acked within the timeout is given up on */
+	outstanding = acks ? outstanding - acks : 0;
+	if (outstanding < 0)
+	  outstanding = 0;
+      }
+    }
+  acked += collect_acks (ep, outstanding, 0);
+  steady_us = now_us () - start;
+
+  printf ("clients %d setup %.1f ms (%ld acks)"
+	  " steady %ld pkts %ld acks %.2f s %.0f acks/s %.1f us/ack\n",
+	  nclients, setup_us / 1000.0, setup_acks, sent, acked,
+	  steady_us / 1e6, acked / (steady_us / 1e6),
+	  acked ? (double) steady_us / acked : 0);
+
+  kill (sink, SIGKILL);
+  waitpid (sink, NULL, 0);
+  return 0;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "rlib.h"
+#include "netem.h"
+
+struct held {
+  uint64_t due;			/* microseconds, on CLOCK_MONOTONIC */
+  uint64_t seq;			/* keeps packets due at once in order */
+  int fd;
+  int has_to;
+  int cancelled;		/* already sent or forgotten */
+  struct sockaddr_storage to;
+  size_t len;
+  char data[1];
+};
+
+static struct netem_config cfg;
+static netem_xmit_fn *xmit;
+static int active;
+
+static uint64_t rng;
+static int burst_bad;		/* Gilbert-Elliott channel state */
+static uint64_t link_free;	/* when the rate limited link is next idle */
+
+/* Held packets, a binary heap on (due, seq) */
+static struct held **heap;
+static size_t nheap;
+static size_t heap_size;
+static uint64_t next_seq;
+
+static struct held *reorder_held;
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64* */
+static uint64_t
+rand64 (void)
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717ULL;
+}
+
+static int
+chance (int percent)
+{
+  return percent > 0 && (int) (rand64 () % 100) < percent;
+}
+
+static void
+debug_pkt (const struct held *h, const char *op)
+{
+  if (cfg.debug)
+    print_pkt ((const packet_t *) h->data, op, h->len);
+}
+
+static int
+before (const struct held *a, const struct held *b)
+{
+  return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void
+heap_push (struct held *h)
+{
+  size_t i;
+
+  if (nheap == heap_size) {
+    heap_size = heap_size ? heap_size * 2 : 64;
+    heap = realloc (heap, heap_size * sizeof (*heap));
+    if (!heap) {
+      fprintf (stderr, "netem: out of memory\n");
+      abort ();
+    }
+  }
+
+  for (i = nheap++; i > 0 && before (h, heap[(i - 1) / 2]); i = (i - 1) / 2)
+    heap[i] = heap[(i - 1) / 2];
+  heap[i] = h;
+}
+
+static struct held *
+heap_pop (void)
+{
+  struct held *top = heap[0];
+  struct held *last = heap[--nheap];
+  size_t i = 0, child;
+
+  while ((child = 2 * i + 1) < nheap) {
+    if (child + 1 < nheap && before (heap[child + 1], heap[child]))
+      child++;
+    if (!before (heap[child], last))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  if (nheap)
+    heap[i] = last;
+  return top;
+}
+
+static void
+transmit (struct held *h)
+{
+  xmit (h->fd, h->has_to ? &h->to : NULL, h->data, h->len);
+
+  /* A packet held back for reordering follows the next one out */
+  if (reorder_held == h)
+    reorder_held = NULL;
+  else if (reorder_held) {
+    xmit (reorder_held->fd, reorder_held->has_to ? &reorder_held->to : NULL,
+	  reorder_held->data, reorder_held->len);
+    reorder_held->cancelled = 1;
+    reorder_held = NULL;
+  }
+}
+
+/* Everything after loss and duplication, for one copy */
+static void
+impair (int fd, const struct sockaddr_storage *to, const void *pkt,
+	size_t len)
+{
+  struct held *h = malloc (offsetof (struct held, data[len]));
+  uint64_t now = now_us ();
+  uint64_t due = now;
+
+  if (!h) {
+    fprintf (stderr, "netem: out of memory\n");
+    abort ();
+  }
+  h->seq = next_seq++;
+  h->fd = fd;
+  h->has_to = to != NULL;
+  if (to)
+    h->to = *to;
+  h->cancelled = 0;
+  h->len = len;
+  memcpy (h->data, pkt, len);
+
+  if (chance (cfg.corrupt)) {
+    size_t bit = rand64 () % (len * 8);
+    debug_pkt (h, "corrupting: ");
+    h->data[bit / 8] ^= 1 << (bit % 8);
+  }
+
+  if (cfg.rate_kbps) {
+    if (link_free < now)
+      link_free = now;
+    /* What is already waiting for the link, in bytes */
+    if ((link_free - now) * cfg.rate_kbps / 8000 > NETEM_QUEUE_BYTES) {
+      debug_pkt (h, "dropping (queue full): ");
+      free (h);
+      return;
+    }
+    link_free += (uint64_t) len * 8000 / cfg.rate_kbps;
+    due = link_free;
+  }
+
+  due += (uint64_t) cfg.latency_ms * 1000;
+  if (chance (cfg.delay)) {
+    debug_pkt (h, "delaying: ");
+    due += rand64 () % ((uint64_t) cfg.delay_ms * 1000 + 1);
+  }
+  h->due = due;
+
+  if (!reorder_held && chance (cfg.reorder)) {
+    debug_pkt (h, "reordering: ");
+    h->due += NETEM_REORDER_MS * 1000;
+    reorder_held = h;
+  }
+  else if (due <= now) {
+    transmit (h);
+    free (h);
+    return;
+  }
+
+  heap_push (h);
+}
+
+void
+netem_init (const struct netem_config *c, netem_xmit_fn *x)
+{
+  cfg = *c;
+  xmit = x;
+  active = cfg.drop || cfg.burst_enter || cfg.duplicate || cfg.corrupt
+    || cfg.rate_kbps || cfg.latency_ms || cfg.delay || cfg.reorder;
+
+  /* splitmix64, so that nearby seeds start far apart (and never at 0) */
+  rng = cfg.seed + 0x9e3779b97f4a7c15ULL;
+  rng = (rng ^ (rng >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  rng = (rng ^ (rng >> 27)) * 0x94d049bb133111ebULL;
+  rng ^= rng >> 31;
+  if (!rng)
+    rng = 1;
+}
+
+void
+netem_send (int fd, const struct sockaddr_storage *to, const void *pkt,
+	    size_t len)
+{
+  int loss = cfg.drop;
+
+  if (!active) {
+    xmit (fd, to, pkt, len);
+    return;
+  }
+
+  if (cfg.burst_enter) {
+    if (burst_bad ? chance (cfg.burst_leave) : chance (cfg.burst_enter))
+      burst_bad = !burst_bad;
+    if (burst_bad)
+      loss = cfg.burst_loss;
+  }
+  if (chance (loss)) {
+    if (cfg.debug)
+      print_pkt (pkt, "dropping: ", len);
+    return;
+  }
+
+  if (chance (cfg.duplicate)) {
+    if (cfg.debug)
+      print_pkt (pkt, "duplicating: ", len);
+    impair (fd, to, pkt, len);
+  }
+  impair (fd, to, pkt, len);
+}
+
+long
+netem_next (void)
+{
+  uint64_t now;
+
+  if (!nheap)
+    return -1;
+  now = now_us ();
+  if (heap[0]->due <= now)
+    return 0;
+  return (heap[0]->due - now + 999) / 1000;
+}
+
+void
+netem_run (void)
+{
+  uint64_t now = now_us ();
+
+  while (nheap && heap[0]->due <= now) {
+    struct held *h = heap_pop ();
+    if (!h->cancelled)
+      transmit (h);
+    free (h);
+  }
+}
+
+void
+netem_flush (int fd)
+{
+  size_t i;
+
+  if (reorder_held && reorder_held->fd == fd)
+    reorder_held = NULL;
+  for (i = 0; i < nheap; i++)
+    if (heap[i]->fd == fd && !heap[i]->cancelled) {
+      xmit (fd, heap[i]->has_to ? &heap[i]->to : NULL, heap[i]->data,
+	    heap[i]->len);
+      heap[i]->cancelled = 1;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef NETEM_H
+#define NETEM_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* In-process network impairment for conn_sendpkt.
+
+   Every packet sent passes through the stages below, in order, each
+   drawing from one seeded random number generator, so a run is
+   repeatable for a given seed and sequence of sends:
+
+     loss	  independent with probability drop, or Gilbert-Elliott burst
+		  loss when burst_enter is set: each packet first moves the
+		  channel from good to bad with probability burst_enter (bad
+		  to good with burst_leave), and is lost with probability
+		  drop when good, burst_loss when bad
+     duplicate	  a second copy goes through the remaining stages on its own
+     corrupt	  one random bit is flipped
+     rate	  packets leave at rate_kbps, queueing behind each other;
+		  one that would wait more than NETEM_QUEUE_BYTES is dropped
+     latency	  every packet is held latency_ms
+     delay	  a delay percent of packets are held up to delay_ms more
+     reorder	  a reorder percent of packets are held back until the next
+		  packet has gone (or NETEM_REORDER_MS have passed)
+
+   Probabilities are percentages.  Held packets sit in a queue ordered by
+   when they are due, and netem_next tells the event loop how long it can
+   sleep.  Nothing forks or sleeps. */
+
+#define NETEM_QUEUE_BYTES 65536
+#define NETEM_REORDER_MS 10
+
+struct netem_config {
+  int drop;
+  int burst_enter;
+  int burst_leave;
+  int burst_loss;
+  int duplicate;
+  int corrupt;
+  int rate_kbps;		/* 0 for no limit */
+  int latency_ms;
+  int delay;
+  int delay_ms;
+  int reorder;
+  unsigned int seed;
+  int debug;			/* print_pkt what happens to packets */
+};
+
+/* Actually sends a packet, to the socket's peer if to is NULL */
+typedef void netem_xmit_fn (int fd, const struct sockaddr_storage *to,
+			    const void *pkt, size_t len);
+
+void netem_init (const struct netem_config *cfg, netem_xmit_fn *xmit);
+
+/* Impairs a packet and passes what is left of it to xmit, now or later */
+void netem_send (int fd, const struct sockaddr_storage *to,
+		 const void *pkt, size_t len);
+
+/* Milliseconds until a held packet is due, or -1 if none are held */
+long netem_next (void);
+
+/* Sends the held packets that are due */
+void netem_run (void);
+
+/* Sends the packets held for fd right away, before it is closed, so a
+   connection's last acks aren't lost to the emulated latency */
+void netem_flush (int fd);
+
+#endif /* NETEM_H */
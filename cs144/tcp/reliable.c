@@ -14,6 +14,8 @@
 #include <netinet/in.h>
 
 #include "rlib.h"
+#include "congestion.h"
+#include "timerwheel.h"
 
 #include  <signal.h>
 
@@ -25,6 +27,18 @@ static const int ACK_PACKET_LEN = 8;
 static const int DATA_PACKET_HEADER_LEN = 12;
 static const int DATA_PACKET_MAX_PAYLOAD_LEN = 500;
 static const int DATA_PACKET_MAX_LEN = 512; /* 12 bytes for header + 500 bytes for payload */
+static const uint16_t SACK_ACK_FLAG = 0x8000; /* Set in a SACK ack's len, which never needs more than 10 bits */
+
+static const int MIN_RTO_MILLIS = 50;
+static const int MAX_RTO_MILLIS = 60000;
+
+static const int DUP_ACK_THRESHOLD = 3;
+
+static const uint32_t ACK_EVERY_PKTS = 2;
+
+static const int OUTPUT_IOV_MAX = 64;
+
+static const uint32_t SESSION_TABLE_MIN_BUCKETS = 64;
 
 enum packet_type {
   DATA_PACKET, ACK_PACKET, INVALID_PACKET
@@ -36,17 +50,23 @@ struct reliable_state {
 
   conn_t *c;		             /* This is the connection object */
   struct sockaddr_storage ss;        /* Network peer */
+  rel_t *hash_next;                  /* Next session in the same session_table bucket */
+  bool in_session_table;             /* Whether the session is demultiplexed by ss (server mode) */
 
   int window_size;                   /* The size of the window */ 
+  uint32_t window_slots;             /* The size of the per-packet arrays, window_size rounded up to a power of 2 */
 
-  packet_t *pkts_sent;               /* An array of packets sent with size = window size */
-  packet_t *pkts_recvd;              /* An array of packets received with size = window size */
+  packet_t **pkts_sent;              /* An array of the packets in flight, from pkt_pool, NULL for empty slots */
+  packet_t **pkts_recvd;             /* An array of the packets received and not yet output, from pkt_pool */
 
-  bool *has_recvd_pkt;               /* An array of booleans indicating which packets in the receive window have been received */
+  uint64_t *recvd_bitmap;            /* A bit per slot of pkts_recvd, set when it holds a received packet */
 
   uint64_t *pkt_send_time_millis;    /* An array of timestamps representing when each packet in the window was sent */
+  bool *pkt_retransmitted;           /* An array of booleans indicating which packets in the send window have been re-sent */
+  bool *pkt_sacked;                  /* An array of booleans indicating which packets in the send window the peer has selectively acked */
+  bool *pkt_resent_in_recovery;      /* An array of booleans indicating which packets have been re-sent since the last timeout */
 
-  uint32_t last_ackno_sent;          /* The last ackno sent to the other side of the connection */
+  uint32_t last_ackno_sent;          /* The ackno covering everything output, which a delayed ack may not have sent yet */
   uint32_t last_ackno_recvd;         /* The last ackno received from the other side of the connection */
 
   uint32_t last_seqno_sent;          /* The sequence number of the last sent packet */
@@ -56,22 +76,84 @@ struct reliable_state {
   bool last_pkt_recvd_eof;           /* Signifies whether the last received data packet was an EOF */
 
   bool read_eof;                     /* Whether or not the last read input was EOF */
-
-  bool last_pkt_sent_partial;        /* Whether the last packet sent has a partially filled payload */
-
-  int timeout_millis;                /* The maximum timeout before attempting to re-send a packet */
+  bool eof_sent;                     /* Whether the EOF packet has been sent, after everything read */
+
+  char *send_buf;                    /* Input not sent yet, coalesced into a payload of up to DATA_PACKET_MAX_PAYLOAD_LEN */
+  uint16_t send_buf_len;             /* The number of bytes in send_buf */
+  uint64_t send_buf_time_millis;     /* When the oldest byte in send_buf was read */
+  bool nodelay;                      /* Whether partial payloads are sent right away */
+  int flush_delay_millis;            /* The longest a partial payload waits for the packets in flight */
+
+  uint32_t pkts_unacked;             /* The number of packets output since the last ack sent, whose ack is delayed */
+  uint64_t ack_due_millis;           /* When the delayed ack has to go */
+  int ack_delay_millis;              /* The longest an ack is delayed, 0 to ack every packet right away */
+  uint32_t data_pkts_recvd;          /* Counters for how many acks data packets take */
+  uint32_t acks_sent;
+  uint32_t acks_piggybacked;         /* Delayed acks sent on a data packet instead */
+  uint32_t data_pkts_resent;         /* Retransmissions of every kind, for xferbench */
+
+  int timeout_millis;                /* The retransmission timeout (RTO) from the RTT estimate */
+  int backoff;                       /* How many times the RTO has doubled since the last new ack */
+  int timer_millis;                  /* The configured timer granularity, the RTO's lower bound on 4 * RTTVAR */
+  struct timer_entry timer;          /* Fires at the retransmission deadline, or right away once the connection can close */
+  bool has_rtt_sample;               /* Whether srtt and rttvar have been initialized from a measurement */
+  int srtt_millis;                   /* The smoothed round trip time */
+  int rttvar_millis;                 /* The round trip time variation */
+
+  struct congestion cc;              /* Limits how much of the window can be in flight */
+  uint32_t dup_acks;                 /* The number of acks in a row repeating last_ackno_recvd */
+  bool in_recovery;                  /* Whether we are in fast recovery */
+  uint32_t recover;                  /* The last seqno sent when recovery started, recovery ends once it is acked */
+
+  bool sack;                         /* Whether to send selective acks and recover from the ones received */
+  uint32_t rto_lost_below;           /* Unsacked packets below this seqno were outstanding at the last timeout and count as lost */
+  uint32_t rto_resend_next;          /* Without SACK, the next of those to resend (go-back-N) */
 };
 rel_t *rel_list;
 
+/* Packets held in the send and receive windows come from a pool shared by
+ * every connection, so a large window only takes memory for the packets
+ * actually in it. Freed packets stay in the pool for the next ones. */
+union pkt_buf {
+  union pkt_buf *next;               /* In pkt_pool while free */
+  packet_t pkt;
+};
+union pkt_buf *pkt_pool;
+
+packet_t *pkt_alloc();
+void pkt_free(packet_t *pkt);
+
+/* Every connection's next deadline, so rel_timer only visits the
+ * connections that are due */
+struct timer_wheel rel_timers;
+bool rel_timers_started;
+
+/* Server sessions hashed by peer address, so demultiplexing a packet
+ * doesn't walk every connection. Chained, and doubled whenever there are
+ * more sessions than buckets. */
+rel_t **session_table;
+uint32_t session_table_buckets;
+uint32_t session_table_count;
+
 rel_t *get_session(const struct sockaddr_storage *ss);
+void session_table_insert(rel_t *r);
+void session_table_remove(rel_t *r);
+void session_table_resize(uint32_t buckets);
 
 void process_first_pkt(packet_t *pkt, enum packet_type pkt_type, const struct sockaddr_storage *ss, const struct config_common *cc);
 void process_pkt(rel_t *r, packet_t *pkt, enum packet_type pkt_type);
 void process_ack_pkt(rel_t *r, packet_t *pkt);
+void process_dup_ack(rel_t *r);
+void process_sack(rel_t *r, packet_t *pkt);
+void sack_recover(rel_t *r);
+uint32_t sack_lost_below(rel_t *r);
+uint32_t sack_pipe(rel_t *r, uint32_t lost_below);
 void process_data_pkt(rel_t *r, packet_t *pkt);
 
 bool pkt_out_of_bounds(rel_t *r, packet_t *pkt);
-bool has_recvd_pkt(rel_t *r, packet_t *pkt);
+bool has_recvd_pkt(rel_t *r, uint32_t seqno);
+void set_recvd_pkt(rel_t *r, uint32_t seqno, bool recvd);
+uint32_t recvd_run(rel_t *r, uint32_t seqno, uint32_t max);
 uint32_t get_pkt_idx(rel_t *r, uint32_t seqno);
 bool has_buffered_pkts(rel_t *r);
 void process_eof_pkt(rel_t *r, packet_t *pkt);
@@ -80,17 +162,27 @@ void add_pkt_to_send_window(rel_t *r, packet_t *pkt);
 void add_pkt_to_recv_window(rel_t *r, packet_t *pkt);
 
 void output_pkts(rel_t *r);
-uint16_t output_pkt(rel_t *r, packet_t *pkt, uint16_t start, uint16_t payload_len);
+void ack_output_pkts(rel_t *r, uint32_t num_pkts, bool ack_now);
 
 int send_ack_pkt(rel_t *r, uint32_t ackno);
+void add_sack_bitmap(rel_t *r, packet_t *pkt);
 
 uint32_t avail_send_window_slots(rel_t *r);
+uint32_t pkts_in_flight(rel_t *r);
 bool has_unackd_pkts(rel_t *r);
 
+void fill_send_buf(rel_t *r);
+bool can_send_partial(rel_t *r);
+
 int send_new_data_pkt(rel_t *r, char *data, uint16_t payload_len);
 int send_data_pkt(rel_t *r, packet_t *pkt);
 
 void retransmit_pkt(rel_t *r);
+void resend_after_timeout(rel_t *r);
+void resend_pkt(rel_t *r, uint32_t seqno);
+void update_rto(rel_t *r, uint32_t ackno);
+int clamp_rto(long long rto_millis);
+int current_rto(rel_t *r);
 bool should_close_conn(rel_t *r);
 
 void init_ack_pkt(packet_t *pkt, uint32_t ackno);
@@ -102,8 +194,17 @@ void pkt_hton(packet_t *pkt);
 enum packet_type get_pkt_type(packet_t *pkt, size_t n);
 bool checksum_matches(packet_t *pkt);
 
+void rel_schedule_timer(rel_t *r);
+void rel_on_timer(void *arg);
+
 uint64_t get_timestamp_millis();
 
+bool seq_lt(uint32_t a, uint32_t b);
+bool seq_leq(uint32_t a, uint32_t b);
+bool seq_gt(uint32_t a, uint32_t b);
+bool seq_geq(uint32_t a, uint32_t b);
+uint32_t seq_max(uint32_t a, uint32_t b);
+
 /* Creates a new reliable protocol session, returns NULL on failure.
  * Exactly one of c and ss should be NULL.  (ss is NULL when called
  * from rlib.c, while c is NULL when this function is called from
@@ -127,6 +228,7 @@ rel_t * rel_create(conn_t *c, const struct sockaddr_storage *ss,
 
   if (ss != NULL) {
     r->ss = *ss;
+    session_table_insert(r);
   }
 
   r->next = rel_list;
@@ -137,17 +239,32 @@ rel_t * rel_create(conn_t *c, const struct sockaddr_storage *ss,
 
   r->window_size = cc->window;
 
-  r->pkts_sent = xmalloc(r->window_size * sizeof(packet_t));
-  r->pkts_recvd = xmalloc(r->window_size * sizeof(packet_t));
+  /* A power of 2, so slots stay contiguous when sequence numbers wrap */
+  r->window_slots = 1;
+  while (r->window_slots < r->window_size) {
+    r->window_slots *= 2;
+  }
+
+  r->pkts_sent = xmalloc(r->window_slots * sizeof(packet_t *));
+  r->pkts_recvd = xmalloc(r->window_slots * sizeof(packet_t *));
 
-  r->has_recvd_pkt = xmalloc(r->window_size * sizeof(bool));
+  uint32_t bitmap_words = (r->window_slots + 63) / 64;
+  r->recvd_bitmap = xmalloc(bitmap_words * sizeof(uint64_t));
+  memset(r->recvd_bitmap, 0, bitmap_words * sizeof(uint64_t));
 
-  r->pkt_send_time_millis = xmalloc(r->window_size * sizeof(uint64_t));
+  r->pkt_send_time_millis = xmalloc(r->window_slots * sizeof(uint64_t));
+  r->pkt_retransmitted = xmalloc(r->window_slots * sizeof(bool));
+  r->pkt_sacked = xmalloc(r->window_slots * sizeof(bool));
+  r->pkt_resent_in_recovery = xmalloc(r->window_slots * sizeof(bool));
 
-  int i;
-  for (i = 0; i < r->window_size; i++) {
-    r->has_recvd_pkt[i] = FALSE;
+  uint32_t i;
+  for (i = 0; i < r->window_slots; i++) {
+    r->pkts_sent[i] = NULL;
+    r->pkts_recvd[i] = NULL;
     r->pkt_send_time_millis[i] = 0;
+    r->pkt_retransmitted[i] = FALSE;
+    r->pkt_sacked[i] = FALSE;
+    r->pkt_resent_in_recovery[i] = FALSE;
   }
 
   r->last_seqno_sent = 0;
@@ -160,11 +277,50 @@ rel_t * rel_create(conn_t *c, const struct sockaddr_storage *ss,
   r->last_pkt_bytes_outputted = 0;
 
   r->read_eof = FALSE;
+  r->eof_sent = FALSE;
+
+  r->send_buf = xmalloc(DATA_PACKET_MAX_PAYLOAD_LEN);
+  r->send_buf_len = 0;
+  r->send_buf_time_millis = 0;
+  r->nodelay = cc->nodelay;
+  r->flush_delay_millis = cc->flush_delay;
+
+  r->pkts_unacked = 0;
+  r->ack_due_millis = 0;
+  r->ack_delay_millis = cc->ack_delay;
+  r->data_pkts_recvd = 0;
+  r->acks_sent = 0;
+  r->acks_piggybacked = 0;
+  r->data_pkts_resent = 0;
+
+  /* The -t timeout is only used until the first round trip is measured */
+  r->timeout_millis = clamp_rto(cc->timeout);
+  r->backoff = 0;
+  r->timer_millis = cc->timer;
+  r->has_rtt_sample = FALSE;
+  r->srtt_millis = 0;
+  r->rttvar_millis = 0;
+
+  const struct congestion_ops *ops = congestion_find(cc->congestion);
+  if (ops == NULL) {
+    fprintf(stderr, "%d: unknown congestion control %s\n", getpid(), cc->congestion);
+    exit(1);
+  }
+  congestion_init(&r->cc, ops, r->window_size);
+  r->dup_acks = 0;
+  r->in_recovery = FALSE;
+  r->recover = 0;
+
+  r->sack = cc->sack;
+  r->rto_lost_below = 1;
+  r->rto_resend_next = 1;
+
+  if (rel_timers_started == FALSE) {
+    timer_wheel_init(&rel_timers, get_timestamp_millis());
+    rel_timers_started = TRUE;
+  }
+  timer_entry_init(&r->timer, rel_on_timer, r);
 
-  r->last_pkt_sent_partial = FALSE;
-
-  r->timeout_millis = cc->timeout;
-  
   return r;
 }
 
@@ -174,10 +330,33 @@ void rel_destroy(rel_t *r) {
   *r->prev = r->next;
   conn_destroy (r->c);
 
+  fprintf(stderr, "%d: %u data packets received, %u acks sent, %u more piggybacked, %u data packets resent\n",
+          getpid(), r->data_pkts_recvd, r->acks_sent, r->acks_piggybacked, r->data_pkts_resent);
+
+  timer_wheel_cancel(&rel_timers, &r->timer);
+
+  if (r->in_session_table == TRUE) {
+    session_table_remove(r);
+  }
+
+  uint32_t i;
+  for (i = 0; i < r->window_slots; i++) {
+    if (r->pkts_sent[i] != NULL) {
+      pkt_free(r->pkts_sent[i]);
+    }
+    if (r->pkts_recvd[i] != NULL) {
+      pkt_free(r->pkts_recvd[i]);
+    }
+  }
+
   free(r->pkts_sent);
   free(r->pkts_recvd);
-  free(r->has_recvd_pkt);
+  free(r->recvd_bitmap);
   free(r->pkt_send_time_millis);
+  free(r->pkt_retransmitted);
+  free(r->pkt_sacked);
+  free(r->pkt_resent_in_recovery);
+  free(r->send_buf);
 
   free(r);
 }
@@ -205,6 +384,7 @@ void rel_demux(const struct config_common *cc,
 
   if (existing_session != NULL) {
     process_pkt(existing_session, pkt, pkt_type);
+    rel_schedule_timer(existing_session);
   } else {
     fprintf(stderr, "%d: rel_demux: process first pkt\n", getpid());
     process_first_pkt(pkt, pkt_type, ss, cc);
@@ -215,48 +395,87 @@ void rel_recvpkt(rel_t *r, packet_t *pkt, size_t n) {
   enum packet_type pkt_type = get_pkt_type(pkt, n);
   pkt_ntoh(pkt);
   process_pkt(r, pkt, pkt_type);
+  rel_schedule_timer(r);
 }
 
+/* Input is coalesced in send_buf and sent in full packets while the
+ * window has room. Per Nagle's algorithm, a partial packet is held while
+ * anything is in flight, but for no longer than the flush delay, and not
+ * at all with nodelay or once the input has ended. Also called whenever
+ * an ack opens the window and when the flush delay runs out. */
 void rel_read(rel_t *r) {
-  if (r->read_eof == TRUE) {
+  if (r->eof_sent == TRUE) {
     fprintf(stderr, "%d: rel_read: already read EOF\n", getpid());
     return;
   }
 
-  if (r->last_pkt_sent_partial == TRUE) {
-    fprintf(stderr, "%d: rel_read: last pkt sent partial\n", getpid());
-    return;
-  }
-
-  uint32_t pkts_to_send = avail_send_window_slots(r);
-
-  while (pkts_to_send > 0) {
-    char buf[DATA_PACKET_MAX_PAYLOAD_LEN];
-    int bytes_read = conn_input(r->c, buf, DATA_PACKET_MAX_PAYLOAD_LEN);
+  while (avail_send_window_slots(r) > 0) {
+    fill_send_buf(r);
 
-    if (bytes_read < 0) {
+    if (r->send_buf_len == DATA_PACKET_MAX_PAYLOAD_LEN
+        || (r->send_buf_len > 0 && can_send_partial(r) == TRUE)) {
+      send_new_data_pkt(r, r->send_buf, r->send_buf_len);
+      r->send_buf_len = 0;
+    } else if (r->send_buf_len == 0 && r->read_eof == TRUE) {
       fprintf(stderr, "%d: rel_read: EOF\n", getpid());
-      r->read_eof = TRUE;
+      r->eof_sent = TRUE;
       send_new_data_pkt(r, NULL, 0); /* send EOF to other side */
       return;
+    } else {
+      break;
     }
+  }
 
-    if (bytes_read == 0) {
+  rel_schedule_timer(r);
+}
+
+/* Reads until send_buf holds a full payload, the input has nothing more
+ * for now, or it ends */
+void fill_send_buf(rel_t *r) {
+  while (r->read_eof == FALSE && r->send_buf_len < DATA_PACKET_MAX_PAYLOAD_LEN) {
+    int bytes_read = conn_input(r->c, r->send_buf + r->send_buf_len,
+                                DATA_PACKET_MAX_PAYLOAD_LEN - r->send_buf_len);
+    if (bytes_read < 0) {
+      r->read_eof = TRUE;
+    } else if (bytes_read == 0) {
       return;
+    } else {
+      if (r->send_buf_len == 0) {
+        r->send_buf_time_millis = get_timestamp_millis();
+      }
+      r->send_buf_len += bytes_read;
     }
+  }
+}
 
-    send_new_data_pkt(r, buf, bytes_read);
+bool can_send_partial(rel_t *r) {
+  if (r->nodelay == TRUE || r->read_eof == TRUE || pkts_in_flight(r) == 0) {
+    return TRUE;
+  }
+  return get_timestamp_millis() >= r->send_buf_time_millis + r->flush_delay_millis;
+}
 
-    if (bytes_read < DATA_PACKET_MAX_PAYLOAD_LEN) {
-      r->last_pkt_sent_partial = TRUE;
-    }
+uint32_t avail_send_window_slots(rel_t *r) {
+  uint32_t window = congestion_window(&r->cc);
+  uint32_t in_flight = pkts_in_flight(r);
+
+  /* With SACK, packets known to be delivered or lost don't count against
+   * cwnd, but nothing can be sent past the window */
+  uint32_t pipe = in_flight;
+  if (r->sack == TRUE) {
+    pipe = sack_pipe(r, sack_lost_below(r));
+  } else if (seq_lt(r->rto_resend_next, r->rto_lost_below)) {
+    return 0; /* resend_after_timeout goes first */
+  }
 
-    pkts_to_send--;
+  if (pipe >= window || in_flight >= r->window_size) {
+    return 0;
   }
+  return fmin(window - pipe, r->window_size - in_flight);
 }
 
-uint32_t avail_send_window_slots(rel_t *r) {
-  return r->window_size - (r->last_seqno_sent - r->last_ackno_recvd + 1);
+uint32_t pkts_in_flight(rel_t *r) {
+  return r->last_seqno_sent - r->last_ackno_recvd + 1;
 }
 
 bool has_unackd_pkts(rel_t *r) {
@@ -269,36 +488,145 @@ bool has_unackd_pkts(rel_t *r) {
 
 void rel_output(rel_t *r) {
   output_pkts(r);
+  rel_schedule_timer(r);
 }
 
 void rel_timer() {
-  rel_t *r = rel_list;
-  while (r != NULL) {
-    retransmit_pkt(r);
-    if (should_close_conn(r) == TRUE) {
-      fprintf(stderr, "%d: closing connection\n", getpid());
-      rel_t *next = r->next;
-      rel_destroy(r);
-      r = next;
-    } else {
-      r = r->next;
-    }
+  if (rel_timers_started == TRUE) {
+    timer_wheel_advance(&rel_timers, get_timestamp_millis());
+  }
+}
+
+long rel_next_timer() {
+  if (rel_timers_started == FALSE) {
+    return -1;
+  }
+
+  uint64_t next = timer_wheel_next(&rel_timers);
+  if (next == UINT64_MAX) {
+    return -1;
+  }
+
+  uint64_t now = get_timestamp_millis();
+  if (next <= now) {
+    return 0;
+  }
+  return fmin(next - now, MAX_RTO_MILLIS);
+}
+
+/* A connection's one timer covers all of its deadlines: the oldest
+ * unacked packet's retransmission, flushing a partial packet held back by
+ * Nagle's algorithm, a delayed ack, and closing once both sides are done.
+ * Called after anything that can move any of them. A partial packet that
+ * has no room in the window waits for an ack instead. */
+void rel_schedule_timer(rel_t *r) {
+  if (should_close_conn(r) == TRUE) {
+    timer_wheel_schedule(&rel_timers, &r->timer, get_timestamp_millis());
+    return;
+  }
+
+  uint64_t deadline = UINT64_MAX;
+  if (pkts_in_flight(r) > 0) {
+    uint32_t idx = get_pkt_idx(r, r->last_ackno_recvd);
+    deadline = r->pkt_send_time_millis[idx] + current_rto(r) + 1;
+  }
+  if (r->send_buf_len > 0 && avail_send_window_slots(r) > 0
+      && r->send_buf_time_millis + r->flush_delay_millis < deadline) {
+    deadline = r->send_buf_time_millis + r->flush_delay_millis;
+  }
+  if (r->pkts_unacked > 0 && r->ack_due_millis < deadline) {
+    deadline = r->ack_due_millis;
+  }
+
+  if (deadline == UINT64_MAX) {
+    timer_wheel_cancel(&rel_timers, &r->timer);
+  } else {
+    timer_wheel_schedule(&rel_timers, &r->timer, deadline);
+  }
+}
+
+void rel_on_timer(void *arg) {
+  rel_t *r = arg;
+
+  retransmit_pkt(r);
+  if (r->send_buf_len > 0) {
+    rel_read(r);
+  }
+  if (r->pkts_unacked > 0 && get_timestamp_millis() >= r->ack_due_millis) {
+    send_ack_pkt(r, r->last_ackno_sent);
+  }
+  if (should_close_conn(r) == TRUE) {
+    fprintf(stderr, "%d: closing connection\n", getpid());
+    rel_destroy(r);
+  } else {
+    rel_schedule_timer(r);
   }
 }
 
 rel_t *get_session(const struct sockaddr_storage *ss) {
-  rel_t *r = rel_list;
+  if (session_table == NULL) {
+    return NULL;
+  }
+
+  rel_t *r = session_table[addrhash(ss) & (session_table_buckets - 1)];
 
   while (r != NULL) {
     if (addreq(&r->ss, ss)) {
       return r;
     }
-    r = r->next;
+    r = r->hash_next;
   }
 
   return NULL; 
 }
 
+void session_table_insert(rel_t *r) {
+  if (session_table == NULL) {
+    session_table_resize(SESSION_TABLE_MIN_BUCKETS);
+  } else if (session_table_count >= session_table_buckets) {
+    session_table_resize(session_table_buckets * 2);
+  }
+
+  uint32_t bucket = addrhash(&r->ss) & (session_table_buckets - 1);
+  r->hash_next = session_table[bucket];
+  session_table[bucket] = r;
+  r->in_session_table = TRUE;
+  session_table_count++;
+}
+
+void session_table_remove(rel_t *r) {
+  rel_t **p = &session_table[addrhash(&r->ss) & (session_table_buckets - 1)];
+
+  while (*p != r) {
+    p = &(*p)->hash_next;
+  }
+  *p = r->hash_next;
+  r->in_session_table = FALSE;
+  session_table_count--;
+}
+
+/* buckets must be a power of 2 */
+void session_table_resize(uint32_t buckets) {
+  rel_t **table = xmalloc(buckets * sizeof(rel_t *));
+  uint32_t i;
+
+  memset(table, 0, buckets * sizeof(rel_t *));
+  for (i = 0; i < session_table_buckets; i++) {
+    rel_t *r = session_table[i];
+    while (r != NULL) {
+      rel_t *next = r->hash_next;
+      uint32_t bucket = addrhash(&r->ss) & (buckets - 1);
+      r->hash_next = table[bucket];
+      table[bucket] = r;
+      r = next;
+    }
+  }
+
+  free(session_table);
+  session_table = table;
+  session_table_buckets = buckets;
+}
+
 void process_first_pkt(packet_t *pkt, enum packet_type pkt_type, const struct sockaddr_storage *ss, const struct config_common *cc) {
   if (pkt_type != DATA_PACKET) {
     fprintf(stderr, "%d: rel_demux: ignoring non-data pkt\n", getpid());
@@ -312,35 +640,203 @@ void process_first_pkt(packet_t *pkt, enum packet_type pkt_type, const struct so
 
   rel_t *r = rel_create(NULL, ss, cc);
   process_pkt(r, pkt, pkt_type);
+  rel_schedule_timer(r);
 }
 
 void process_pkt(rel_t *r, packet_t *pkt, enum packet_type pkt_type) {
   if (pkt_type == ACK_PACKET) {
     process_ack_pkt(r, pkt);
   } else if (pkt_type == DATA_PACKET) {
+    /* Data packets carry an ack too, which only counts when it is new.
+     * It comes second, so data it lets out can carry the ack for this. */
+    uint32_t ackno = pkt->ackno;
     process_data_pkt(r, pkt);
+    if (seq_gt(ackno, r->last_ackno_recvd)) {
+      packet_t ack;
+      init_ack_pkt(&ack, ackno);
+      process_ack_pkt(r, &ack);
+    }
   }
 }
 
 void process_ack_pkt(rel_t *r, packet_t *pkt) {
-  if (pkt->ackno <= r->last_ackno_recvd) {
+  if (seq_lt(pkt->ackno, r->last_ackno_recvd) || (pkt->ackno == r->last_ackno_recvd && pkts_in_flight(r) == 0)) {
     fprintf(stderr, "%d: ignoring already received ack\n", getpid());
     return;
   }
 
-  if (pkt->ackno > r->last_seqno_sent + 1) {
+  if (seq_gt(pkt->ackno, r->last_seqno_sent + 1)) {
     fprintf(stderr, "%d: invalid ackno %u\n", getpid(), pkt->ackno);
     return;
   }
 
-  if (r->last_pkt_sent_partial == TRUE && pkt->ackno == r->last_seqno_sent + 1) {
-    r->last_pkt_sent_partial = FALSE;
+  if (r->sack == TRUE) {
+    process_sack(r, pkt);
+  }
+
+  if (pkt->ackno == r->last_ackno_recvd) {
+    process_dup_ack(r);
+    return;
+  }
+
+  uint32_t acked = pkt->ackno - r->last_ackno_recvd;
+  update_rto(r, pkt->ackno);
+
+  uint32_t seqno;
+  for (seqno = r->last_ackno_recvd; seqno != pkt->ackno; seqno++) {
+    uint32_t idx = get_pkt_idx(r, seqno);
+    pkt_free(r->pkts_sent[idx]);
+    r->pkts_sent[idx] = NULL;
   }
 
   r->last_ackno_recvd = pkt->ackno;
+  r->dup_acks = 0;
+
+  /* Keep these within the window, where comparing them is wraparound safe */
+  if (seq_lt(r->rto_lost_below, r->last_ackno_recvd)) {
+    r->rto_lost_below = r->last_ackno_recvd;
+  }
+  if (r->in_recovery == FALSE && seq_lt(r->recover, r->last_ackno_recvd - 1)) {
+    r->recover = r->last_ackno_recvd - 1;
+  }
+
+  if (r->in_recovery == FALSE) {
+    congestion_on_ack(&r->cc, acked, get_timestamp_millis(), r->srtt_millis);
+  } else if (seq_gt(pkt->ackno, r->recover)) {
+    r->in_recovery = FALSE;
+    congestion_exit_recovery(&r->cc);
+  } else if (r->sack == FALSE) {
+    /* NewReno (RFC 6582): a partial ack means the next packet was lost too */
+    congestion_on_partial_ack(&r->cc, acked);
+    resend_pkt(r, pkt->ackno);
+  }
+
+  if (r->sack == TRUE) {
+    sack_recover(r);
+  } else {
+    resend_after_timeout(r);
+  }
+
   rel_read(r);
 }
 
+/* Three duplicate acks mean the packet after last_ackno_recvd was lost while
+ * later ones got through, so it is resent without waiting for its timer.
+ * Every further duplicate is another packet that has left the network. */
+void process_dup_ack(rel_t *r) {
+  r->dup_acks++;
+
+  if (r->sack == TRUE) {
+    sack_recover(r);
+    rel_read(r);
+  } else if (r->in_recovery == TRUE) {
+    congestion_on_dup_ack(&r->cc);
+    rel_read(r);
+  } else if (r->dup_acks == DUP_ACK_THRESHOLD && seq_gt(r->last_ackno_recvd, r->recover)) {
+    fprintf(stderr, "%d: fast retransmit seqno=%u\n", getpid(), r->last_ackno_recvd);
+    r->in_recovery = TRUE;
+    r->recover = r->last_seqno_sent;
+    congestion_on_loss(&r->cc, pkts_in_flight(r), DUP_ACK_THRESHOLD, get_timestamp_millis());
+    resend_pkt(r, r->last_ackno_recvd);
+    rel_read(r);
+  }
+}
+
+/* The bitmap after a SACK ack's header marks which packets after ackno the
+ * peer has buffered, starting from ackno + 1 */
+void process_sack(rel_t *r, packet_t *pkt) {
+  uint32_t nbits = (pkt->len - fmin(pkt->len, DATA_PACKET_HEADER_LEN)) * 8;
+  uint32_t i;
+
+  for (i = 0; i < nbits; i++) {
+    uint32_t seqno = pkt->ackno + 1 + i;
+    if (seq_gt(seqno, r->last_seqno_sent)) {
+      break;
+    }
+    if (pkt->data[i / 8] & (1 << (i % 8))) {
+      r->pkt_sacked[get_pkt_idx(r, seqno)] = TRUE;
+    }
+  }
+}
+
+/* Loss recovery driven by the SACK scoreboard (RFC 6675). Unsacked packets
+ * with DUP_ACK_THRESHOLD sacked packets above them are taken as lost, and
+ * are resent in order as long as the packets still in the network (the
+ * pipe) leave room in cwnd. Packets sacked or already resent aren't sent
+ * again until a timeout. */
+void sack_recover(rel_t *r) {
+  if (pkts_in_flight(r) == 0) {
+    return;
+  }
+
+  uint32_t lost_below = sack_lost_below(r);
+
+  if (r->in_recovery == FALSE && seq_gt(r->last_ackno_recvd, r->recover)
+      && (r->dup_acks >= DUP_ACK_THRESHOLD || seq_gt(lost_below, r->last_ackno_recvd))) {
+    fprintf(stderr, "%d: fast retransmit seqno=%u\n", getpid(), r->last_ackno_recvd);
+    r->in_recovery = TRUE;
+    r->recover = r->last_seqno_sent;
+    congestion_on_loss(&r->cc, pkts_in_flight(r), 0, get_timestamp_millis());
+    lost_below = sack_lost_below(r);
+  }
+
+  uint32_t window = congestion_window(&r->cc);
+  uint32_t pipe = sack_pipe(r, lost_below);
+  uint32_t seqno;
+
+  for (seqno = r->last_ackno_recvd; seq_lt(seqno, lost_below) && pipe < window; seqno++) {
+    uint32_t idx = get_pkt_idx(r, seqno);
+    if (r->pkt_sacked[idx] == FALSE && r->pkt_resent_in_recovery[idx] == FALSE) {
+      fprintf(stderr, "%d: re-sending sack hole seqno=%u\n", getpid(), seqno);
+      resend_pkt(r, seqno);
+      pipe++;
+    }
+  }
+}
+
+/* Unsacked packets below the returned seqno are lost */
+uint32_t sack_lost_below(rel_t *r) {
+  uint32_t lost_below = r->last_ackno_recvd;
+  uint32_t sacked = 0;
+  uint32_t seqno;
+
+  for (seqno = r->last_seqno_sent; seq_gt(seqno, r->last_ackno_recvd); seqno--) {
+    if (r->pkt_sacked[get_pkt_idx(r, seqno)] == TRUE && ++sacked == DUP_ACK_THRESHOLD) {
+      lost_below = seqno;
+      break;
+    }
+  }
+
+  /* The duplicate acks that started recovery say the oldest packet is gone */
+  if (r->in_recovery == TRUE && r->dup_acks >= DUP_ACK_THRESHOLD) {
+    lost_below = seq_max(lost_below, r->last_ackno_recvd + 1);
+  }
+
+  return seq_max(lost_below, r->rto_lost_below);
+}
+
+/* Packets still in the network: the ones neither sacked nor lost, plus the
+ * ones resent */
+uint32_t sack_pipe(rel_t *r, uint32_t lost_below) {
+  uint32_t pipe = 0;
+  uint32_t seqno;
+
+  for (seqno = r->last_ackno_recvd; seq_leq(seqno, r->last_seqno_sent); seqno++) {
+    uint32_t idx = get_pkt_idx(r, seqno);
+    if (r->pkt_sacked[idx] == TRUE) {
+      continue;
+    }
+    if (seq_geq(seqno, lost_below)) {
+      pipe++;
+    }
+    if (r->pkt_resent_in_recovery[idx] == TRUE) {
+      pipe++;
+    }
+  }
+
+  return pipe;
+}
+
 void process_data_pkt(rel_t *r, packet_t *pkt) {
   if (pkt_out_of_bounds(r, pkt)) {
     fprintf(stderr, "%d: dropping out-of-bounds sequence number %u\n", getpid(), pkt->seqno);
@@ -348,7 +844,7 @@ void process_data_pkt(rel_t *r, packet_t *pkt) {
     return;
   }
 
-  if (has_recvd_pkt(r, pkt)) {
+  if (has_recvd_pkt(r, pkt->seqno)) {
     fprintf(stderr, "%d: ignoring duplicate data packet %u\n", getpid(), pkt->seqno);
     send_ack_pkt(r, r->last_ackno_sent); 
     return;
@@ -361,7 +857,7 @@ void process_data_pkt(rel_t *r, packet_t *pkt) {
   }
 
   if (pkt->len == DATA_PACKET_HEADER_LEN) {
-    if (has_buffered_pkts(r)) {
+    if (has_buffered_pkts(r) || pkt->seqno != r->last_ackno_sent) {
       fprintf(stderr, "%d: ignoring EOF - waiting on pkt %u\n", getpid(), r->last_ackno_sent);
       send_ack_pkt(r, r->last_ackno_sent);
     } else {
@@ -370,31 +866,75 @@ void process_data_pkt(rel_t *r, packet_t *pkt) {
     return;
   }
 
+  /* A packet arriving with later ones already buffered may fill a gap,
+   * which the sender should hear about right away */
+  bool had_gap = has_buffered_pkts(r);
+
+  r->data_pkts_recvd++;
   add_pkt_to_recv_window(r, pkt);
   output_pkts(r);
+  if (had_gap == TRUE && r->pkts_unacked > 0) {
+    send_ack_pkt(r, r->last_ackno_sent);
+  }
+
+  /* Still missing an earlier packet, repeat the ack so the sender can tell */
+  if (seq_gt(pkt->seqno, r->last_ackno_sent) && has_recvd_pkt(r, r->last_ackno_sent) == FALSE) {
+    send_ack_pkt(r, r->last_ackno_sent);
+  }
 }
 
 bool pkt_out_of_bounds(rel_t *r, packet_t *pkt) {
-  if (pkt->seqno < r->last_ackno_sent) {
+  if (seq_lt(pkt->seqno, r->last_ackno_sent)) {
     return TRUE;
-  } else if (pkt->seqno >= r->last_ackno_sent + r->window_size) {
+  } else if (seq_geq(pkt->seqno, r->last_ackno_sent + r->window_size)) {
     return TRUE;
   } else {
     return FALSE;
   }
 }
 
-bool has_recvd_pkt(rel_t *r, packet_t *pkt) {
-  uint32_t idx = get_pkt_idx(r, pkt->seqno);
-  return r->has_recvd_pkt[idx];
+bool has_recvd_pkt(rel_t *r, uint32_t seqno) {
+  uint32_t idx = get_pkt_idx(r, seqno);
+  return (r->recvd_bitmap[idx / 64] >> (idx % 64)) & 1;
+}
+
+void set_recvd_pkt(rel_t *r, uint32_t seqno, bool recvd) {
+  uint32_t idx = get_pkt_idx(r, seqno);
+  if (recvd == TRUE) {
+    r->recvd_bitmap[idx / 64] |= 1ULL << (idx % 64);
+  } else {
+    r->recvd_bitmap[idx / 64] &= ~(1ULL << (idx % 64));
+  }
+}
+
+/* How many packets in a row, up to max, have been received from seqno on,
+ * scanning the bitmap a word at a time for the first gap */
+uint32_t recvd_run(rel_t *r, uint32_t seqno, uint32_t max) {
+  uint32_t run = 0;
+
+  while (run < max) {
+    uint32_t idx = get_pkt_idx(r, seqno + run);
+    uint32_t bit = idx % 64;
+    uint64_t missing = ~r->recvd_bitmap[idx / 64] >> bit;
+    uint32_t n = missing != 0 ? __builtin_ctzll(missing) : 64 - bit;
+
+    /* Bits past a window smaller than a word are 0, so the end of the
+     * slots looks like a gap, after which the run goes on from slot 0 */
+    run += n;
+    if (idx + n < r->window_slots && bit + n < 64) {
+      break;
+    }
+  }
+
+  return fmin(run, max);
 }
 
 uint32_t get_pkt_idx(rel_t *r, uint32_t seqno) {
-  return (seqno - 1) % r->window_size;
+  return (seqno - 1) & (r->window_slots - 1);
 }
 
 bool has_buffered_pkts(rel_t *r) {
-  if (r->last_ackno_sent < r->last_seqno_recvd) {
+  if (seq_lt(r->last_ackno_sent, r->last_seqno_recvd)) {
     return TRUE;
   } else {
     return FALSE;
@@ -410,86 +950,122 @@ void process_eof_pkt(rel_t *r, packet_t *pkt) {
 
 void add_pkt_to_send_window(rel_t *r, packet_t *pkt) {
   uint32_t idx = get_pkt_idx(r, pkt->seqno);
-  r->pkts_sent[idx] = *pkt;
+  if (r->pkts_sent[idx] == NULL) {
+    r->pkts_sent[idx] = pkt_alloc();
+  }
+  memcpy(r->pkts_sent[idx], pkt, pkt->len);
 
   r->pkt_send_time_millis[idx] = get_timestamp_millis();
-  if (pkt->seqno > r->last_seqno_sent) {
+  r->pkt_retransmitted[idx] = FALSE;
+  r->pkt_sacked[idx] = FALSE;
+  r->pkt_resent_in_recovery[idx] = FALSE;
+  if (seq_gt(pkt->seqno, r->last_seqno_sent)) {
     r->last_seqno_sent = pkt->seqno;
   }
 }
 
 void add_pkt_to_recv_window(rel_t *r, packet_t *pkt) {
   uint32_t idx = get_pkt_idx(r, pkt->seqno);
-  r->pkts_recvd[idx] = *pkt;
+  r->pkts_recvd[idx] = pkt_alloc();
+  memcpy(r->pkts_recvd[idx], pkt, pkt->len);
 
-  r->has_recvd_pkt[idx] = TRUE;
-  if (pkt->seqno > r->last_seqno_recvd) {
+  set_recvd_pkt(r, pkt->seqno, TRUE);
+  if (seq_gt(pkt->seqno, r->last_seqno_recvd)) {
     r->last_seqno_recvd = pkt->seqno;
   }
 }
 
+/* Hands the in-order packets to conn_outputv straight from the receive
+ * window, many per call, and acks the ones it took completely */
 void output_pkts(rel_t *r) {
-  uint32_t idx = get_pkt_idx(r, r->last_ackno_sent);
-  uint16_t num_pkts = 0;
+  uint32_t num_pkts = 0;
+  bool partial = FALSE;
+
+  while (TRUE) {
+    struct iovec iov[OUTPUT_IOV_MAX];
+    int n = recvd_run(r, r->last_ackno_sent + num_pkts, fmin(OUTPUT_IOV_MAX, r->window_size - num_pkts));
+    int i;
+
+    for (i = 0; i < n; i++) {
+      packet_t *pkt = r->pkts_recvd[get_pkt_idx(r, r->last_ackno_sent + num_pkts + i)];
+      uint16_t start = i == 0 ? r->last_pkt_bytes_outputted : 0;
+      iov[i].iov_base = pkt->data + start;
+      iov[i].iov_len = pkt->len - DATA_PACKET_HEADER_LEN - start;
+    }
 
-  while (r->has_recvd_pkt[idx] == TRUE) {
-    packet_t *pkt = &r->pkts_recvd[idx];
-    uint16_t payload_len = pkt->len - DATA_PACKET_HEADER_LEN;
+    if (n == 0) {
+      break;
+    }
 
-    uint16_t bytes_outputted = output_pkt(r, pkt, r->last_pkt_bytes_outputted, payload_len);
+    int bytes_outputted = conn_outputv(r->c, iov, n);
     if (bytes_outputted < 0) {
-      perror("error calling conn_output");
-      rel_destroy(r);
-      return;
+      fprintf(stderr, "%d: error calling conn_outputv\n", getpid());
+      break;
     }
 
-    uint16_t bytes_left = payload_len - bytes_outputted - r->last_pkt_bytes_outputted;
-    if (bytes_left > 0) {
-      r->last_pkt_bytes_outputted += bytes_outputted;
-      return;
+    for (i = 0; i < n; i++) {
+      if (bytes_outputted < iov[i].iov_len) {
+        r->last_pkt_bytes_outputted += bytes_outputted;
+        break;
+      }
+      bytes_outputted -= iov[i].iov_len;
+      uint32_t idx = get_pkt_idx(r, r->last_ackno_sent + num_pkts);
+      if (r->pkts_recvd[idx]->len < DATA_PACKET_MAX_LEN) {
+        partial = TRUE;
+      }
+      r->last_pkt_bytes_outputted = 0;
+      pkt_free(r->pkts_recvd[idx]);
+      r->pkts_recvd[idx] = NULL;
+      set_recvd_pkt(r, r->last_ackno_sent + num_pkts, FALSE);
+      num_pkts++;
     }
-  
-    r->last_pkt_bytes_outputted = 0;
-    r->has_recvd_pkt[idx] = FALSE;
 
-    num_pkts += 1;
-    idx = get_pkt_idx(r, r->last_ackno_sent + num_pkts);
+    /* The rest waits for rel_output */
+    if (i < n) {
+      break;
+    }
   }
 
   if (num_pkts > 0) {
-    send_ack_pkt(r, r->last_ackno_sent + num_pkts);
+    r->last_ackno_sent += num_pkts;
+    ack_output_pkts(r, num_pkts, partial);
   }
 }
 
-uint16_t output_pkt(rel_t *r, packet_t *pkt, uint16_t start, uint16_t payload_len) {
-  uint16_t bufspace = conn_bufspace(r->c);
-  uint16_t bytes_to_output = fmin(bufspace, payload_len - start);
-
-  if (bufspace <= 0) {
-    fprintf(stderr, "%d: no bufspace available\n", getpid());
-    return 0;
+/* Delayed acks (RFC 1122, RFC 5681): an ack goes out for every second full
+ * packet output, or once the ack delay runs out, unless a data packet
+ * carries it first. A partial packet is acked right away, since per
+ * Nagle's algorithm the sender may be holding its next one until then. */
+void ack_output_pkts(rel_t *r, uint32_t num_pkts, bool ack_now) {
+  if (r->pkts_unacked == 0) {
+    r->ack_due_millis = get_timestamp_millis() + r->ack_delay_millis;
   }
+  r->pkts_unacked += num_pkts;
 
-  char buf[bytes_to_output];
-  memcpy(buf, pkt->data + start, bytes_to_output);
-
-  int bytes_outputted = conn_output(r->c, buf, bytes_to_output); 
-  assert(bytes_outputted != 0); /* guaranteed not to be 0 because we checked bufspace */
-
-  return bytes_outputted;
+  if (ack_now == TRUE || r->ack_delay_millis == 0
+      || r->pkts_unacked >= fmin(ACK_EVERY_PKTS, r->window_size)) {
+    send_ack_pkt(r, r->last_ackno_sent);
+  }
 }
 
 int send_ack_pkt(rel_t *r, uint32_t ackno) {
   packet_t pkt;
   init_ack_pkt(&pkt, ackno);
 
+  if (r->sack == TRUE && seq_gt(r->last_seqno_recvd, ackno)) {
+    add_sack_bitmap(r, &pkt);
+  }
+
+  uint16_t pkt_len = pkt.len & ~SACK_ACK_FLAG;
   pkt_hton(&pkt);
   pkt.cksum = 0;
-  pkt.cksum = cksum((void *)&pkt, ACK_PACKET_LEN);
-  int bytes_sent = conn_sendpkt(r->c, &pkt, ACK_PACKET_LEN);
+  pkt.cksum = cksum((void *)&pkt, pkt_len);
+  int bytes_sent = conn_sendpkt(r->c, &pkt, pkt_len);
 
   if (bytes_sent > 0) {
     r->last_ackno_sent = ackno;
+    r->pkts_unacked = 0;
+    r->acks_sent++;
   } else if (bytes_sent == 0) {
     fprintf(stderr, "%d: no bytes sent calling conn_sendpkt", getpid());
   } else { 
@@ -499,16 +1075,45 @@ int send_ack_pkt(rel_t *r, uint32_t ackno) {
   return bytes_sent;
 }
 
+/* A SACK ack is an ack with a data packet's header, SACK_ACK_FLAG set in its
+ * len (which no data packet can have) and a bitmap of the packets buffered
+ * after ackno */
+void add_sack_bitmap(rel_t *r, packet_t *pkt) {
+  uint32_t nbits = fmin(r->last_seqno_recvd - pkt->ackno, DATA_PACKET_MAX_PAYLOAD_LEN * 8);
+  uint32_t nbytes = (nbits + 7) / 8;
+  uint32_t i;
+
+  memset(pkt->data, 0, nbytes);
+  for (i = 0; i < nbits; i++) {
+    if (has_recvd_pkt(r, pkt->ackno + 1 + i) == TRUE) {
+      pkt->data[i / 8] |= 1 << (i % 8);
+    }
+  }
+
+  pkt->seqno = 0;
+  pkt->len = (DATA_PACKET_HEADER_LEN + nbytes) | SACK_ACK_FLAG;
+}
+
 int send_new_data_pkt(rel_t *r, char *data, uint16_t payload_len) {
   packet_t pkt;
   init_data_pkt(&pkt, r->last_ackno_sent, r->last_seqno_sent + 1, data, payload_len);
   add_pkt_to_send_window(r, &pkt);
-  return send_data_pkt(r, &pkt);
+  int bytes_sent = send_data_pkt(r, &pkt);
+  rel_schedule_timer(r);
+  return bytes_sent;
 }
 
+/* Every data packet, resent ones included, acks what has been output so
+ * far, which stands in for a delayed ack */
 int send_data_pkt(rel_t *r, packet_t *pkt) {
   uint16_t pkt_len = pkt->len;
 
+  pkt->ackno = r->last_ackno_sent;
+  if (r->pkts_unacked > 0) {
+    r->pkts_unacked = 0;
+    r->acks_piggybacked++;
+  }
+
   pkt_hton(pkt);
   pkt->cksum = 0;
   pkt->cksum = cksum((void *)pkt, pkt_len);
@@ -525,23 +1130,109 @@ int send_data_pkt(rel_t *r, packet_t *pkt) {
 }
 
 void retransmit_pkt(rel_t *r) {
-  if (r->last_seqno_sent < r->last_ackno_recvd) {
+  if (seq_lt(r->last_seqno_sent, r->last_ackno_recvd)) {
     return;
   }
 
   int idx = get_pkt_idx(r, r->last_ackno_recvd);
-  packet_t *pkt = &r->pkts_sent[idx];
-  unsigned int ellapsed_millis = get_timestamp_millis() - r->pkt_send_time_millis[idx];
-  if (ellapsed_millis > r->timeout_millis) {
-    fprintf(stderr, "%d: re-transmitting seqno=%u\n", getpid(), pkt->seqno);
-    send_data_pkt(r, pkt);
+  uint64_t now = get_timestamp_millis();
+  unsigned int ellapsed_millis = now - r->pkt_send_time_millis[idx];
+  if (ellapsed_millis > current_rto(r)) {
+    fprintf(stderr, "%d: re-transmitting seqno=%u rto=%d\n", getpid(), r->last_ackno_recvd, current_rto(r));
+
+    /* Only the first timeout in a row is a new congestion signal */
+    if (r->backoff == 0) {
+      congestion_on_timeout(&r->cc, pkts_in_flight(r), now);
+    }
+    r->in_recovery = FALSE;
+    r->recover = r->last_seqno_sent;
+    r->dup_acks = 0;
+
+    /* Everything unsacked is lost now, even the packets already resent */
+    if (r->sack == TRUE) {
+      uint32_t seqno;
+      for (seqno = r->last_ackno_recvd; seq_leq(seqno, r->last_seqno_sent); seqno++) {
+        r->pkt_resent_in_recovery[get_pkt_idx(r, seqno)] = FALSE;
+      }
+    }
+    r->rto_lost_below = r->last_seqno_sent + 1;
+
+    /* Restart the timer, backing off until the peer acks something new */
+    resend_pkt(r, r->last_ackno_recvd);
+    r->rto_resend_next = r->last_ackno_recvd + 1;
+    if (current_rto(r) < MAX_RTO_MILLIS) {
+      r->backoff++;
+    }
+  }
+}
+
+/* Without SACK, every packet outstanding at a timeout is taken as lost and
+ * resent in order as the acks open cwnd from 1, ahead of any new data
+ * (go-back-N, RFC 5681 section 3.1). Otherwise each further loss in that
+ * window would take a timeout of its own. */
+void resend_after_timeout(rel_t *r) {
+  if (seq_lt(r->rto_resend_next, r->last_ackno_recvd)) {
+    r->rto_resend_next = r->last_ackno_recvd;
+  }
+
+  uint32_t window = congestion_window(&r->cc);
+  while (seq_lt(r->rto_resend_next, r->rto_lost_below)
+         && r->rto_resend_next - r->last_ackno_recvd < window) {
+    resend_pkt(r, r->rto_resend_next);
+    r->rto_resend_next++;
   }
 }
 
+void resend_pkt(rel_t *r, uint32_t seqno) {
+  int idx = get_pkt_idx(r, seqno);
+  send_data_pkt(r, r->pkts_sent[idx]);
+  r->pkt_send_time_millis[idx] = get_timestamp_millis();
+  r->pkt_retransmitted[idx] = TRUE;
+  r->pkt_resent_in_recovery[idx] = TRUE;
+  r->data_pkts_resent++;
+}
+
+/* Jacobson/Karels estimation (RFC 6298) from the newest packet covered by
+ * ackno. Per Karn's rule, acks covering a retransmitted packet are ambiguous
+ * and aren't sampled. The ack still shows the path is delivering again, so
+ * the backoff is dropped either way. */
+void update_rto(rel_t *r, uint32_t ackno) {
+  uint32_t seqno;
+
+  r->backoff = 0;
+
+  for (seqno = r->last_ackno_recvd; seqno != ackno; seqno++) {
+    if (r->pkt_retransmitted[get_pkt_idx(r, seqno)] == TRUE) {
+      return;
+    }
+  }
+
+  int rtt_millis = get_timestamp_millis() - r->pkt_send_time_millis[get_pkt_idx(r, ackno - 1)];
+
+  if (r->has_rtt_sample == FALSE) {
+    r->srtt_millis = rtt_millis;
+    r->rttvar_millis = rtt_millis / 2;
+    r->has_rtt_sample = TRUE;
+  } else {
+    r->rttvar_millis = (3 * r->rttvar_millis + abs(r->srtt_millis - rtt_millis)) / 4;
+    r->srtt_millis = (7 * r->srtt_millis + rtt_millis) / 8;
+  }
+
+  r->timeout_millis = clamp_rto(r->srtt_millis + fmax(r->timer_millis, 4 * r->rttvar_millis));
+}
+
+int current_rto(rel_t *r) {
+  return clamp_rto((long long) r->timeout_millis << r->backoff);
+}
+
+int clamp_rto(long long rto_millis) {
+  return fmin(fmax(rto_millis, MIN_RTO_MILLIS), MAX_RTO_MILLIS);
+}
+
 bool should_close_conn(rel_t *r) {
   if (r->last_pkt_recvd_eof == FALSE) {
     return FALSE;
-  } else if (r->read_eof == FALSE) {
+  } else if (r->eof_sent == FALSE) {
     return FALSE;
   } else if (has_unackd_pkts(r) == FALSE) {
     return FALSE;
@@ -566,8 +1257,9 @@ void init_data_pkt(packet_t *pkt, uint32_t ackno, uint32_t seqno, char *data, ui
   memcpy(pkt->data, data, payload_len);
 }
 
+/* Clears SACK_ACK_FLAG, so call get_pkt_type first */
 void pkt_ntoh(packet_t *pkt) {
-  pkt->len = ntohs(pkt->len);
+  pkt->len = ntohs(pkt->len) & ~SACK_ACK_FLAG;
   pkt->ackno = ntohl(pkt->ackno);
 
   if (pkt->len >= DATA_PACKET_HEADER_LEN) {
@@ -600,8 +1292,10 @@ enum packet_type get_pkt_type(packet_t *pkt, size_t n) {
     return ACK_PACKET;
   }
 
+  bool sack = (pkt_len & SACK_ACK_FLAG) != 0;
+  pkt_len &= ~SACK_ACK_FLAG;
   if (pkt_len >= DATA_PACKET_HEADER_LEN && pkt_len <= DATA_PACKET_MAX_LEN) {
-    return DATA_PACKET;
+    return sack == TRUE ? ACK_PACKET : DATA_PACKET;
   }
   
   fprintf(stderr, "%d: invalid packet length: %u", getpid(), pkt_len);
@@ -610,7 +1304,7 @@ enum packet_type get_pkt_type(packet_t *pkt, size_t n) {
 
 
 bool checksum_matches(packet_t *pkt) {
-  uint16_t len = ntohs(pkt->len);
+  uint16_t len = ntohs(pkt->len) & ~SACK_ACK_FLAG;
   if (len == 0 || len > sizeof(*pkt)) {
     return FALSE;
   }
@@ -638,3 +1332,44 @@ uint64_t get_timestamp_millis() {
 
   return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
 }
+
+/* Sequence numbers wrap around at 2^32, so they are compared by the sign of
+ * their difference (RFC 1982), which holds while they are within 2^31 of
+ * each other. Everything compared is within a window of each other. */
+bool seq_lt(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+bool seq_leq(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) <= 0;
+}
+
+bool seq_gt(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+bool seq_geq(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) >= 0;
+}
+
+uint32_t seq_max(uint32_t a, uint32_t b) {
+  return seq_gt(a, b) ? a : b;
+}
+
+packet_t *pkt_alloc() {
+  union pkt_buf *buf = pkt_pool;
+
+  if (buf != NULL) {
+    pkt_pool = buf->next;
+  } else {
+    buf = xmalloc(sizeof(*buf));
+  }
+  return &buf->pkt;
+}
+
+void pkt_free(packet_t *pkt) {
+  union pkt_buf *buf = (union pkt_buf *)pkt;
+
+  buf->next = pkt_pool;
+  pkt_pool = buf;
+}
@@ -1,5 +1,6 @@
 /* rlib version 5 */
 
+#define _GNU_SOURCE		/* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -13,21 +14,21 @@
 #include <assert.h>
 #include <stddef.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <signal.h>
 #include <unistd.h>
 
 #include "rlib.h"
+#include "netem.h"
 
 char *progname;
 int opt_debug;
 
-int opt_drop = 0;
-int opt_corrupt = 0;
-int opt_delay = 0;
-int opt_duplicate = 0;
+int opt_outbuf = 8192;		/* output buffer per connection in bytes */
+static int udp_buffer;		/* UDP socket buffers in bytes, 0 for default */
 
 int log_in = -1;
 int log_out = -1;
@@ -48,30 +49,68 @@ struct config_server {
 
 static struct config_server *serverconf;
 
-static void conn_mkevents (void);
-static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-		       struct sockaddr_storage *from);
+static int debug_recv_batch (int s, int from);
+static void sendq_flush (void);
+
+/* Every descriptor waited on has an evsrc, which is what epoll hands back.
+ * Connections register their own descriptors and only change what they
+ * wait for when their state changes, so a wakeup costs as much as the
+ * descriptors that are ready rather than all of them. */
+struct evsrc {
+  conn_t *c;			/* NULL for the listen socket */
+  int fd;
+  char registered;		/* non-zero once added to epfd */
+  char file;			/* non-zero if on file_srcs instead */
+  char dead;			/* hung up or failed, never watched again */
+  uint32_t events;		/* what we are waiting for */
+  struct evsrc *next_file;
+};
+
+#define MAX_EVENTS 256
+
+/* Datagrams move in batches of up to this many per system call.
+ * Received ones land in recvq, and sent ones wait in sendq until the
+ * end of the loop iteration (or until it fills, or is for another
+ * socket), when a single sendmmsg sends them all. */
+#define UDP_BATCH 64
 
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
+static packet_t recvq_pkts[UDP_BATCH];
+static struct sockaddr_storage recvq_from[UDP_BATCH];
+static struct iovec recvq_iov[UDP_BATCH];
+static struct mmsghdr recvq_msgs[UDP_BATCH];
 
-struct chunk {
-  struct chunk *next;
-  size_t size;
-  size_t used;
+static struct {
+  packet_t pkt;
+  struct sockaddr_storage to;
+  struct iovec iov;
+} sendq[UDP_BATCH];
+static struct mmsghdr sendq_msgs[UDP_BATCH];
+static int sendq_len;
+static int sendq_fd;
+
+static int epfd = -1;
+static struct evsrc listen_src;	/* accept socket, or UDP socket on server */
+static int listen_ready;
+/* Regular files can't be added to epoll and are always ready, so they
+ * count as ready whenever they are waited on */
+static struct evsrc *file_srcs;
+
+/* Output that can't be written right away waits in a ring buffer of
+ * opt_outbuf bytes.  A connection only holds one while it has output
+ * queued; drained ones go back to outbuf_pool for the next. */
+struct outbuf {
+  struct outbuf *next;		/* in outbuf_pool */
   char buf[1];
 };
-typedef struct chunk chunk_t;
+
+static struct outbuf *outbuf_pool;
 
 struct conn {
   rel_t *rel;			/* Data from reliable */
 
-  int rpoll;			/* offsets into cevents array */
-  int wpoll;
-  int npoll;
+  struct evsrc rsrc;		/* rfd, and wfd too when they are the same */
+  struct evsrc wsrc;		/* wfd when it differs from rfd */
+  struct evsrc nsrc;		/* nfd on clients (servers share one) */
 
   int rfd;			/* input file descriptor */
   int wfd;			/* output file descriptor */
@@ -84,15 +123,18 @@ struct conn {
   char write_err;	        /* zero if it's okay to write to wfd */
   char xoff;			/* non-zero to pause reading */
   char delete_me;		/* delete after draining */
-  chunk_t *outq;		/* chunks not yet written */
-  chunk_t **outqtail;
+  struct outbuf *outq;		/* bytes not yet written, NULL if none */
+  size_t outq_start;		/* offset of the first in outq->buf */
+  size_t outq_len;		/* how many */
 
   struct conn *next;		/* Linked list of connections */
   struct conn **prev;
 };
 
 static conn_t *conn_list;
-struct timespec last_timeout;
+
+static void conn_watch (conn_t *c);
+static void ev_forget (struct evsrc *src);
 
 #if !DMALLOC
 void *
@@ -153,118 +195,130 @@ print_pkt (const packet_t *buf, const char *op, int n)
   errno = saved_errno;
 }
 
-void flipbit(const void *data_, size_t bit) {
-  char *data = ((char *) data_);
-  unsigned int mask = 1 << (bit % 8);
-  data[bit/8] ^= mask;
+/* Queues a packet for the next sendq_flush, to fd's peer if to is NULL.
+ * Errors are only reported then, the same way a failed sendto would be,
+ * since nothing above acts on them. */
+static void
+sendq_add (int fd, const struct sockaddr_storage *to, const void *pkt,
+	   size_t len)
+{
+  struct msghdr *h;
+
+  if (sendq_len == UDP_BATCH || (sendq_len && sendq_fd != fd))
+    sendq_flush ();
+
+  sendq_fd = fd;
+  memcpy (&sendq[sendq_len].pkt, pkt, len);
+  sendq[sendq_len].iov.iov_base = &sendq[sendq_len].pkt;
+  sendq[sendq_len].iov.iov_len = len;
+
+  h = &sendq_msgs[sendq_len].msg_hdr;
+  memset (h, 0, sizeof (*h));
+  h->msg_iov = &sendq[sendq_len].iov;
+  h->msg_iovlen = 1;
+  if (to) {
+    sendq[sendq_len].to = *to;
+    h->msg_name = &sendq[sendq_len].to;
+    h->msg_namelen = addrsize (to);
+  }
+
+  sendq_len++;
 }
 
-int rand_percent(int fork_level)
+static void
+sendq_flush (void)
 {
-  #define SALT (0x12345)
-  return (rand() + (fork_level * SALT)) % 100;
+  int i = 0, n;
+
+  /* sendmmsg stops at the first failure, returning what it sent before,
+   * and fails outright if that was nothing, so skip the failed one */
+  while (i < sendq_len) {
+    n = sendmmsg (sendq_fd, sendq_msgs + i, sendq_len - i, 0);
+    if (n < 0) {
+      perror ("sendmmsg");
+      i++;
+    }
+    else
+      i += n;
+  }
+  sendq_len = 0;
 }
 
 int
 conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 {
-  int n;
   assert (!c->delete_me);
 
-  int fork_level = 0;
-  bool am_i_forked = false;
-
-  /* packet drop */
-  if (rand_percent(fork_level) < opt_drop) {
-    if (opt_debug)
-      print_pkt(pkt, "dropping: ", len);
-    return len;
-  }
+  if (opt_debug)
+    print_pkt (pkt, "send", len);
+  netem_send (c->nfd, c->server ? &c->peer : NULL, pkt, len);
+  return len;
+}
 
-  /* packet duplication */
-  if (rand_percent(fork_level) < opt_duplicate) {
-    if (opt_debug)
-      print_pkt(pkt, "duplicating: ", len);
+static void
+outq_push (conn_t *c, const char *buf, size_t n)
+{
+  size_t tail, first;
 
-    if (fork() == 0) {
-      am_i_forked = true;
-      fork_level++;
-    }
+  if (!c->outq) {
+    if ((c->outq = outbuf_pool))
+      outbuf_pool = c->outq->next;
+    else
+      c->outq = xmalloc (offsetof (struct outbuf, buf[opt_outbuf]));
+    c->outq_start = c->outq_len = 0;
   }
 
-  /* packet delay */
-  bool do_delay = rand_percent(fork_level) < opt_delay;
-  if (do_delay) {
-    if (opt_debug)
-      print_pkt(pkt,"delaying: ", len);
-
-    if (fork() == 0) {
-      am_i_forked = true;
-      fork_level++;
-      sleep(rand() % 5);
-    } else if (am_i_forked) {
-      exit(0);
-    } else {
-      return len;
-    }
-  }
+  tail = (c->outq_start + c->outq_len) % opt_outbuf;
+  first = n < opt_outbuf - tail ? n : opt_outbuf - tail;
+  memcpy (c->outq->buf + tail, buf, first);
+  memcpy (c->outq->buf, buf + first, n - first);
+  c->outq_len += n;
+}
 
-  /* packet corruption */
-  bool do_corrupt = rand_percent(fork_level) < opt_corrupt;
-  int bit = (rand() + getpid())  % (len * 8 - 1);
-  if (do_corrupt) {
-    if (opt_debug)
-      print_pkt(pkt, "corrupting: ", len);
-    flipbit(pkt,bit);
+static void
+outq_release (conn_t *c)
+{
+  if (c->outq) {
+    c->outq->next = outbuf_pool;
+    outbuf_pool = c->outq;
+    c->outq = NULL;
+    c->outq_len = 0;
   }
-
-  if (c->server)
-    n = sendto (c->nfd, pkt, len, 0,
-    (const struct sockaddr *) &c->peer, addrsize (&c->peer));
-  else
-    n = send (c->nfd, pkt, len, 0);
-  if (opt_debug)
-    print_pkt (pkt, "send", n);
-
-  /* corruption cleanup */
-  if (do_corrupt)
-    flipbit(pkt, bit); // undo changes.
-
-  /* cleanup child processes */
-  if (am_i_forked)
-    exit(0);
-
-  return n;
 }
 
 size_t
 conn_bufspace (conn_t *c)
 {
-  chunk_t *ch;
-  size_t used = 0;
-  const size_t bufsize = 8192;
-
-
-  for (ch = c->outq; ch; ch = ch->next)
-    used += (ch->size - ch->used);
-  return used > bufsize ? 0 : bufsize - used;
+  return opt_outbuf - c->outq_len;
 }
 
 int
 conn_output (conn_t *c, const void *_buf, size_t _n)
 {
-  const char *buf = _buf;
-  int n = _n;
+  struct iovec iov;
 
   assert (!c->delete_me && !c->write_eof);
 
-  if (n == 0) {
+  if (_n == 0) {
     c->write_eof = 1;
     if (!c->outq)
       shutdown (c->wfd, SHUT_WR);
     return 0;
   }
 
+  iov.iov_base = (void *) _buf;
+  iov.iov_len = _n;
+  return conn_outputv (c, &iov, 1);
+}
+
+int
+conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+  size_t total = 0, done = 0, skip, left, space;
+  int i;
+
+  assert (!c->delete_me && !c->write_eof);
+
   if (c->write_err) {
     if (c->write_err == 2)
       fprintf (stderr, "conn_output: attempt to write after error\n");
@@ -272,14 +326,14 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     return -1;
   }
 
-  if (!conn_bufspace (c))
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  if (!total || !conn_bufspace (c))
     return 0;
 
-  if (log_out >= 0)
-    write (log_out, buf, n);
-
+  /* Straight from the caller's buffers if nothing is queued ahead */
   if (!c->outq) {
-    int r = write (c->wfd, buf, n);
+    ssize_t r = writev (c->wfd, iov, iovcnt);
     if (r < 0) {
       if (errno != EAGAIN) {
 	perror ("write");
@@ -287,25 +341,38 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 	return -1;
       }
     }
-    else {
-      buf += r;
-      n -= r;
-    }
+    else
+      done = r;
   }
 
-  if (n > 0) {
-    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
-    ch->next = NULL;
-    ch->size = n;
-    ch->used = 0;
-    memcpy (ch->buf, buf, n);
-    *c->outqtail = ch;
-    c->outqtail = &ch->next;
+  /* Then queue what the descriptor didn't take, as far as it fits */
+  space = conn_bufspace (c);
+  for (i = 0, skip = done; i < iovcnt && space > 0; i++) {
+    const char *p = iov[i].iov_base;
+    size_t n = iov[i].iov_len;
+    if (skip >= n) {
+      skip -= n;
+      continue;
+    }
+    p += skip;
+    n -= skip;
+    skip = 0;
+    if (n > space)
+      n = space;
+    outq_push (c, p, n);
+    space -= n;
+    done += n;
   }
 
-  if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
-  return _n;
+  if (log_out >= 0)
+    for (i = 0, left = done; i < iovcnt && left > 0; i++) {
+      size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+      write (log_out, iov[i].iov_base, n);
+      left -= n;
+    }
+
+  conn_watch (c);
+  return done;
 }
 
 int
@@ -322,6 +389,7 @@ conn_input (conn_t *c, void *buf, size_t n)
       errno = EIO;
     r = -1;
     c->read_eof = 1;
+    conn_watch (c);
     return r;
   }
   if (r < 0 && errno == EAGAIN)
@@ -331,7 +399,7 @@ conn_input (conn_t *c, void *buf, size_t n)
     write (log_in, buf, r);
 
   c->xoff = 0;
-  cevents[c->rpoll].events |= POLLIN;
+  conn_watch (c);
   return r;
 }
 
@@ -342,13 +410,11 @@ conn_alloc (void)
   memset (c, 0, sizeof (*c));
   c->prev = &conn_list;
   c->next = conn_list;
-  c->outqtail = &c->outq;
+  c->rsrc.c = c->wsrc.c = c->nsrc.c = c;
   if (conn_list)
     conn_list->prev = &c->next;
   conn_list = c;
 
-  cevents_generation++;
-
   return c;
 }
 
@@ -382,6 +448,7 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
   c->nfd = serverconf->udp_socket;
   c->rfd = c->wfd = n;
   c->server = 1;
+  conn_watch (c);
 
   return c;
 }
@@ -389,24 +456,24 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
 static void
 conn_free (conn_t *c)
 {
-  chunk_t *ch, *nch;
-
-  for (ch = c->outq; ch; ch = nch) {
-    nch = ch->next;
-    free (ch);
-  }
+  outq_release (c);
 
   if (c->next)
     c->next->prev = c->prev;
   *c->prev = c->next;
 
+  ev_forget (&c->rsrc);
+  ev_forget (&c->wsrc);
+  ev_forget (&c->nsrc);
+
   close (c->rfd);
   if (c->wfd != c->rfd)
     close (c->wfd);
-  if (!c->server)
+  if (!c->server) {
+    netem_flush (c->nfd);
+    sendq_flush ();
     close (c->nfd);
-
-  cevents_generation++;
+  }
 
   /* to help catch errors */
   memset (c, 0xc5, sizeof (*c));
@@ -422,229 +489,273 @@ conn_destroy (conn_t *c)
 void
 conn_drain (conn_t *c)
 {
-  chunk_t *ch;
   int didsome = 0;
 
-  if (c->wpoll)
-    cevents[c->wpoll].events &= ~POLLOUT;
-
   if (c->write_err)
     return;
 
-  while ((ch = c->outq)) {
-    int n = write (c->wfd, ch->buf + ch->used,
-		   ch->size - ch->used);
+  /* Keep going until EAGAIN, as an edge-triggered wfd won't be reported
+   * again before then */
+  while (c->outq_len) {
+    struct iovec iov[2];
+    size_t first = opt_outbuf - c->outq_start;
+    int n;
+
+    iov[0].iov_base = c->outq->buf + c->outq_start;
+    iov[0].iov_len = c->outq_len < first ? c->outq_len : first;
+    iov[1].iov_base = c->outq->buf;
+    iov[1].iov_len = c->outq_len - iov[0].iov_len;
+    n = writev (c->wfd, iov, iov[1].iov_len ? 2 : 1);
     if (n < 0) {
       if (errno != EAGAIN)
 	c->write_err = 1;
       break;
     }
     didsome = 1;
-    ch->used += n;
-    if (ch->used < ch->size) {
-      if (c->wpoll)
-	cevents[c->wpoll].events |= POLLOUT;
-      break;
-    }
-    c->outq = ch->next;
-    if (!c->outq)
-      c->outqtail = &c->outq;
-    free (ch);
+    c->outq_start = (c->outq_start + n) % opt_outbuf;
+    c->outq_len -= n;
   }
+  if (!c->outq_len)
+    outq_release (c);
   if (c->write_eof && !c->write_err && !c->outq) {
     c->write_err = 1;
     shutdown (c->wfd, SHUT_WR);
   }
+  conn_watch (c);
   if (didsome && !c->delete_me)
     rel_output (c->rel);
 }
 
 static void
-conn_mkevents (void)
+ev_init (void)
 {
-  struct pollfd *e;
-  conn_t **r, **w;
-  size_t n = 2;
-  conn_t *c;
+  struct epoll_event ev;
 
-  for (c = conn_list; c; c = c->next) {
-    if (c->read_eof) {
-      c->rpoll = 0;
-      if (c->write_err)
-	c->wpoll = 0;
-      else
-	c->wpoll = n++;
-    }
-    else {
-      c->rpoll = n++;
-      if (c->write_err)
-	c->wpoll = 0;
-      else if (c->wfd == c->rfd)
-	c->wpoll = c->rpoll;
-      else
-	c->wpoll = n++;
-    }
-    if (c->server)
-      c->npoll = 0;
-    else
-      c->npoll = n++;
+  if (epfd >= 0)
+    return;
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror ("epoll_create1");
+    exit (1);
   }
 
-  e = xmalloc (n * sizeof (*e));
-  memset (e, 0, n * sizeof (*e));
-  if (cevents)
-    e[0] = cevents[0];
-  else
-    e[0].fd = -1;
-  e[1].fd = 2;			/* Do catch errors on stderr */
-
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll) {
-      e[c->rpoll].fd = c->rfd;
-      if (!c->xoff)
-	e[c->rpoll].events |= POLLIN;
-    }
-    if (c->wpoll) {
-      e[c->wpoll].fd = c->wfd;
-      if (c->outq)
-	e[c->wpoll].events |= POLLOUT;
-    }
-    if (c->npoll) {
-      e[c->npoll].fd = c->nfd;
-      e[c->npoll].events |= POLLIN;
+  /* Do catch errors on stderr, which epoll reports without asking */
+  memset (&ev, 0, sizeof (ev));
+  ev.data.ptr = NULL;
+  epoll_ctl (epfd, EPOLL_CTL_ADD, 2, &ev);
+}
+
+/* Waits for events on src if want is non-zero, and stops if not.  Only
+ * makes a system call if that changes anything. */
+static void
+ev_watch (struct evsrc *src, int want, uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (src->dead)
+    return;
+  if (src->file) {
+    src->events = want ? events : 0;
+    return;
+  }
+  if (!want) {
+    if (src->registered) {
+      epoll_ctl (epfd, EPOLL_CTL_DEL, src->fd, NULL);
+      src->registered = 0;
     }
+    return;
   }
+  if (src->registered && src->events == events)
+    return;
 
-  r = xmalloc (n * sizeof (*r));
-  memset (r, 0, n * sizeof (*r));
-  w = xmalloc (n * sizeof (*w));
-  memset (w, 0, n * sizeof (*w));
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll > 0)
-      r[c->rpoll] = c;
-    if (c->npoll > 0)
-      r[c->npoll] = c;
-    if (c->wpoll > 0)
-      w[c->wpoll] = c;
+  ev_init ();
+  memset (&ev, 0, sizeof (ev));
+  ev.events = events;
+  ev.data.ptr = src;
+  if (epoll_ctl (epfd, src->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		 src->fd, &ev) == 0) {
+    src->registered = 1;
+    src->events = events;
+  }
+  else if (errno == EPERM) {
+    src->file = 1;
+    src->events = events;
+    src->next_file = file_srcs;
+    file_srcs = src;
+  }
+  else {
+    perror ("epoll_ctl");
+    src->dead = 1;
   }
-
-  free (cevents);
-  cevents = e;
-  ncevents = n;
-  free (evreaders);
-  evreaders = r;
-  free (evwriters);
-  evwriters = w;
 }
 
 static void
-conn_demux (const struct config_server *cs)
+ev_forget (struct evsrc *src)
 {
-  packet_t pkt;
-  struct sockaddr_storage ss;
-  int n;
+  struct evsrc **p;
 
-  memset (&ss, 0, sizeof (ss));
-  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
-    rel_demux (&cs->c, &ss, &pkt, n);
-    memset (&pkt, 0xc7, n);	     /* to help debugging */
-    memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
+  if (src->file) {
+    for (p = &file_srcs; *p != src; p = &(*p)->next_file)
+      ;
+    *p = src->next_file;
+    src->file = 0;
   }
-  if (errno != EAGAIN)
-    perror ("UDP recv");
+  ev_watch (src, 0, 0);
 }
 
-long
-need_timer_in (const struct timespec *last, long timer)
+/* What a regular file is ready for, which is whatever we wait for */
+static uint32_t
+file_ready (const struct evsrc *src)
 {
-  long to;
-  struct timespec ts;
+  return src->events & (EPOLLIN | (src->c->outq ? EPOLLOUT : 0));
+}
 
-  clock_gettime (CLOCK_MONOTONIC, &ts);
-  to = ts.tv_sec - last->tv_sec;
-  if (to > timer / 1000)
-    return 0;
-  to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-  if (to >= timer)
-    return 0;
-  return
-    timer - to;
+/* Brings c's registrations up to date with its state.  Input is level
+ * triggered, since rel_read needn't read everything available.  The
+ * client's UDP socket and a separate wfd are edge triggered, as they are
+ * always drained until EAGAIN. */
+static void
+conn_watch (conn_t *c)
+{
+  uint32_t in = !c->read_eof && !c->xoff ? EPOLLIN : 0;
+  uint32_t out = c->outq && !c->write_err ? EPOLLOUT : 0;
+
+  c->rsrc.fd = c->rfd;
+  c->wsrc.fd = c->wfd;
+  c->nsrc.fd = c->nfd;
+
+  if (c->wfd == c->rfd)
+    ev_watch (&c->rsrc, !c->read_eof || !c->write_err, in | out);
+  else {
+    ev_watch (&c->rsrc, !c->read_eof, in);
+    ev_watch (&c->wsrc, !c->write_err, EPOLLOUT | EPOLLET);
+  }
+  if (!c->server)
+    ev_watch (&c->nsrc, 1, EPOLLIN | EPOLLET);
 }
 
-void
-conn_poll (const struct config_common *cc)
+static void
+conn_event (struct evsrc *src, uint32_t revents,
+	    const struct config_common *cc)
 {
-  //int n, i;
-  int  i;
-  conn_t *c, *nc;
-  static int last_cg;
+  conn_t *c = src ? src->c : NULL;
 
-  if (last_cg != cevents_generation) {
-    conn_mkevents ();
-    cevents_generation = last_cg;
+  if (!src) {
+    /* If stderr has an error, the tester has probably died, so exit
+     * immediately. */
+    if (revents & (EPOLLERR|EPOLLHUP))
+      exit (1);
+    return;
   }
+  if (src == &listen_src) {
+    listen_ready = 1;
+    return;
+  }
+  if (src->dead)
+    return;
 
-  if (cevents[0].fd >= 0)
-    poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
-  else
-    poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
-
-  for (i = 1; i < ncevents; i++) {
-    if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-      if ((c = evreaders[i]) && !c->delete_me) {
-	if (cevents[i].fd == c->rfd) {
-	  c->xoff = 1;
-	  cevents[i].events &= ~POLLIN;
-	  rel_read (c->rel);
-	}
-	else if (cevents[i].fd == c->nfd
-		 && (cevents[i].revents & (POLLERR|POLLHUP))) {
-	  char addr[NI_MAXHOST] = "unknown";
-	  char port[NI_MAXSERV] = "unknown";
-	  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-		       addr, sizeof (addr), port, sizeof (port),
-		       NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-	  fprintf (stderr, "[received ICMP port unreachable;"
-		   " assuming peer at %s:%s is dead]\n", addr, port);
-	  if (cc->single_connection)
-	    exit (1);
-	  rel_destroy (c->rel);
-	}
-	else if (cevents[i].fd == c->nfd && !c->server) {
-	  packet_t pkt;
-	  int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
-	  if (len < 0) {
-	    if (errno != EAGAIN)
-	      perror ("recv");
-	  }
-	  else {
-	    rel_recvpkt (c->rel, &pkt, len);
-	    memset (&pkt, 0xc9, len); /* for debugging */
-	  }
+  if ((revents & (EPOLLIN|EPOLLERR|EPOLLHUP)) && !c->delete_me) {
+    if (src == &c->rsrc && !c->read_eof) {
+      /* Input is only dropped from the wait set when it is still ready
+       * and rel_read hasn't called conn_input since the last time, which
+       * saves two epoll_ctl calls per read in the usual case */
+      if (c->xoff && !(revents & (EPOLLERR|EPOLLHUP)))
+	conn_watch (c);
+      else {
+	c->xoff = 1;
+	rel_read (c->rel);
+      }
+    }
+    else if (src == &c->nsrc && (revents & (EPOLLERR|EPOLLHUP))) {
+      char addr[NI_MAXHOST] = "unknown";
+      char port[NI_MAXSERV] = "unknown";
+      getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+		   addr, sizeof (addr), port, sizeof (port),
+		   NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+      fprintf (stderr, "[received ICMP port unreachable;"
+	       " assuming peer at %s:%s is dead]\n", addr, port);
+      if (cc->single_connection)
+	exit (1);
+      rel_destroy (c->rel);
+    }
+    else if (src == &c->nsrc) {
+      /* A short batch means the socket is drained, and anything arriving
+       * after it raises a new edge */
+      int i, n = UDP_BATCH;
+      while (n == UDP_BATCH && !c->delete_me) {
+	n = debug_recv_batch (c->nfd, 0);
+	if (n < 0 && errno != EAGAIN)
+	  perror ("recv");
+	for (i = 0; i < n && !c->delete_me; i++) {
+	  rel_recvpkt (c->rel, &recvq_pkts[i], recvq_msgs[i].msg_len);
+	  memset (&recvq_pkts[i], 0xc9, recvq_msgs[i].msg_len); /* for debugging */
 	}
       }
     }
-    if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-	&& evwriters[i])
-      conn_drain (evwriters[i]);
-    if (cevents[i].revents & (POLLHUP|POLLERR)) {
+  }
+  if ((revents & (EPOLLOUT|EPOLLHUP|EPOLLERR)) && src->fd == c->wfd)
+    conn_drain (c);
+  if (revents & (EPOLLHUP|EPOLLERR)) {
 #if 0
-      fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
-	       getpid (), cevents[i].fd, cevents[i].revents);
+    fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
+	     getpid (), src->fd, revents);
 #endif
-      /* If stderr has an error, the tester has probably died, so exit
-       * immediately. */
-      if (cevents[i].fd == 2)
-	exit (1);
-      cevents[i].fd = -1;
-    }
-    cevents[i].revents = 0;
+    ev_watch (src, 0, 0);
+    src->dead = 1;
   }
+}
 
-  if (need_timer_in (&last_timeout, cc->timer) == 0) {
+static void
+conn_demux (const struct config_server *cs)
+{
+  int i, n;
+
+  memset (recvq_from, 0, sizeof (recvq_from));
+  do {
+    n = debug_recv_batch (cs->udp_socket, 1);
+    for (i = 0; i < n; i++) {
+      rel_demux (&cs->c, &recvq_from[i], &recvq_pkts[i], recvq_msgs[i].msg_len);
+      memset (&recvq_pkts[i], 0xc7, recvq_msgs[i].msg_len); /* to help debugging */
+      memset (&recvq_from[i], 0x7c, sizeof (recvq_from[i])); /* to help debugging */
+    }
+  } while (n == UDP_BATCH);
+  if (n < 0 && errno != EAGAIN)
+    perror ("UDP recv");
+}
+
+void
+conn_poll (const struct config_common *cc)
+{
+  struct epoll_event ev[MAX_EVENTS];
+  struct evsrc *src;
+  conn_t *c, *nc;
+  int i, n, timeout;
+  long held;
+
+  ev_init ();
+  sendq_flush ();
+
+  timeout = rel_next_timer ();
+  held = netem_next ();
+  if (held >= 0 && (timeout < 0 || held < timeout))
+    timeout = held;
+  for (src = file_srcs; src; src = src->next_file)
+    if (file_ready (src))
+      timeout = 0;
+
+  n = epoll_wait (epfd, ev, MAX_EVENTS, timeout);
+  for (i = 0; i < n; i++)
+    conn_event (ev[i].data.ptr, ev[i].events, cc);
+  for (src = file_srcs; src; src = src->next_file)
+    if (file_ready (src))
+      conn_event (src, file_ready (src), cc);
+
+  if (rel_next_timer () == 0)
     rel_timer ();
-    clock_gettime (CLOCK_MONOTONIC, &last_timeout);
-  }
+  netem_run ();
+
+  /* Before conn_free closes any of the sockets */
+  sendq_flush ();
 
   for (c = conn_list; c; c = nc) {
     nc = c->next;
@@ -825,6 +936,18 @@ get_address (struct sockaddr_storage *ss, int local,
   return 0;
 }
 
+/* A window's worth of packets can arrive at once, more than the default
+ * buffers hold, so they are sized for it (up to net.core.rmem_max and
+ * wmem_max) */
+static void
+size_udp_buffers (int s)
+{
+  if (udp_buffer) {
+    setsockopt (s, SOL_SOCKET, SO_RCVBUF, &udp_buffer, sizeof (udp_buffer));
+    setsockopt (s, SOL_SOCKET, SO_SNDBUF, &udp_buffer, sizeof (udp_buffer));
+  }
+}
+
 int
 listen_on (int dgram, struct sockaddr_storage *ss)
 {
@@ -841,6 +964,8 @@ listen_on (int dgram, struct sockaddr_storage *ss)
   }
   if (!dgram)
     setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+  else
+    size_udp_buffers (s);
   if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
     perror ("bind");
     close (s);
@@ -888,6 +1013,8 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
     perror ("socket");
     return -1;
   }
+  if (dgram)
+    size_udp_buffers (s);
   make_async (s);
   if (connect (s, (struct sockaddr *) ss, addrsize (ss)) < 0
       && errno != EINPROGRESS) {
@@ -899,18 +1026,34 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
   return s;
 }
 
+/* Receives up to UDP_BATCH datagrams into recvq_pkts (and their
+ * senders into recvq_from if from is non-zero) with one system call.
+ * Returns how many, or -1. */
 static int
-debug_recv (int s, packet_t *buf, size_t len, int flags,
-	    struct sockaddr_storage *from)
+debug_recv_batch (int s, int from)
 {
-  socklen_t socklen = sizeof (*from);
-  int n;
-  if (from)
-    n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
-  else
-    n = recv (s, buf, len, flags);
-  if (opt_debug)
-    print_pkt (buf, "recv", n);
+  int i, n;
+
+  for (i = 0; i < UDP_BATCH; i++) {
+    struct msghdr *h = &recvq_msgs[i].msg_hdr;
+    recvq_iov[i].iov_base = &recvq_pkts[i];
+    recvq_iov[i].iov_len = sizeof (recvq_pkts[i]);
+    memset (h, 0, sizeof (*h));
+    h->msg_iov = &recvq_iov[i];
+    h->msg_iovlen = 1;
+    if (from) {
+      h->msg_name = &recvq_from[i];
+      h->msg_namelen = sizeof (recvq_from[i]);
+    }
+  }
+
+  n = recvmmsg (s, recvq_msgs, UDP_BATCH, 0, NULL);
+  if (opt_debug) {
+    if (n < 0)
+      print_pkt (&recvq_pkts[0], "recv", n);
+    for (i = 0; i < n; i++)
+      print_pkt (&recvq_pkts[i], "recv", recvq_msgs[i].msg_len);
+  }
   return n;
 }
 
@@ -918,13 +1061,16 @@ debug_recv (int s, packet_t *buf, size_t len, int flags,
 void
 do_client (struct config_client *cc)
 {
-  conn_mkevents ();
   make_async (cc->listen_socket);
-  cevents[0].fd = cc->listen_socket;
-  cevents[0].events = POLLIN;
+  listen_src.fd = cc->listen_socket;
+  ev_watch (&listen_src, 1, EPOLLIN | EPOLLET);
   for (;;) {
     conn_poll (&cc->c);
-    if (cevents[0].revents) {
+    if (!listen_ready)
+      continue;
+    listen_ready = 0;
+    /* Edge triggered, so accept everything pending */
+    for (;;) {
       struct sockaddr_storage ss;
       socklen_t len = sizeof (ss);
       int s, u;
@@ -934,7 +1080,7 @@ do_client (struct config_client *cc)
       if (s < 0 && errno != EAGAIN)
 	perror ("accept");
       if (s < 0)
-	continue;
+	break;
       make_async (s);
       if ((u = connect_to (1, &cc->server)) >= 0) {
 	c = conn_alloc ();
@@ -943,7 +1089,7 @@ do_client (struct config_client *cc)
 	c->nfd = u;
 	c->peer = cc->server;
 	c->rel = rel_create (c, NULL, &cc->c);
-	conn_mkevents ();
+	conn_watch (c);
       }
       else
 	close (s);
@@ -955,14 +1101,15 @@ void
 do_server (struct config_server *cs)
 {
   serverconf = cs;
-  conn_mkevents ();
   make_async (cs->udp_socket);
-  cevents[0].fd = cs->udp_socket;
-  cevents[0].events = POLLIN;
+  listen_src.fd = cs->udp_socket;
+  ev_watch (&listen_src, 1, EPOLLIN | EPOLLET);
   for (;;) {
     conn_poll (&cs->c);
-    if (cevents[0].revents)
-      conn_demux (cs);
+    if (listen_ready) {
+      listen_ready = 0;
+      conn_demux (cs);	/* reads until EAGAIN */
+    }
   }
 }
 
@@ -991,6 +1138,17 @@ main (int argc, char **argv)
     { "server", no_argument, NULL, 's' },
     { "window", required_argument, NULL, 'w' },
     { "client", no_argument, NULL, 'c' },
+    { "congestion", required_argument, NULL, 'g' },
+    { "sack", no_argument, NULL, 'a' },
+    { "nodelay", no_argument, NULL, 'N' },
+    { "flush-delay", required_argument, NULL, 'f' },
+    { "ack-delay", required_argument, NULL, 'A' },
+    { "outbuf", required_argument, NULL, 'b' },
+    { "delay-ms", required_argument, NULL, 'm' },
+    { "latency", required_argument, NULL, 'L' },
+    { "reorder", required_argument, NULL, 'o' },
+    { "burst", required_argument, NULL, 'B' },
+    { "rate", required_argument, NULL, 'R' },
     { NULL, 0, NULL, 0 }
   };
   int opt;
@@ -1000,6 +1158,7 @@ main (int argc, char **argv)
   char *local = NULL;
   char *remote = NULL;
   struct config_common c;
+  struct netem_config nc;
   struct sockaddr_storage ss;
   struct sigaction sa;
 
@@ -1011,6 +1170,14 @@ main (int argc, char **argv)
   memset (&c, 0, sizeof (c));
   c.window = 1;
   c.timeout = 2000;
+  c.congestion = "newreno";
+  c.flush_delay = 40;
+  c.ack_delay = 40;
+
+  memset (&nc, 0, sizeof (nc));
+  nc.delay_ms = 100;		/* --delay used to mean up to 4 s; see README */
+  nc.burst_loss = 100;
+  nc.seed = 1;
 
   progname = strrchr (argv[0], '/');
   if (progname)
@@ -1018,7 +1185,7 @@ main (int argc, char **argv)
   else
     progname = argv[0];
 
-  while ((opt = getopt_long (argc, argv, "cdust:r:p:y:q:e:w:l", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "cdust:r:p:y:q:e:w:lg:ab:m:L:o:B:R:Nf:A:", o, NULL)) != -1)
     switch (opt) {
     case 'c':
       opt_client = 1;
@@ -1027,18 +1194,37 @@ main (int argc, char **argv)
       opt_debug = 1;
       break;
     case 'e':
-      srand(atoi(optarg));
+      nc.seed = atoi (optarg);
+      break;
     case 'r':
-      opt_drop = atoi(optarg);
+      nc.drop = atoi (optarg);
       break;
     case 'p':
-      opt_corrupt = atoi(optarg);
+      nc.corrupt = atoi (optarg);
       break;
     case 'y':
-      opt_delay = atoi(optarg);
+      nc.delay = atoi (optarg);
       break;
     case 'q':
-      opt_duplicate = atoi(optarg);
+      nc.duplicate = atoi (optarg);
+      break;
+    case 'm':
+      nc.delay_ms = atoi (optarg);
+      break;
+    case 'L':
+      nc.latency_ms = atoi (optarg);
+      break;
+    case 'o':
+      nc.reorder = atoi (optarg);
+      break;
+    case 'B':
+      /* enter:leave[:loss], percentages */
+      if (sscanf (optarg, "%d:%d:%d", &nc.burst_enter, &nc.burst_leave,
+		  &nc.burst_loss) < 2)
+	usage ();
+      break;
+    case 'R':
+      nc.rate_kbps = atoi (optarg);
       break;
     case 'l':
       {
@@ -1065,16 +1251,43 @@ main (int argc, char **argv)
     case 't':
       c.timeout = atoi (optarg);
       break;
+    case 'g':
+      c.congestion = optarg;
+      break;
+    case 'a':
+      c.sack = 1;
+      break;
+    case 'N':
+      c.nodelay = 1;
+      break;
+    case 'f':
+      c.flush_delay = atoi (optarg);
+      break;
+    case 'A':
+      c.ack_delay = atoi (optarg);
+      break;
+    case 'b':
+      opt_outbuf = atoi (optarg);
+      break;
     default:
       usage ();
       break;
     }
 
-  if (optind + 2 != argc || c.window < 1 || c.timeout < 10
+  if (optind + 2 != argc || c.window < 1 || c.window > 1 << 20
+      || c.timeout < 10 || opt_outbuf < 1
+      || c.flush_delay < 0 || c.ack_delay < 0
       || (opt_server && opt_client)
       || (!(opt_server || opt_client) && opt_unix))
     usage ();
   c.timer = c.timeout / 5;
+  /* Room for a window of data and its acks, at the kernel's accounting
+   * of about twice the packet size */
+  if (c.window > 64)
+    udp_buffer = c.window < 16384 ? c.window * 2 * 2 * sizeof (packet_t)
+      : 16384 * 2 * 2 * sizeof (packet_t);
+  nc.debug = opt_debug;
+  netem_init (&nc, sendq_add);
   local = argv[optind];
   remote = argv[optind+1];
 
@@ -1118,7 +1331,7 @@ main (int argc, char **argv)
     make_async (cn->nfd);
     cn->rel = rel_create (cn, NULL, &c);
 
-    conn_mkevents ();
+    conn_watch (cn);
     while (conn_list)
       conn_poll (&c);
   }
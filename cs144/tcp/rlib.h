@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* -----------------------------------------------------------------------
 
@@ -171,20 +172,25 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * The function rel_timer is called whenever rel_next_timer says a
+     timer is due, and the library sleeps no longer than that.  You can
+     use this timer to inspect packets and retransmit packets that have
+     not been acknowledged.  Do not retransmit every packet every time
+     the timer is fired!  You must keep track of which packets need to
+     be retransmitted when.
 
 */
 
 struct config_common {
   int window;			/* # of unacknowledged packets in flight */
-  int timer;			/* How often rel_timer called in milliseconds */
+  int timer;			/* Timer granularity in milliseconds */
   int timeout;			/* Retransmission timeout in milliseconds */
   int single_connection;        /* Exit after first connection failure */
+  char *congestion;             /* Congestion control algorithm, "newreno" or "cubic" */
+  int sack;                     /* Send selective acks and recover from them */
+  int nodelay;                  /* Send partial packets without waiting */
+  int flush_delay;              /* Longest a partial packet waits, in ms */
+  int ack_delay;                /* Longest an ack is delayed, in ms */
 };
 
 typedef struct reliable_state rel_t;
@@ -226,8 +232,9 @@ conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
 /* This function tells you how many bytes of output buffering are free
- * for conn_output to store your data.  conn_output is guaranteed not
- * to return 0 if you write less than this many bytes. */
+ * for conn_output to store your data (8192 in all unless set with
+ * --outbuf).  conn_output is guaranteed not to return 0 if you write
+ * less than this many bytes. */
 size_t conn_bufspace (conn_t *c);
 
 /* Call this function to produce output from the UDP packets you have
@@ -243,6 +250,14 @@ size_t conn_bufspace (conn_t *c);
  * write. */
 int conn_output (conn_t *c, const void *buf, size_t len);
 
+/* Like conn_output, but takes the bytes from iovcnt buffers in turn
+ * (at most IOV_MAX), which are written with a single writev when no
+ * output is queued, without being copied.  Only what the descriptor
+ * won't take right away is copied into the buffer, and only as much as
+ * conn_bufspace allows.  Returns the number of bytes accepted from the
+ * front of the buffers, or -1 on error.  Never sends EOF. */
+int conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
@@ -268,7 +283,8 @@ void rel_demux (const struct config_common *cc,
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_timer (void); /* Invoked when rel_next_timer returns 0 */
+long rel_next_timer (void); /* Milliseconds until a timer is due, -1 if none */
 
 
 
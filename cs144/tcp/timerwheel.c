@@ -0,0 +1,169 @@
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+void timer_wheel_link(struct timer_entry **head, struct timer_entry *t);
+void timer_wheel_unlink(struct timer_entry *t);
+void timer_wheel_insert(struct timer_wheel *tw, struct timer_entry *t);
+void timer_wheel_cascade(struct timer_wheel *tw, int level);
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now) {
+  int level, slot;
+
+  tw->now = now;
+  tw->count = 0;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      tw->slots[level][slot] = NULL;
+    }
+  }
+}
+
+void timer_entry_init(struct timer_entry *t, void (*fn)(void *arg), void *arg) {
+  t->next = NULL;
+  t->prev = NULL;
+  t->expires = 0;
+  t->fn = fn;
+  t->arg = arg;
+}
+
+void timer_wheel_schedule(struct timer_wheel *tw, struct timer_entry *t, uint64_t expires) {
+  timer_wheel_cancel(tw, t);
+  t->expires = expires;
+  timer_wheel_insert(tw, t);
+  tw->count++;
+}
+
+void timer_wheel_cancel(struct timer_wheel *tw, struct timer_entry *t) {
+  if (t->prev != NULL) {
+    timer_wheel_unlink(t);
+    tw->count--;
+  }
+}
+
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t now) {
+  /* Nothing to fire or cascade, so idle stretches are skipped in one go */
+  if (tw->count == 0) {
+    if (now >= tw->now) {
+      tw->now = now + 1;
+    }
+    return;
+  }
+
+  while (tw->now <= now) {
+    int slot = tw->now & TIMER_WHEEL_MASK;
+    int level;
+
+    /* Whenever a level wraps, bring the next slot of the one above down */
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if ((tw->now >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) {
+        break;
+      }
+      timer_wheel_cascade(tw, level);
+    }
+
+    /* Fire from a private list so callbacks can touch any slot */
+    struct timer_entry *due = NULL;
+    if (tw->slots[0][slot] != NULL) {
+      due = tw->slots[0][slot];
+      due->prev = &due;
+      tw->slots[0][slot] = NULL;
+    }
+
+    tw->now++;
+
+    while (due != NULL) {
+      struct timer_entry *t = due;
+      timer_wheel_unlink(t);
+      tw->count--;
+      t->fn(t->arg);
+    }
+  }
+}
+
+uint64_t timer_wheel_next(struct timer_wheel *tw) {
+  uint64_t next = UINT64_MAX;
+  int level, i;
+
+  if (tw->count == 0) {
+    return next;
+  }
+
+  /* Level 0 holds exact expiries, one tick per slot */
+  for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    if (tw->slots[0][(tw->now + i) & TIMER_WHEEL_MASK] != NULL) {
+      return tw->now + i;
+    }
+  }
+
+  /* Above that, the first occupied slot after the current one is the
+   * earliest at that level, and it cascades when its span starts */
+  for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    int shift = TIMER_WHEEL_BITS * level;
+    uint64_t cur = tw->now >> shift;
+    for (i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+      if (tw->slots[level][(cur + i) & TIMER_WHEEL_MASK] != NULL) {
+        uint64_t start = (cur + i) << shift;
+        if (start < next) {
+          next = start;
+        }
+        break;
+      }
+    }
+  }
+
+  return next;
+}
+
+void timer_wheel_link(struct timer_entry **head, struct timer_entry *t) {
+  t->next = *head;
+  if (t->next != NULL) {
+    t->next->prev = &t->next;
+  }
+  t->prev = head;
+  *head = t;
+}
+
+void timer_wheel_unlink(struct timer_entry *t) {
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  *t->prev = t->next;
+  t->next = NULL;
+  t->prev = NULL;
+}
+
+void timer_wheel_insert(struct timer_wheel *tw, struct timer_entry *t) {
+  uint64_t expires = t->expires < tw->now ? tw->now : t->expires;
+  uint64_t delta = expires - tw->now;
+  int level;
+
+  for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+    if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+      break;
+    }
+  }
+
+  /* Beyond the top level's reach, park it in the furthest slot there */
+  if (delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+    expires = tw->now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+
+  int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  timer_wheel_link(&tw->slots[level][slot], t);
+}
+
+void timer_wheel_cascade(struct timer_wheel *tw, int level) {
+  int slot = (tw->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  struct timer_entry *t = tw->slots[level][slot];
+
+  tw->slots[level][slot] = NULL;
+  while (t != NULL) {
+    struct timer_entry *next = t->next;
+    t->prev = NULL;
+    timer_wheel_insert(tw, t);
+    t = next;
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Hierarchical timer wheel with millisecond ticks.
+
+   Level 0 has a slot per tick for the next 64 ticks, and each level above
+   has slots 64 times as wide. A timer sits in the lowest level whose
+   span reaches its expiry. Each time a level wraps, the next slot up is
+   cascaded into the levels below, so a timer moves down at most three
+   times before it fires. Scheduling, cancelling and firing are O(1), and
+   a tick with nothing due costs only a slot check. Timers further out
+   than the top level can reach (about 18 hours) fire at its end.
+
+ */
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+struct timer_entry {
+  struct timer_entry *next;
+  struct timer_entry **prev;  /* NULL when not scheduled */
+  uint64_t expires;           /* Tick (millisecond) the timer fires at */
+  void (*fn)(void *arg);
+  void *arg;
+};
+
+struct timer_wheel {
+  uint64_t now;               /* The next tick to process */
+  unsigned int count;         /* Timers scheduled */
+  struct timer_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now);
+
+void timer_entry_init(struct timer_entry *t, void (*fn)(void *arg), void *arg);
+
+/* (Re)schedules t to fire at expires, or on the next tick if that has
+ * already passed */
+void timer_wheel_schedule(struct timer_wheel *tw, struct timer_entry *t, uint64_t expires);
+
+/* Does nothing if t isn't scheduled */
+void timer_wheel_cancel(struct timer_wheel *tw, struct timer_entry *t);
+
+/* Fires every timer due at or before now. Timers may schedule or cancel
+ * any timer, themselves included, from their callbacks. */
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t now);
+
+/* A tick by which timer_wheel_advance must next be called: the expiry
+ * of the earliest timer, or earlier when that timer still has to cascade
+ * down. UINT64_MAX if nothing is scheduled. */
+uint64_t timer_wheel_next(struct timer_wheel *tw);
+
+#endif /* TIMERWHEEL_H */
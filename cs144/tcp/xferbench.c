@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/* Runs a pair of reliable processes against each other over loopback for
+ * every combination of window, timeout, loss rate and latency given,
+ * sends each pair a fixed payload and prints one CSV row per combination:
+ * goodput, the fraction of data packets retransmitted and completion time
+ * percentiles.  Losses and latency come from reliable's own emulation
+ * (--drop, --latency), so every run of a combination gets its own seed.
+ * Anything after "--" is passed on to both processes. */
+
+char *progname;
+
+#define MAX_VALUES 16
+#define PAYLOAD_PER_PKT 500	/* DATA_PACKET_MAX_PAYLOAD_LEN in reliable.c */
+#define SETTLE_MS 100		/* for the receiver to bind its port */
+
+struct run {
+  int ok;
+  uint64_t us;			/* first byte in to last byte out */
+  long retx;
+};
+
+static char *reliable = "./reliable";
+static char **extra_args;
+static int nextra;
+static int base_port = 40000;
+static int limit_s = 60;
+
+static char *payload;
+static size_t payload_len;
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+parse_list (char *s, int *v)
+{
+  int n = 0;
+  char *tok;
+
+  while ((tok = strsep (&s, ",")) != NULL) {
+    if (n == MAX_VALUES || !*tok)
+      return -1;
+    v[n++] = atoi (tok);
+  }
+  return n;
+}
+
+static void
+nonblock (int fd)
+{
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Starts reliable between the given ports with its stdin, stdout and
+ * stderr on the given descriptors, /dev/null for any that are -1 */
+static pid_t
+start_reliable (int w, int t, int drop, int latency, int seed,
+		int local, int remote, int in, int out, int err)
+{
+  char args[5][16], laddr[16], raddr[32];
+  char *argv[32 + nextra];
+  int i, argc = 0;
+  pid_t pid;
+
+  snprintf (args[0], sizeof (args[0]), "%d", w);
+  snprintf (args[1], sizeof (args[1]), "%d", t);
+  snprintf (args[2], sizeof (args[2]), "%d", drop);
+  snprintf (args[3], sizeof (args[3]), "%d", latency);
+  snprintf (args[4], sizeof (args[4]), "%d", seed);
+  snprintf (laddr, sizeof (laddr), "%d", local);
+  snprintf (raddr, sizeof (raddr), "localhost:%d", remote);
+
+  argv[argc++] = reliable;
+  argv[argc++] = "-w";
+  argv[argc++] = args[0];
+  argv[argc++] = "-t";
+  argv[argc++] = args[1];
+  argv[argc++] = "--drop";
+  argv[argc++] = args[2];
+  argv[argc++] = "--latency";
+  argv[argc++] = args[3];
+  argv[argc++] = "--seed";
+  argv[argc++] = args[4];
+  for (i = 0; i < nextra; i++)
+    argv[argc++] = extra_args[i];
+  argv[argc++] = laddr;
+  argv[argc++] = raddr;
+  argv[argc] = NULL;
+
+  if ((pid = fork ()) < 0) {
+    perror ("fork");
+    exit (1);
+  }
+  if (pid == 0) {
+    int null = open ("/dev/null", O_WRONLY);
+    if (out < 0)
+      out = null;
+    if (err < 0)
+      err = null;
+    dup2 (in, 0);
+    dup2 (out, 1);
+    dup2 (err, 2);
+    for (i = 3; i < 64; i++)
+      close (i);
+    execv (reliable, argv);
+    perror (reliable);
+    _exit (1);
+  }
+  return pid;
+}
+
+/* The sender's retransmissions, from the summary reliable prints when its
+ * connection closes, or 0 if line isn't that summary */
+static long
+parse_retx (char *line)
+{
+  unsigned long retx;
+  if (sscanf (line, "%*d: %*u data packets received, %*u acks sent, "
+	      "%*u more piggybacked, %lu data packets resent", &retx) != 1)
+    return 0;
+  return retx;
+}
+
+static void
+run_xfer (int w, int t, int drop, int latency, int k, struct run *res)
+{
+  int to_snd[2], from_rcv[2], to_rcv[2], snd_err[2];
+  int sport = base_port + 2 * (k % 1000), rport = sport + 1;
+  size_t written = 0, received = 0;
+  char buf[65536], line[512];
+  size_t linelen = 0;
+  uint64_t start = 0, deadline;
+  pid_t snd, rcv;
+  int mismatch = 0;
+
+  res->ok = 0;
+  res->us = 0;
+  res->retx = 0;
+
+  if (pipe (to_snd) || pipe (from_rcv) || pipe (to_rcv) || pipe (snd_err)) {
+    perror ("pipe");
+    exit (1);
+  }
+
+  /* The receiver's stdin stays open until everything has arrived, so
+   * its EOF can't reach the sender before the sender is listening */
+  rcv = start_reliable (w, t, drop, latency, 2 * k + 2, rport, sport,
+			to_rcv[0], from_rcv[1], -1);
+  usleep (SETTLE_MS * 1000);
+  snd = start_reliable (w, t, drop, latency, 2 * k + 1, sport, rport,
+			to_snd[0], -1, snd_err[1]);
+  close (to_snd[0]);
+  close (from_rcv[1]);
+  close (to_rcv[0]);
+  close (snd_err[1]);
+  nonblock (to_snd[1]);
+  nonblock (from_rcv[0]);
+  nonblock (snd_err[0]);
+
+  start = now_us ();
+  deadline = start + (uint64_t) limit_s * 1000000;
+  while (received < payload_len || snd_err[0] >= 0) {
+    struct pollfd pfd[3];
+    int n = 0, i;
+    uint64_t now = now_us ();
+    ssize_t r;
+
+    if (now >= deadline)
+      break;
+    if (to_snd[1] >= 0) {
+      pfd[n].fd = to_snd[1];
+      pfd[n++].events = POLLOUT;
+    }
+    if (from_rcv[0] >= 0) {
+      pfd[n].fd = from_rcv[0];
+      pfd[n++].events = POLLIN;
+    }
+    if (snd_err[0] >= 0) {
+      pfd[n].fd = snd_err[0];
+      pfd[n++].events = POLLIN;
+    }
+    if (poll (pfd, n, (deadline - now) / 1000 + 1) < 0 && errno != EINTR) {
+      perror ("poll");
+      exit (1);
+    }
+
+    for (i = 0; i < n; i++) {
+      if (!pfd[i].revents)
+	continue;
+      if (pfd[i].fd == to_snd[1]) {
+	r = write (to_snd[1], payload + written, payload_len - written);
+	if (r > 0)
+	  written += r;
+	if ((r < 0 && errno != EAGAIN) || written == payload_len) {
+	  close (to_snd[1]);
+	  to_snd[1] = -1;
+	}
+      }
+      else if (pfd[i].fd == from_rcv[0]) {
+	r = read (from_rcv[0], buf, sizeof (buf));
+	if (r > 0) {
+	  if (received + r > payload_len
+	      || memcmp (buf, payload + received, r))
+	    mismatch = 1;
+	  received += r;
+	  if (received >= payload_len)
+	    res->us = now_us () - start;
+	}
+	else if (r == 0 || errno != EAGAIN) {
+	  close (from_rcv[0]);
+	  from_rcv[0] = -1;
+	}
+      }
+      else {
+	char *p, *nl;
+	r = read (snd_err[0], buf, sizeof (buf) - 1);
+	if (r == 0 || (r < 0 && errno != EAGAIN)) {
+	  close (snd_err[0]);
+	  snd_err[0] = -1;
+	  continue;
+	}
+	if (r < 0)
+	  continue;
+	for (p = buf; p < buf + r; p = nl + 1) {
+	  size_t len;
+	  nl = memchr (p, '\n', buf + r - p);
+	  len = (nl ? nl : buf + r) - p;
+	  if (linelen + len >= sizeof (line))
+	    len = sizeof (line) - 1 - linelen;
+	  memcpy (line + linelen, p, len);
+	  linelen += len;
+	  if (!nl)
+	    break;
+	  line[linelen] = '\0';
+	  res->retx += parse_retx (line);
+	  linelen = 0;
+	}
+      }
+    }
+
+    /* Everything is in, so the receiver can send its EOF and both close */
+    if (received >= payload_len && to_rcv[1] >= 0) {
+      close (to_rcv[1]);
+      to_rcv[1] = -1;
+    }
+    if (from_rcv[0] < 0 && received < payload_len)
+      break;
+  }
+
+  res->ok = received == payload_len && !mismatch;
+  if (received < payload_len || snd_err[0] >= 0) {
+    kill (snd, SIGKILL);
+    kill (rcv, SIGKILL);
+  }
+  waitpid (snd, NULL, 0);
+  waitpid (rcv, NULL, 0);
+  if (to_snd[1] >= 0)
+    close (to_snd[1]);
+  if (from_rcv[0] >= 0)
+    close (from_rcv[0]);
+  if (to_rcv[1] >= 0)
+    close (to_rcv[1]);
+  if (snd_err[0] >= 0)
+    close (snd_err[0]);
+}
+
+static int
+cmp_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Nearest rank, in milliseconds */
+static double
+percentile (uint64_t *v, int n, int p)
+{
+  int rank = (p * n + 99) / 100;
+  if (!n)
+    return 0;
+  return v[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-p reliable] [-b bytes] [-n runs]"
+	   " [-w windows] [-t timeouts] [-r drops] [-L latencies]"
+	   " [-P port] [-T limit-s] [-- reliable-args]\n"
+	   "  lists are comma separated, e.g. -w 1,8,32 -r 0,1,5\n",
+	   progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  int windows[MAX_VALUES] = { 1, 8, 32 }, nwindows = 3;
+  int timeouts[MAX_VALUES] = { 200 }, ntimeouts = 1;
+  int drops[MAX_VALUES] = { 0, 1, 5 }, ndrops = 3;
+  int latencies[MAX_VALUES] = { 0 }, nlatencies = 1;
+  int runs = 5;
+  int opt, wi, ti, di, li, i, k = 0;
+  long bytes = 1 << 20;
+  struct run *res;
+  uint64_t *times;
+  uint32_t x = 1;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  while ((opt = getopt (argc, argv, "p:b:n:w:t:r:L:P:T:")) != -1)
+    switch (opt) {
+    case 'p':
+      reliable = optarg;
+      break;
+    case 'b':
+      bytes = atol (optarg);
+      break;
+    case 'n':
+      runs = atoi (optarg);
+      break;
+    case 'w':
+      nwindows = parse_list (optarg, windows);
+      break;
+    case 't':
+      ntimeouts = parse_list (optarg, timeouts);
+      break;
+    case 'r':
+      ndrops = parse_list (optarg, drops);
+      break;
+    case 'L':
+      nlatencies = parse_list (optarg, latencies);
+      break;
+    case 'P':
+      base_port = atoi (optarg);
+      break;
+    case 'T':
+      limit_s = atoi (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (bytes < 1 || runs < 1 || limit_s < 1 || base_port < 1
+      || base_port > 65535 - 2000 || nwindows < 1 || ntimeouts < 1
+      || ndrops < 1 || nlatencies < 1)
+    usage ();
+  extra_args = argv + optind;
+  nextra = argc - optind;
+
+  /* Random bytes, so a misplaced packet shows up as a mismatch */
+  payload_len = bytes;
+  payload = malloc (payload_len);
+  for (i = 0; i < bytes; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    payload[i] = x;
+  }
+  res = calloc (runs, sizeof (*res));
+  times = calloc (runs, sizeof (*times));
+  signal (SIGPIPE, SIG_IGN);
+
+  printf ("window,timeout_ms,drop_pct,latency_ms,bytes,runs,failed,"
+	  "goodput_kbps,retx_ratio,p50_ms,p90_ms,p99_ms,max_ms\n");
+  fflush (stdout);
+
+  for (wi = 0; wi < nwindows; wi++)
+    for (ti = 0; ti < ntimeouts; ti++)
+      for (di = 0; di < ndrops; di++)
+	for (li = 0; li < nlatencies; li++) {
+	  uint64_t total_us = 0;
+	  long retx = 0;
+	  int ok = 0;
+	  long pkts = (bytes + PAYLOAD_PER_PKT - 1) / PAYLOAD_PER_PKT;
+
+	  for (i = 0; i < runs; i++) {
+	    run_xfer (windows[wi], timeouts[ti], drops[di], latencies[li],
+		      k++, &res[i]);
+	    retx += res[i].retx;
+	    if (res[i].ok) {
+	      times[ok++] = res[i].us;
+	      total_us += res[i].us;
+	    }
+	  }
+	  qsort (times, ok, sizeof (*times), cmp_u64);
+
+	  printf ("%d,%d,%d,%d,%ld,%d,%d,%.1f,%.4f,%.1f,%.1f,%.1f,%.1f\n",
+		  windows[wi], timeouts[ti], drops[di], latencies[li], bytes,
+		  runs, runs - ok,
+		  total_us ? ok * bytes * 8000.0 / total_us : 0,
+		  (double) retx / (pkts * runs),
+		  percentile (times, ok, 50), percentile (times, ok, 90),
+		  percentile (times, ok, 99),
+		  ok ? times[ok - 1] / 1000.0 : 0);
+	  fflush (stdout);
+	}
+
+  return 0;
+}